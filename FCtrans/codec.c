@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#include "qemu/osdep.h"
+#include "smemv.h"
+#include "codec.h"
+
+#define PAGE_SIZE 4096
+
+/*
+ * what to propose with the compress capability on: LZ4 if built in,
+ * zlib at its fastest level otherwise
+ */
+int page_codec_wanted(void)
+{
+#if defined(CONFIG_LZ4)
+    return PAGE_CODEC_LZ4;
+#else
+    return PAGE_CODEC_ZLIB;
+#endif
+}
+
+/*
+ * returns the compressed size, or -1 if the page does not get smaller
+ * and should go as it is
+ */
+int page_compress(int codec, const void *page, void *out, size_t out_size)
+{
+    uLongf zlen;
+    int len = -1;
+
+    switch (codec) {
+#ifdef CONFIG_LZ4
+    case PAGE_CODEC_LZ4:
+        len = LZ4_compress_default(page, out, PAGE_SIZE, out_size);
+        if (len == 0)
+            len = -1;
+        break;
+#endif
+    case PAGE_CODEC_ZLIB:
+        zlen = out_size;
+        if (compress2(out, &zlen, page, PAGE_SIZE, Z_BEST_SPEED) == Z_OK)
+            len = zlen;
+        break;
+    }
+
+    if (len >= PAGE_SIZE)
+        return -1;
+
+    return len;
+}
+
+/* returns 0 if exactly one page came out */
+int page_decompress(int codec, const void *in, size_t len, void *page)
+{
+    uLongf zlen;
+
+    switch (codec) {
+#ifdef CONFIG_LZ4
+    case PAGE_CODEC_LZ4:
+        if (LZ4_decompress_safe(in, page, len, PAGE_SIZE) == PAGE_SIZE)
+            return 0;
+        break;
+#endif
+    case PAGE_CODEC_ZLIB:
+        zlen = PAGE_SIZE;
+        if (uncompress(page, &zlen, in, len) == Z_OK && zlen == PAGE_SIZE)
+            return 0;
+        break;
+    }
+
+    printf("page_decompress: corrupted page\n");
+
+    return -1;
+}
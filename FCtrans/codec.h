@@ -0,0 +1,17 @@
+#ifndef __CODEC_H_
+#define __CODEC_H_
+
+/* page compression on sub-host connections, agreed on in the HELLO */
+
+#define PAGE_CODEC_NONE 0
+#define PAGE_CODEC_LZ4 1
+#define PAGE_CODEC_ZLIB 2
+
+/* worst case size of one compressed page */
+#define PAGE_CODEC_BOUND (4096 + 4096 / 255 + 64)
+
+int page_codec_wanted(void);
+int page_compress(int codec, const void *page, void *out, size_t out_size);
+int page_decompress(int codec, const void *in, size_t len, void *page);
+
+#endif /* __CODEC_H_ */
@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "evict.h"
+
+#define NR_BUCKETS 256
+#define BUCKET_WORDS (NR_BUCKETS / 64)
+
+#define NIL (-1L)
+
+struct evict_node {
+    long prev;
+    long next;
+    short bucket;  /* -1 if not indexed */
+};
+
+struct evict_index {
+    struct evict_node *nodes;  /* one per chunk */
+    unsigned long nr_chunks;
+    long head[NR_BUCKETS];
+    long tail[NR_BUCKETS];
+    uint64_t nonempty[BUCKET_WORDS];  /* bit per bucket with chunks */
+    QemuMutex lock;  /* fault thread vs. history aging */
+};
+
+/* called at first */
+struct evict_index *evict_index_init(unsigned long nr_chunks)
+{
+    struct evict_index *ei;
+    unsigned long i;
+
+    ei = malloc(sizeof(struct evict_index));
+    if (ei == NULL) {
+        printf("evict_index_init: cannot allocate index\n");
+        return NULL;
+    }
+
+    ei->nodes = malloc(nr_chunks * sizeof(struct evict_node));
+    if (ei->nodes == NULL) {
+        printf("evict_index_init: cannot allocate nodes\n");
+        free(ei);
+        return NULL;
+    }
+
+    for (i = 0; i < nr_chunks; i++) {
+        ei->nodes[i].prev = NIL;
+        ei->nodes[i].next = NIL;
+        ei->nodes[i].bucket = -1;
+    }
+
+    for (i = 0; i < NR_BUCKETS; i++) {
+        ei->head[i] = NIL;
+        ei->tail[i] = NIL;
+    }
+
+    memset(ei->nonempty, 0, sizeof(ei->nonempty));
+
+    ei->nr_chunks = nr_chunks;
+    qemu_mutex_init(&ei->lock);
+
+    return ei;
+}
+
+void evict_index_free(struct evict_index *ei)
+{
+    if (ei == NULL)
+        return;
+
+    qemu_mutex_destroy(&ei->lock);
+    free(ei->nodes);
+    free(ei);
+}
+
+static void unlink_node(struct evict_index *ei, unsigned long chunk)
+{
+    struct evict_node *node = &ei->nodes[chunk];
+    int b = node->bucket;
+
+    if (node->prev != NIL)
+        ei->nodes[node->prev].next = node->next;
+    else
+        ei->head[b] = node->next;
+
+    if (node->next != NIL)
+        ei->nodes[node->next].prev = node->prev;
+    else
+        ei->tail[b] = node->prev;
+
+    if (ei->head[b] == NIL)
+        ei->nonempty[b / 64] &= ~(1ULL << (b % 64));
+
+    node->prev = NIL;
+    node->next = NIL;
+    node->bucket = -1;
+}
+
+static void link_node(struct evict_index *ei, unsigned long chunk, int b)
+{
+    struct evict_node *node = &ei->nodes[chunk];
+
+    node->bucket = b;
+    node->prev = ei->tail[b];
+    node->next = NIL;
+
+    if (ei->tail[b] != NIL)
+        ei->nodes[ei->tail[b]].next = chunk;
+    else
+        ei->head[b] = chunk;
+
+    ei->tail[b] = chunk;
+    ei->nonempty[b / 64] |= 1ULL << (b % 64);
+}
+
+/* index a main-host chunk, or move it to the bucket of its new hotness */
+void evict_index_update(struct evict_index *ei, unsigned long chunk,
+                        unsigned int hotness)
+{
+    if (ei == NULL || chunk >= ei->nr_chunks)
+        return;
+
+    if (hotness >= NR_BUCKETS)
+        hotness = NR_BUCKETS - 1;
+
+    qemu_mutex_lock(&ei->lock);
+
+    if (ei->nodes[chunk].bucket != (short)hotness) {
+        if (ei->nodes[chunk].bucket != -1)
+            unlink_node(ei, chunk);
+        link_node(ei, chunk, hotness);
+    }
+
+    qemu_mutex_unlock(&ei->lock);
+}
+
+/* move an indexed chunk to the bucket of its new hotness */
+void evict_index_refresh(struct evict_index *ei, unsigned long chunk,
+                         unsigned int hotness)
+{
+    if (ei == NULL || chunk >= ei->nr_chunks)
+        return;
+
+    if (hotness >= NR_BUCKETS)
+        hotness = NR_BUCKETS - 1;
+
+    qemu_mutex_lock(&ei->lock);
+
+    if (ei->nodes[chunk].bucket != -1 &&
+        ei->nodes[chunk].bucket != (short)hotness) {
+        unlink_node(ei, chunk);
+        link_node(ei, chunk, hotness);
+    }
+
+    qemu_mutex_unlock(&ei->lock);
+}
+
+/* drop a chunk that left the main host */
+void evict_index_remove(struct evict_index *ei, unsigned long chunk)
+{
+    if (ei == NULL || chunk >= ei->nr_chunks)
+        return;
+
+    qemu_mutex_lock(&ei->lock);
+
+    if (ei->nodes[chunk].bucket != -1)
+        unlink_node(ei, chunk);
+
+    qemu_mutex_unlock(&ei->lock);
+}
+
+/* return 1 if the chunk is an eviction candidate */
+int evict_index_contains(struct evict_index *ei, unsigned long chunk)
+{
+    if (ei == NULL || chunk >= ei->nr_chunks)
+        return 0;
+
+    return ei->nodes[chunk].bucket != -1;
+}
+
+/*
+ * Remove and return the coldest chunk other than exclude, EVICT_NONE if
+ * none.  Taking it under the lock keeps two reclaimers off one chunk.
+ */
+long evict_index_take_coldest(struct evict_index *ei, unsigned long exclude)
+{
+    uint64_t word;
+    long chunk = EVICT_NONE;
+    int i, b;
+
+    if (ei == NULL)
+        return EVICT_NONE;
+
+    qemu_mutex_lock(&ei->lock);
+
+    for (i = 0; i < BUCKET_WORDS && chunk == EVICT_NONE; i++) {
+        word = ei->nonempty[i];
+
+        while (word) {
+            b = i * 64 + __builtin_ctzll(word);
+
+            chunk = ei->head[b];
+            if (chunk == exclude)
+                chunk = ei->nodes[chunk].next;
+            if (chunk != NIL)
+                break;
+
+            chunk = EVICT_NONE;
+            word &= word - 1;
+        }
+    }
+
+    if (chunk != EVICT_NONE)
+        unlink_node(ei, chunk);
+
+    qemu_mutex_unlock(&ei->lock);
+
+    return chunk;
+}
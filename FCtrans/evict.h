@@ -0,0 +1,22 @@
+#ifndef __EVICT_H_
+#define __EVICT_H_
+
+/*
+ * Eviction candidates: main-host chunks bucketed by hotness, the OR of
+ * the access history of their pages (0-255).
+ */
+struct evict_index;
+
+#define EVICT_NONE (-1L)
+
+struct evict_index *evict_index_init(unsigned long nr_chunks);
+void evict_index_free(struct evict_index *ei);
+void evict_index_update(struct evict_index *ei, unsigned long chunk,
+                        unsigned int hotness);
+void evict_index_refresh(struct evict_index *ei, unsigned long chunk,
+                         unsigned int hotness);
+void evict_index_remove(struct evict_index *ei, unsigned long chunk);
+int evict_index_contains(struct evict_index *ei, unsigned long chunk);
+long evict_index_take_coldest(struct evict_index *ei, unsigned long exclude);
+
+#endif /* __EVICT_H_ */
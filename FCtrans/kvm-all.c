@@ -2008,6 +2008,7 @@ int kvm_cpu_exec(CPUState *cpu)
                     accessed = test_bit(pfn, data.bitmap);
                     history[pfn] = (accessed << 7) | (history[pfn] >> 1);
                 }
+                paging_history_aged();
 
                 last_time = current_time;
             }
@@ -0,0 +1,218 @@
+#!/usr/bin/env python3
+#
+# Round trip against a memserver on localhost: HELLO, VM, MEM_SIZE,
+# STORE and SYNC on a migration connection, then FETCH on a paging
+# connection, checking the DATA records and contents.  Then RELEASE,
+# after which the pages are gone and the slot of the VM is reused.
+#
+#   memserver-test.py ./memserver
+
+import os
+import socket
+import struct
+import subprocess
+import sys
+import time
+
+PAGE = 4096
+
+FRAME = struct.Struct('=IHHII')  # len, type, flags, nr, csum
+HELLO = struct.Struct('=IHHII2Q')  # magic, version, role, caps, codec, key
+PAGE_REC = struct.Struct('=QII')  # addr, len, version
+
+MAGIC = 0x5652534d
+
+F_HELLO, F_MEM_SIZE, F_STORE, F_FETCH, F_DATA = 1, 2, 3, 4, 5
+F_SYNC, F_VM, F_RELEASE = 8, 11, 15
+
+ROLE_MIGRATION, ROLE_PAGING = 1, 2
+
+CAP_BATCH, CAP_ZERO, CAP_TENANT, CAP_RELEASE = 0x1, 0x4, 0x80, 0x400
+
+MAX_VMS = 64  # MS_MAX_VMS
+
+ADDR_ZERO, ADDR_COMP, ADDR_NONE = 0x1, 0x2, 0x4
+
+
+def fail(msg):
+    print('memserver-test: ' + msg)
+    sys.exit(1)
+
+
+def recv_all(sock, n):
+    buf = b''
+    while len(buf) < n:
+        part = sock.recv(n - len(buf))
+        if not part:
+            fail('connection closed by memserver')
+        buf += part
+    return buf
+
+
+def send_frame(sock, ftype, payload=b'', nr=0):
+    sock.sendall(FRAME.pack(len(payload), ftype, 0, nr, 0) + payload)
+
+
+def recv_frame(sock):
+    length, ftype, flags, nr, csum = FRAME.unpack(recv_all(sock, FRAME.size))
+    return ftype, nr, recv_all(sock, length)
+
+
+def connect(port, role, uuid):
+    sock = socket.create_connection(('127.0.0.1', port))
+    caps = CAP_BATCH | CAP_ZERO | CAP_TENANT | CAP_RELEASE
+    send_frame(sock, F_HELLO, HELLO.pack(MAGIC, 1, role, caps, 0, 0, 0))
+
+    ftype, nr, payload = recv_frame(sock)
+    if ftype != F_HELLO or len(payload) != HELLO.size:
+        fail('no HELLO')
+    magic, version, _, agreed, codec, _, _ = HELLO.unpack(payload)
+    if magic != MAGIC or version != 1 or agreed != caps or codec != 0:
+        fail('HELLO: version %d caps 0x%x codec %d' % (version, agreed, codec))
+
+    send_frame(sock, F_VM, uuid)
+    return sock
+
+
+def sync(sock):
+    send_frame(sock, F_SYNC)
+    ftype, nr, payload = recv_frame(sock)
+    if ftype != F_SYNC or payload:
+        fail('no SYNC, frame type %d' % ftype)
+
+
+def round_trip(port):
+    uuid = os.urandom(16)
+    pages = {
+        0: os.urandom(PAGE),
+        1: None,  # zero page
+        5: (b'memserver round trip ' * 200)[:PAGE],
+    }
+    pages[3] = pages[0]  # shared with page 0
+
+    mig = connect(port, ROLE_MIGRATION, uuid)
+    send_frame(mig, F_MEM_SIZE, struct.pack('=Q', 16 << 20))
+
+    recs, data = b'', b''
+    for pfn, page in pages.items():
+        if page is None:
+            recs += PAGE_REC.pack(pfn * PAGE | ADDR_ZERO, 0, 0)
+        else:
+            recs += PAGE_REC.pack(pfn * PAGE, PAGE, 0)
+            data += page
+    send_frame(mig, F_STORE, recs + data, len(pages))
+    sync(mig)
+
+    # a page never stored comes back as NONE
+    fetch = [0, 1, 3, 5, 7]
+    pag = connect(port, ROLE_PAGING, uuid)
+    send_frame(pag, F_FETCH,
+               b''.join(struct.pack('=Q', pfn * PAGE) for pfn in fetch),
+               len(fetch))
+
+    ftype, nr, payload = recv_frame(pag)
+    if ftype != F_DATA or nr != len(fetch):
+        fail('DATA: frame type %d, %d records' % (ftype, nr))
+
+    off = nr * PAGE_REC.size
+    for i, pfn in enumerate(fetch):
+        addr, length, _ = PAGE_REC.unpack_from(payload, i * PAGE_REC.size)
+        if addr & ~(PAGE - 1) != pfn * PAGE:
+            fail('DATA: record %d for 0x%x' % (i, addr))
+        flags = addr & (PAGE - 1)
+        if pfn == 7:
+            ok = flags == ADDR_NONE and length == 0
+        elif pages[pfn] is None:
+            ok = flags == ADDR_ZERO and length == 0
+        else:
+            ok = flags == 0 and length == PAGE and \
+                payload[off:off + PAGE] == pages[pfn]
+        if not ok:
+            fail('DATA: page %d, flags 0x%x len %d' % (pfn, flags, length))
+        off += length
+    if off != len(payload):
+        fail('DATA: %d bytes left over' % (len(payload) - off))
+
+    send_frame(pag, F_RELEASE)
+    sync(pag)
+    pag.close()
+    mig.close()
+
+    return uuid
+
+
+def released(port, uuid):
+    # dropped with the last connection, a VM of the same UUID is new
+    time.sleep(0.2)
+    sock = connect(port, ROLE_PAGING, uuid)
+    send_frame(sock, F_FETCH, struct.pack('=Q', 0), 1)
+    ftype, nr, payload = recv_frame(sock)
+    addr, length, _ = PAGE_REC.unpack_from(payload, 0)
+    if ftype != F_DATA or nr != 1 or addr != ADDR_NONE:
+        fail('a released VM kept its pages')
+    send_frame(sock, F_RELEASE)
+    sync(sock)
+    sock.close()
+
+    # more VMs than slots, one after the other
+    for _ in range(MAX_VMS + 8):
+        sock = connect(port, ROLE_MIGRATION, os.urandom(16))
+        send_frame(sock, F_MEM_SIZE, struct.pack('=Q', 16 << 20))
+        send_frame(sock, F_RELEASE)
+        sync(sock)
+        sock.close()
+
+
+def nil_vm_refused(port):
+    sock = connect(port, ROLE_MIGRATION, bytes(16))
+    send_frame(sock, F_SYNC)
+    if sock.recv(1):
+        fail('a connection for the nil VM is served')
+    sock.close()
+
+
+def free_port():
+    sock = socket.socket()
+    sock.bind(('127.0.0.1', 0))
+    port = sock.getsockname()[1]
+    sock.close()
+    return port
+
+
+def run(memserver, args):
+    port = free_port()
+    proc = subprocess.Popen([memserver, '-p', str(port), '-t', '1'] + args,
+                            stdout=subprocess.DEVNULL)
+    try:
+        for _ in range(100):
+            try:
+                socket.create_connection(('127.0.0.1', port)).close()
+                break
+            except OSError:
+                if proc.poll() is not None:
+                    fail('memserver exited with %d' % proc.returncode)
+                time.sleep(0.05)
+        else:
+            fail('memserver does not listen on port %d' % port)
+
+        uuid = round_trip(port)
+        released(port, uuid)
+        nil_vm_refused(port)
+    finally:
+        proc.kill()
+        proc.wait()
+
+
+def main():
+    if len(sys.argv) != 2:
+        print('usage: memserver-test.py memserver')
+        sys.exit(2)
+
+    # pages kept compressed, then as they are
+    run(sys.argv[1], [])
+    run(sys.argv[1], ['-r'])
+    print('memserver-test: ok')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,1805 @@
+/*
+ * Memory server of a sub-host.
+ *
+ * Keeps the pages of VMs sent by split migration and page-out, and
+ * sends them back on page-in, speaking the protocol of memsrv.h on
+ * MEMSRV_PORT.  Pages are kept compressed, identical pages once, and
+ * cold pages may go to a spill file, see memstore.c.  A page is kept
+ * until it is stored again:
+ * fetching does not drop it, a chunk paged in and left unmodified is
+ * dropped by QEMU without being written back.
+ *
+ * Connections are spread over worker threads, each running its own
+ * epoll loop.  Frames of one connection are handled in order by its
+ * worker: a FETCH of spilled pages holds back the frames after it until
+ * they are read.
+ *
+ * Each VM is charged for its pages as they are kept.  Every STORED
+ * tells its clients how much room the VM has left, past its quota they
+ * are asked to page out elsewhere.  A worker handles the
+ * frames up to a STORE at once, the STOREs of its connections one at a
+ * time by weighted fair queuing between their VMs, so a page-out burst
+ * of one VM delays the page-ins of the others by one frame at most.
+ *
+ * The fetches of a paging client with a push connection are watched
+ * for a stride between chunks, see struct ms_session, and the chunks
+ * ahead on it are pushed before they are faulted.
+ *
+ * A MOVE is handed to the mover thread, which stores the pages on the
+ * other server over a connection of its own, as they are kept here,
+ * and the worker answers MOVED once they are acknowledged there.
+ *
+ *   memserver [-p port] [-t threads] [-r] [-d spill-file [-m dram-mb]]
+ *             [-q quota-mb] [-v uuid:quota-mb:weight]...
+ *
+ *   -r  keep pages uncompressed
+ *   -d  spill cold pages to this file, on a local NVMe drive
+ *   -m  DRAM for pages before spilling, 3/4 of the RAM by default
+ *   -q  quota of each VM, none by default
+ *   -v  quota and weight (1 by default) of one VM
+ *
+ * Built by the Makefile here from memserver.c, memstore.c, memsrv.c
+ * and codec.c against a built QEMU tree, linked with zlib.  "make
+ * check" runs memserver-test.py, a round trip on localhost.  For a
+ * test with QEMU on one machine, point SUBHOST1 in ram.c at 127.0.0.1.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/bitops.h"
+#include "smemv.h"
+#include "memsrv.h"
+#include "codec.h"
+#include "memstore.h"
+
+#define MS_PAGE_SIZE MEMSRV_PAGE_SIZE
+#define MS_MAX_EVENTS 64  /* events handled per epoll_wait() */
+#define MS_DEF_WORKERS 4
+#define MS_MAX_WORKERS 64
+#define MS_RX_BUF_SIZE (2 * MEMSRV_MAX_FRAME)
+#define MS_TX_HIGH (16 << 20)  /* stop reading while more is unsent */
+
+#define MS_MAX_VMS 64
+
+#define MS_PUSH_DEPTH 8  /* chunks pushed ahead of the last fetch */
+#define MS_PUSH_MAX_STRIDE 16  /* in chunks */
+#define MS_PUSH_HIGH (4 << 20)  /* stop pushing while more is unsent */
+
+/* what a mover asks of the server it moves pages to */
+#define MS_MOVE_CAPS (MEMSRV_CAP_BATCH | MEMSRV_CAP_COMPRESS | \
+                      MEMSRV_CAP_ZERO | MEMSRV_CAP_ACK | MEMSRV_CAP_TENANT)
+
+#define MS_CAPS MEMSRV_CAPS
+
+#ifdef CONFIG_LZ4
+#define MS_STORE_CODEC PAGE_CODEC_LZ4
+#else
+#define MS_STORE_CODEC PAGE_CODEC_ZLIB
+#endif
+
+/*
+ * Pages of a VM, shared by all its connections.  Kept until the VM is
+ * released and its last connection is gone, then its pages are dropped
+ * and its slot goes to the next VM.
+ */
+struct ms_vm {
+    uint8_t uuid[16];
+    int idx;  /* in vms[] */
+    uint64_t gen;  /* tells apart the VMs of a slot */
+    int refs;  /* connections, under vms_lock */
+    bool released;  /* by RELEASE, not found any more */
+    QemuMutex lock;  /* sizing */
+    uint64_t *handles;  /* memstore.h handles by pfn, set last */
+    unsigned long size;
+    unsigned long nr_pages;
+    unsigned long nr_shared;  /* pages stored as a reference */
+    uint32_t *chunk_ver;  /* bumped by each page stored into a chunk */
+    unsigned long nr_chunks;
+
+    int64_t used;  /* bytes of its pages as kept, shared ones in full */
+    uint64_t quota;  /* 0 if none */
+    bool full;  /* over the quota, for the log */
+    int weight;  /* share of the workers for its STOREs */
+};
+
+/*
+ * Connections of a paging client.  Once two fetches in a row are the
+ * same stride of chunks apart, the next MS_PUSH_DEPTH chunks along it
+ * are queued for its push connection, and kept that far ahead by the
+ * fetches that follow the stride past the pushed chunks.
+ */
+struct ms_session {
+    uint64_t id;
+    int refs;  /* connections */
+    QemuMutex lock;
+    struct ms_conn *push;  /* NULL if none */
+    long last;  /* chunk of the last fetch */
+    long stride;  /* 0 if none */
+    bool streaming;  /* on the stride */
+    long pushed;  /* last chunk queued */
+    long queue[MS_PUSH_DEPTH];  /* chunks to push */
+    int nr_queued;
+    struct ms_session *next;
+};
+
+struct ms_conn {
+    int sock;
+    struct ms_worker *worker;
+    bool hello;  /* handshake done */
+    int role;  /* MEMSRV_ROLE_* */
+    uint32_t caps;  /* agreed on */
+    int codec;
+    struct ms_vm *vm;  /* NULL until the first frame after the HELLO */
+    struct ms_session *session;  /* NULL if none */
+
+    char *rx_buf;
+    size_t rx_len;
+
+    char *tx_buf;
+    size_t tx_off;  /* sent up to here */
+    size_t tx_len;
+    size_t tx_size;
+    uint32_t events;  /* registered in epoll */
+
+    /* pages of the last FETCH being read from the spill file */
+    int pending_reads;
+    size_t tx_hold;  /* its DATA frames, not sent until they are read */
+    bool read_error;
+    int pending_moves;  /* MOVEs not answered yet */
+    bool closing;  /* freed once the reads and moves are done */
+
+    bool kicked;  /* in the kicked list of its worker */
+    QSIMPLEQ_ENTRY(ms_conn) kick_next;
+
+    bool queued;  /* a STORE at the head of rx_buf, in stores of its worker */
+    QTAILQ_ENTRY(ms_conn) store_next;
+};
+
+/* a spilled page being read into a DATA frame */
+struct ms_read {
+    struct memstore_read rd;
+    struct ms_conn *c;
+    size_t pos;  /* of the payload in tx_buf */
+    bool inflate;  /* to be sent uncompressed */
+    QSIMPLEQ_ENTRY(ms_read) next;
+    char buf[MS_PAGE_SIZE];
+};
+
+/* pages of a VM going to another memory server, see mover_thread() */
+struct ms_move {
+    struct ms_conn *c;  /* asked for it */
+    struct ms_vm *vm;
+    struct sockaddr_in dest;
+    uint64_t *addrs;
+    uint32_t nr;
+    uint32_t stored;  /* by dest */
+    QSIMPLEQ_ENTRY(ms_move) next;
+};
+
+struct ms_worker {
+    int epfd;
+    int evfd;  /* reads or moves are done, or pushes are due */
+    QemuMutex lock;
+    QSIMPLEQ_HEAD(, ms_read) done;
+    QSIMPLEQ_HEAD(, ms_move) moved;
+    QSIMPLEQ_HEAD(, ms_conn) kicked;  /* push connections with chunks */
+    QemuThread thread;
+
+    /*
+     * Start-time fair queuing: a STORE advances the virtual time of its
+     * VM by its length over the weight, the VM furthest behind goes
+     * next.  A VM coming back starts at the time of the last one.
+     */
+    QTAILQ_HEAD(, ms_conn) stores;
+    uint64_t vtime[MS_MAX_VMS];
+    uint64_t vtime_gen[MS_MAX_VMS];  /* of the VM vtime is for */
+    uint64_t vclock;
+};
+
+/* quota and weight given with -v */
+struct ms_vm_conf {
+    uint8_t uuid[16];
+    uint64_t quota;
+    int weight;
+};
+
+static QemuMutex vms_lock;
+static struct ms_vm *vms[MS_MAX_VMS];  /* NULL where free */
+static uint64_t vm_gen;
+static struct ms_vm_conf vm_confs[MS_MAX_VMS];
+static int nr_vm_confs;
+static uint64_t vm_quota;  /* of VMs not given one */
+static uint64_t hash_key[2];
+static QemuMutex sessions_lock;
+static struct ms_session *sessions;
+static struct ms_worker workers[MS_MAX_WORKERS];
+static int nr_workers = MS_DEF_WORKERS;
+static QemuMutex moves_lock;
+static QemuCond moves_cond;
+static QSIMPLEQ_HEAD(, ms_move) moves = QSIMPLEQ_HEAD_INITIALIZER(moves);
+
+/* a reference on the VM with this UUID, added on first use */
+static struct ms_vm *vm_get(const uint8_t uuid[16])
+{
+    struct ms_vm *vm = NULL;
+    int i, free_idx = -1;
+
+    qemu_mutex_lock(&vms_lock);
+
+    for (i = 0; i < MS_MAX_VMS; i++) {
+        if (vms[i] == NULL) {
+            if (free_idx < 0)
+                free_idx = i;
+        } else if (!vms[i]->released &&
+                   memcmp(vms[i]->uuid, uuid, sizeof(vms[i]->uuid)) == 0) {
+            vm = vms[i];
+            vm->refs++;
+            goto out;
+        }
+    }
+
+    if (free_idx < 0) {
+        printf("memserver: too many VMs\n");
+        goto out;
+    }
+
+    vm = g_new0(struct ms_vm, 1);
+    memcpy(vm->uuid, uuid, sizeof(vm->uuid));
+    vm->idx = free_idx;
+    vm->gen = ++vm_gen;
+    vm->refs = 1;
+    qemu_mutex_init(&vm->lock);
+    vm->quota = vm_quota;
+    vm->weight = 1;
+    for (i = 0; i < nr_vm_confs; i++) {
+        if (memcmp(vm_confs[i].uuid, uuid, sizeof(vm->uuid)) == 0) {
+            vm->quota = vm_confs[i].quota;
+            vm->weight = vm_confs[i].weight;
+        }
+    }
+    vms[free_idx] = vm;
+
+out:
+    qemu_mutex_unlock(&vms_lock);
+
+    return vm;
+}
+
+/* drop the pages of a VM nobody uses any more */
+static void vm_free(struct ms_vm *vm)
+{
+    unsigned long pfn;
+
+    if (vm->handles) {
+        for (pfn = 0; pfn < vm->nr_pages; pfn++)
+            memstore_put(vm->handles[pfn]);
+        munmap(vm->handles, vm->nr_pages * sizeof(vm->handles[0]));
+    }
+
+    printf("memserver: VM %d released\n", vm->idx);
+
+    g_free(vm->chunk_ver);
+    qemu_mutex_destroy(&vm->lock);
+    g_free(vm);
+}
+
+/* drop a reference, the last one of a released VM frees it */
+static void vm_put(struct ms_vm *vm)
+{
+    bool gone;
+
+    qemu_mutex_lock(&vms_lock);
+    gone = --vm->refs == 0 && vm->released;
+    if (gone)
+        vms[vm->idx] = NULL;
+    qemu_mutex_unlock(&vms_lock);
+
+    if (gone)
+        vm_free(vm);
+}
+
+/* RELEASE: the client is done with the VM */
+static void vm_release(struct ms_vm *vm)
+{
+    qemu_mutex_lock(&vms_lock);
+    vm->released = true;
+    qemu_mutex_unlock(&vms_lock);
+}
+
+static bool uuid_is_nil(const uint8_t uuid[16])
+{
+    static const uint8_t nil[16];
+
+    return memcmp(uuid, nil, sizeof(nil)) == 0;
+}
+
+/*
+ * The VM of a connection, which must have named one: pages of VMs
+ * without a UUID of their own would all end up in the same place.
+ */
+static struct ms_vm *conn_vm(struct ms_conn *c)
+{
+    if (c->vm == NULL)
+        printf("memserver: no VM named\n");
+
+    return c->vm;
+}
+
+/* bytes a page handle is charged for */
+static uint32_t page_bytes(uint64_t h)
+{
+    return h > MEMSTORE_H_ZERO ? memstore_len(h) : 0;
+}
+
+/* point a page at h, which holds a reference for it */
+static void store_page(struct ms_vm *vm, unsigned long pfn, uint64_t h)
+{
+    uint64_t old = atomic_xchg(&vm->handles[pfn], h);
+
+    atomic_add(&vm->used, (int64_t)page_bytes(h) - page_bytes(old));
+    memstore_put(old);
+}
+
+/* size the pages of a VM on the first MEM_SIZE, later ones must fit */
+static int store_init(struct ms_vm *vm, unsigned long size)
+{
+    unsigned long nr_pages = DIV_ROUND_UP(size, MS_PAGE_SIZE);
+    uint64_t *handles;
+    int ret = 0;
+
+    qemu_mutex_lock(&vm->lock);
+
+    if (vm->handles) {
+        if (size > vm->size) {
+            printf("memserver: memory size %lu over %lu\n", size, vm->size);
+            ret = -1;
+        }
+        goto out;
+    }
+
+    /* only touched where pages are stored */
+    handles = mmap(NULL, nr_pages * sizeof(handles[0]),
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (handles == MAP_FAILED) {
+        perror("memserver: mmap");
+        ret = -1;
+        goto out;
+    }
+
+    vm->size = nr_pages * MS_PAGE_SIZE;
+    vm->nr_pages = nr_pages;
+    vm->nr_chunks = DIV_ROUND_UP(nr_pages, MEMSRV_CHUNK_PAGES);
+    vm->chunk_ver = g_new0(uint32_t, vm->nr_chunks);
+    atomic_mb_set(&vm->handles, handles);
+
+    printf("memserver: VM %d, %lu MB of guest memory\n", vm->idx, size >> 20);
+
+out:
+    qemu_mutex_unlock(&vm->lock);
+
+    return ret;
+}
+
+/* room for len more bytes at the tail of the send queue */
+static char *tx_reserve(struct ms_conn *c, size_t len)
+{
+    char *p;
+
+    if (c->tx_len + len > c->tx_size) {
+        c->tx_size = MAX(c->tx_size * 2, c->tx_len + len);
+        c->tx_buf = g_realloc(c->tx_buf, c->tx_size);
+    }
+
+    p = c->tx_buf + c->tx_len;
+    c->tx_len += len;
+
+    return p;
+}
+
+static void conn_set_events(struct ms_conn *c, uint32_t events)
+{
+    struct epoll_event ev;
+
+    if (c->events == events)
+        return;
+
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(c->worker->epfd, EPOLL_CTL_MOD, c->sock, &ev))
+        perror("memserver: epoll_ctl");
+
+    c->events = events;
+}
+
+/* send what the socket takes, wait for EPOLLOUT for the rest */
+static void push_run(struct ms_conn *c);
+
+static int conn_flush(struct ms_conn *c)
+{
+    uint32_t events = 0;
+    ssize_t ret;
+    size_t end;
+
+    if (c->role == MEMSRV_ROLE_PUSH && c->session)
+        push_run(c);
+
+    end = c->pending_reads ? c->tx_hold : c->tx_len;
+
+    while (c->tx_off < end) {
+        ret = send(c->sock, c->tx_buf + c->tx_off, end - c->tx_off,
+                   MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            perror("memserver: send");
+            return -1;
+        }
+        c->tx_off += ret;
+    }
+
+    if (c->tx_off == c->tx_len)
+        c->tx_off = c->tx_len = 0;
+
+    if (c->tx_off < end)
+        events |= EPOLLOUT;
+    /* a slow reader must not make us buffer without a bound */
+    if (!c->pending_reads && !c->queued && c->tx_len - c->tx_off < MS_TX_HIGH)
+        events |= EPOLLIN;
+    conn_set_events(c, events);
+
+    return 0;
+}
+
+static void conn_queue_frame(struct ms_conn *c, int type, uint32_t nr,
+                             const void *payload, uint32_t len)
+{
+    struct memsrv_frame frame;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.len = len;
+    frame.type = type;
+    frame.nr = nr;
+
+    memcpy(tx_reserve(c, sizeof(frame)), &frame, sizeof(frame));
+    if (len)
+        memcpy(tx_reserve(c, len), payload, len);
+}
+
+static int handle_hello(struct ms_conn *c, const struct memsrv_frame *f,
+                        const char *payload)
+{
+    struct memsrv_hello hello;
+
+    if (f->len != sizeof(hello)) {
+        printf("memserver: bad HELLO\n");
+        return -1;
+    }
+    memcpy(&hello, payload, sizeof(hello));
+
+    if (hello.magic != MEMSRV_MAGIC || hello.version == 0) {
+        printf("memserver: not a memory server client\n");
+        return -1;
+    }
+
+    c->role = hello.role;
+    c->caps = hello.caps & MS_CAPS;
+    c->codec = hello.codec;
+
+    /* the codecs built in here, anything else goes uncompressed */
+    switch (c->codec) {
+#ifdef CONFIG_LZ4
+    case PAGE_CODEC_LZ4:
+#endif
+    case PAGE_CODEC_ZLIB:
+        break;
+    default:
+        c->codec = PAGE_CODEC_NONE;
+    }
+    if (c->codec == PAGE_CODEC_NONE)
+        c->caps &= ~MEMSRV_CAP_COMPRESS;
+    if (!(c->caps & MEMSRV_CAP_COMPRESS))
+        c->codec = PAGE_CODEC_NONE;
+
+    hello.magic = MEMSRV_MAGIC;
+    hello.version = MIN(hello.version, MEMSRV_VERSION);
+    hello.caps = c->caps;
+    hello.codec = c->codec;
+    memcpy(hello.hash_key, hash_key, sizeof(hello.hash_key));
+    conn_queue_frame(c, MEMSRV_FRAME_HELLO, 0, &hello, sizeof(hello));
+
+    c->hello = true;
+
+    return 0;
+}
+
+/* the page of a record, in the form it is kept */
+static uint64_t store_record(struct ms_conn *c, struct memsrv_page *desc,
+                             const char *data)
+{
+    char page[MS_PAGE_SIZE];
+    char cbuf[PAGE_CODEC_BOUND];
+    uint64_t digest[2];
+    const char *raw = data;
+    uint64_t h;
+    int clen;
+
+    if (desc->addr & MEMSRV_ADDR_COMP) {
+        if (desc->len == 0 || desc->len >= MS_PAGE_SIZE ||
+            page_decompress(c->codec, data, desc->len, page))
+            return 0;
+        raw = page;
+    } else if (desc->len != MS_PAGE_SIZE) {
+        printf("memserver: bad page length %u\n", desc->len);
+        return 0;
+    }
+
+    /* shared only with an object of the same bytes */
+    memsrv_page_hash(hash_key, raw, digest);
+    h = memstore_lookup(digest, raw);
+    if (h) {
+        atomic_inc(&c->vm->nr_shared);
+        return h;
+    }
+
+    /* already in the form we keep */
+    if ((desc->addr & MEMSRV_ADDR_COMP) && c->codec == memstore_codec())
+        return memstore_add(digest, data, desc->len, raw);
+
+    clen = -1;
+    if (memstore_codec() != PAGE_CODEC_NONE)
+        clen = page_compress(memstore_codec(), raw, cbuf, sizeof(cbuf));
+
+    if (clen > 0)
+        return memstore_add(digest, cbuf, clen, raw);
+
+    return memstore_add(digest, raw, MS_PAGE_SIZE, raw);
+}
+
+/* acknowledge a STORE whose last record went to chunk last, if any */
+static void queue_stored(struct ms_conn *c, uint32_t nr, long last)
+{
+    struct ms_vm *vm = c->vm;
+    struct memsrv_frame frame;
+    uint32_t version;
+    uint64_t room = UINT64_MAX;
+    int64_t used;
+    bool full;
+
+    used = atomic_read(&vm->used);
+    full = vm->quota && used > (int64_t)vm->quota;
+    if (full != vm->full) {
+        vm->full = full;
+        printf("memserver: VM %d %s its quota\n", vm->idx,
+               full ? "over" : "back under");
+    }
+
+    /* only a paging client reads the acknowledgements */
+    if (!(c->caps & MEMSRV_CAP_ACK))
+        return;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.type = MEMSRV_FRAME_STORED;
+    frame.nr = nr;
+    if (full && (c->caps & MEMSRV_CAP_TENANT))
+        frame.flags |= MEMSRV_FRAME_FULL;
+    if ((c->caps & MEMSRV_CAP_PUSH) && last >= 0)
+        frame.len += sizeof(version);
+    if (c->caps & MEMSRV_CAP_ROOM)
+        frame.len += sizeof(room);
+
+    memcpy(tx_reserve(c, sizeof(frame)), &frame, sizeof(frame));
+    if ((c->caps & MEMSRV_CAP_PUSH) && last >= 0) {
+        version = atomic_mb_read(&vm->chunk_ver[last]);
+        memcpy(tx_reserve(c, sizeof(version)), &version, sizeof(version));
+    }
+    if (c->caps & MEMSRV_CAP_ROOM) {
+        if (vm->quota)
+            room = full ? 0 : vm->quota - used;
+        memcpy(tx_reserve(c, sizeof(room)), &room, sizeof(room));
+    }
+}
+
+/* page records of a STORE frame */
+static int handle_store(struct ms_conn *c, const struct memsrv_frame *f,
+                        char *payload)
+{
+    char *data = payload + f->nr * sizeof(struct memsrv_page);
+    char *end = payload + f->len;
+    struct ms_vm *vm = c->vm;
+    struct memsrv_page desc;
+    struct memsrv_frame *missing;
+    uint64_t digest[2], addr;
+    size_t head;
+    unsigned long pfn;
+    long last = -1;
+    uint32_t i, nr_missing = 0;
+    uint64_t h;
+
+    if (atomic_mb_read(&vm->handles) == NULL) {
+        printf("memserver: STORE before MEM_SIZE\n");
+        return -1;
+    }
+
+    /* addresses to send again, dropped if there are none */
+    head = c->tx_len;
+    tx_reserve(c, sizeof(*missing));
+
+    for (i = 0; i < f->nr; i++, data += desc.len) {
+        memcpy(&desc, payload + i * sizeof(desc), sizeof(desc));
+        addr = desc.addr & ~MEMSRV_ADDR_FLAGS;
+        pfn = addr / MS_PAGE_SIZE;
+
+        if (desc.len > end - data || pfn >= vm->nr_pages) {
+            printf("memserver: bad page record %lx\n",
+                   (unsigned long)desc.addr);
+            return -1;
+        }
+
+        if (desc.addr & MEMSRV_ADDR_ZERO) {
+            h = MEMSTORE_H_ZERO;
+        } else if (desc.addr & MEMSRV_ADDR_HASH) {
+            if (desc.len != sizeof(digest))
+                return -1;
+            memcpy(digest, data, sizeof(digest));
+
+            /* no bytes to compare, the client vouches for them */
+            h = memstore_lookup(digest, NULL);
+            if (h == 0) {
+                memcpy(tx_reserve(c, sizeof(addr)), &addr, sizeof(addr));
+                nr_missing++;
+                continue;
+            }
+            atomic_inc(&vm->nr_shared);
+        } else {
+            h = store_record(c, &desc, data);
+            if (h == 0)
+                return -1;
+        }
+
+        store_page(vm, pfn, h);
+
+        /* after the page, see push_chunk() */
+        atomic_inc(&vm->chunk_ver[pfn / MEMSRV_CHUNK_PAGES]);
+        last = pfn / MEMSRV_CHUNK_PAGES;
+    }
+
+    if (nr_missing) {
+        missing = (struct memsrv_frame *)(c->tx_buf + head);
+        memset(missing, 0, sizeof(*missing));
+        missing->len = nr_missing * sizeof(addr);
+        missing->type = MEMSRV_FRAME_MISSING;
+        missing->nr = nr_missing;
+    } else {
+        c->tx_len = head;
+    }
+
+    queue_stored(c, f->nr, last);
+
+    return 0;
+}
+
+/* on an I/O thread: hand a read back to the worker of its connection */
+static void read_done(struct memstore_read *rd)
+{
+    struct ms_read *r = container_of(rd, struct ms_read, rd);
+    struct ms_worker *w = r->c->worker;
+    uint64_t one = 1;
+
+    qemu_mutex_lock(&w->lock);
+    QSIMPLEQ_INSERT_TAIL(&w->done, r, next);
+    qemu_mutex_unlock(&w->lock);
+
+    if (write(w->evfd, &one, sizeof(one)) < 0)
+        perror("memserver: eventfd");
+}
+
+/* one page answering a FETCH, appended to the send queue */
+static void fetch_page(struct ms_conn *c, unsigned long pfn,
+                       struct memsrv_page *desc)
+{
+    uint64_t *handles = atomic_mb_read(&c->vm->handles);
+    struct memstore_read rd;
+    char cbuf[MS_PAGE_SIZE];
+    struct ms_read *r;
+    bool inflate;
+    uint64_t h = 0;
+    uint32_t len;
+    size_t pos;
+
+    if (handles && pfn < c->vm->nr_pages)
+        h = atomic_read(&handles[pfn]);
+
+    if (h == 0) {
+        desc->addr |= MEMSRV_ADDR_NONE;
+        return;
+    }
+
+    if (h == MEMSTORE_H_ZERO) {
+        if (c->caps & MEMSRV_CAP_ZERO) {
+            desc->addr |= MEMSRV_ADDR_ZERO;
+        } else {
+            desc->len = MS_PAGE_SIZE;
+            memset(tx_reserve(c, MS_PAGE_SIZE), 0, MS_PAGE_SIZE);
+        }
+        return;
+    }
+
+    /* sent as kept, unless the client has another codec */
+    len = memstore_len(h);
+    inflate = len < MS_PAGE_SIZE && c->codec != memstore_codec();
+    if (inflate) {
+        desc->len = MS_PAGE_SIZE;
+    } else {
+        desc->len = len;
+        if (len < MS_PAGE_SIZE)
+            desc->addr |= MEMSRV_ADDR_COMP;
+    }
+    pos = tx_reserve(c, desc->len) - c->tx_buf;
+
+    if (memstore_get(h, inflate ? cbuf : c->tx_buf + pos, &rd) ==
+        MEMSTORE_MEM) {
+        if (inflate && page_decompress(memstore_codec(), cbuf, len,
+                                       c->tx_buf + pos))
+            desc->addr |= MEMSRV_ADDR_NONE;  /* cannot happen */
+        return;
+    }
+
+    /* spilled, the payload is filled in once read */
+    r = g_new(struct ms_read, 1);
+    r->rd = rd;
+    r->rd.buf = r->buf;
+    r->rd.done = read_done;
+    r->c = c;
+    r->pos = pos;
+    r->inflate = inflate;
+    c->pending_reads++;
+    memstore_submit(&r->rd);
+}
+
+/* checksum the DATA frames from off on */
+static void fetch_seal(struct ms_conn *c, size_t off)
+{
+    struct memsrv_frame frame;
+    struct iovec iov;
+
+    if (!(c->caps & MEMSRV_CAP_CSUM))
+        return;
+
+    while (off < c->tx_len) {
+        memcpy(&frame, c->tx_buf + off, sizeof(frame));
+        iov.iov_base = c->tx_buf + off + sizeof(frame);
+        iov.iov_len = frame.len;
+        frame.flags |= MEMSRV_FRAME_CSUM;
+        frame.csum = memsrv_csum(&iov, 1);
+        memcpy(c->tx_buf + off, &frame, sizeof(frame));
+        off += sizeof(frame) + frame.len;
+    }
+}
+
+/*
+ * Queue page frames of type for nr addresses, in that order.  The last
+ * PUSH frame of a chunk is marked.
+ */
+static void queue_pages(struct ms_conn *c, int type, const char *addrs,
+                        uint32_t nr, uint32_t version)
+{
+    struct memsrv_page desc[MEMSRV_MAX_FRAME_PAGES];
+    struct memsrv_frame frame;
+    size_t start = c->tx_len, head, body;
+    uint64_t addr;
+    uint32_t i, j, cnt, per_frame;
+
+    per_frame = (c->caps & MEMSRV_CAP_BATCH) ? MEMSRV_MAX_FRAME_PAGES : 1;
+
+    for (i = 0; i < nr; i += cnt) {
+        cnt = MIN(nr - i, per_frame);
+
+        /* header and records first, filled once the payloads are known */
+        head = c->tx_len;
+        tx_reserve(c, sizeof(frame) + cnt * sizeof(desc[0]));
+
+        for (j = 0; j < cnt; j++) {
+            memcpy(&addr, addrs + (i + j) * sizeof(addr), sizeof(addr));
+            addr &= ~MEMSRV_ADDR_FLAGS;
+
+            desc[j].addr = addr;
+            desc[j].len = 0;
+            desc[j].version = version;
+            fetch_page(c, addr / MS_PAGE_SIZE, &desc[j]);
+        }
+
+        body = head + sizeof(frame);
+        memcpy(c->tx_buf + body, desc, cnt * sizeof(desc[0]));
+
+        memset(&frame, 0, sizeof(frame));
+        frame.len = c->tx_len - body;
+        frame.type = type;
+        frame.nr = cnt;
+        if (type == MEMSRV_FRAME_PUSH && i + cnt == nr)
+            frame.flags |= MEMSRV_FRAME_END;
+        memcpy(c->tx_buf + head, &frame, sizeof(frame));
+    }
+
+    /* sealed once the spilled pages are in */
+    if (c->pending_reads)
+        c->tx_hold = start;
+    else
+        fetch_seal(c, start);
+}
+
+/* wake the worker of a push connection (session locked) */
+static void conn_kick(struct ms_conn *c)
+{
+    struct ms_worker *w = c->worker;
+    uint64_t one = 1;
+
+    qemu_mutex_lock(&w->lock);
+    if (!c->kicked) {
+        c->kicked = true;
+        QSIMPLEQ_INSERT_TAIL(&w->kicked, c, kick_next);
+    }
+    qemu_mutex_unlock(&w->lock);
+
+    if (write(w->evfd, &one, sizeof(one)) < 0)
+        perror("memserver: eventfd");
+}
+
+/* a fetch of the session faulted on chunk, of nr_chunks */
+static void session_fetched(struct ms_session *s, long chunk, long nr_chunks)
+{
+    long delta, next;
+    bool queued = false;
+
+    qemu_mutex_lock(&s->lock);
+
+    /* on the stride, or past chunks pushed ahead on it */
+    delta = chunk - s->last;
+    if (s->stride && delta % s->stride == 0 && delta / s->stride > 0 &&
+        delta / s->stride <= MS_PUSH_DEPTH + 1) {
+        s->streaming = true;
+    } else {
+        s->stride = labs(delta) <= MS_PUSH_MAX_STRIDE ? delta : 0;
+        s->streaming = false;
+        s->pushed = chunk;
+    }
+    s->last = chunk;
+
+    if (s->streaming && s->push) {
+        if ((s->pushed - chunk) / s->stride < 0)
+            s->pushed = chunk;
+
+        while ((s->pushed - chunk) / s->stride < MS_PUSH_DEPTH &&
+               s->nr_queued < MS_PUSH_DEPTH) {
+            next = s->pushed + s->stride;
+            if (next < 0 || next >= nr_chunks)
+                break;
+            s->queue[s->nr_queued++] = next;
+            s->pushed = next;
+            queued = true;
+        }
+
+        if (queued)
+            conn_kick(s->push);
+    }
+
+    qemu_mutex_unlock(&s->lock);
+}
+
+/* answer nr addresses with DATA frames, in the requested order */
+static int handle_fetch(struct ms_conn *c, const struct memsrv_frame *f,
+                        const char *payload)
+{
+    uint64_t addr;
+
+    if (f->len != f->nr * sizeof(addr)) {
+        printf("memserver: bad FETCH\n");
+        return -1;
+    }
+
+    /* the faulted page comes first */
+    if (c->session && f->nr) {
+        memcpy(&addr, payload, sizeof(addr));
+        session_fetched(c->session, addr / MS_PAGE_SIZE / MEMSRV_CHUNK_PAGES,
+                        c->vm->nr_chunks);
+    }
+
+    queue_pages(c, MEMSRV_FRAME_DATA, payload, f->nr, 0);
+
+    return 0;
+}
+
+/* the pages the server has of a chunk, as PUSH frames */
+static void push_chunk(struct ms_conn *c, unsigned long chunk)
+{
+    struct ms_vm *vm = c->vm;
+    uint64_t addrs[MEMSRV_CHUNK_PAGES];
+    unsigned long pfn = chunk * MEMSRV_CHUNK_PAGES;
+    uint32_t version;
+    int i, nr = 0;
+
+    /* before the pages: a STORE meanwhile makes the push stale */
+    version = atomic_mb_read(&vm->chunk_ver[chunk]);
+
+    for (i = 0; i < MEMSRV_CHUNK_PAGES && pfn + i < vm->nr_pages; i++) {
+        if (atomic_read(&vm->handles[pfn + i]))
+            addrs[nr++] = (uint64_t)(pfn + i) * MS_PAGE_SIZE;
+    }
+
+    if (nr)
+        queue_pages(c, MEMSRV_FRAME_PUSH, (const char *)addrs, nr, version);
+}
+
+/* push the queued chunks of the session, while the client keeps up */
+static void push_run(struct ms_conn *c)
+{
+    struct ms_session *s = c->session;
+    long chunk;
+
+    while (!c->pending_reads && c->tx_len - c->tx_off < MS_PUSH_HIGH) {
+        qemu_mutex_lock(&s->lock);
+        if (s->nr_queued == 0) {
+            qemu_mutex_unlock(&s->lock);
+            break;
+        }
+        chunk = s->queue[0];
+        memmove(s->queue, s->queue + 1, --s->nr_queued * sizeof(s->queue[0]));
+        qemu_mutex_unlock(&s->lock);
+
+        push_chunk(c, chunk);
+    }
+}
+
+static int handle_session(struct ms_conn *c, const struct memsrv_frame *f,
+                          const char *payload)
+{
+    struct ms_session *s;
+    uint64_t id;
+
+    if (f->len != sizeof(id) || c->session ||
+        !(c->caps & MEMSRV_CAP_PUSH)) {
+        printf("memserver: bad SESSION\n");
+        return -1;
+    }
+    memcpy(&id, payload, sizeof(id));
+
+    qemu_mutex_lock(&sessions_lock);
+    for (s = sessions; s && s->id != id; s = s->next)
+        ;
+    if (s == NULL) {
+        s = g_new0(struct ms_session, 1);
+        s->id = id;
+        qemu_mutex_init(&s->lock);
+        s->next = sessions;
+        sessions = s;
+    }
+    s->refs++;
+    qemu_mutex_unlock(&sessions_lock);
+
+    c->session = s;
+
+    if (c->role == MEMSRV_ROLE_PUSH) {
+        qemu_mutex_lock(&s->lock);
+        if (s->push == NULL)
+            s->push = c;
+        qemu_mutex_unlock(&s->lock);
+    }
+
+    return 0;
+}
+
+static void session_leave(struct ms_conn *c)
+{
+    struct ms_session *s = c->session, **p;
+    struct ms_worker *w = c->worker;
+
+    if (s == NULL)
+        return;
+
+    /* no more kicks after this */
+    qemu_mutex_lock(&s->lock);
+    if (s->push == c)
+        s->push = NULL;
+    qemu_mutex_unlock(&s->lock);
+
+    qemu_mutex_lock(&w->lock);
+    if (c->kicked) {
+        QSIMPLEQ_REMOVE(&w->kicked, c, ms_conn, kick_next);
+        c->kicked = false;
+    }
+    qemu_mutex_unlock(&w->lock);
+
+    qemu_mutex_lock(&sessions_lock);
+    if (--s->refs == 0) {
+        for (p = &sessions; *p != s; p = &(*p)->next)
+            ;
+        *p = s->next;
+        qemu_mutex_destroy(&s->lock);
+        g_free(s);
+    }
+    qemu_mutex_unlock(&sessions_lock);
+
+    c->session = NULL;
+}
+
+/* a spilled page read for the mover, which waits for it */
+struct ms_move_read {
+    struct memstore_read rd;
+    QemuSemaphore sem;
+};
+
+static void move_read_done(struct memstore_read *rd)
+{
+    qemu_sem_post(&container_of(rd, struct ms_move_read, rd)->sem);
+}
+
+/* the page at pfn as kept, into desc and buf; false if it is gone */
+static bool move_page(struct ms_vm *vm, unsigned long pfn, int codec,
+                      struct memsrv_page *desc, char *buf)
+{
+    uint64_t h = atomic_read(&vm->handles[pfn]);
+    struct ms_move_read r;
+    char cbuf[MS_PAGE_SIZE];
+    bool inflate;
+    uint32_t len;
+    int ret = 0;
+
+    desc->addr = (uint64_t)pfn * MS_PAGE_SIZE;
+    desc->len = 0;
+    desc->version = 0;
+
+    if (h == 0)
+        return false;
+    if (h == MEMSTORE_H_ZERO) {
+        desc->addr |= MEMSRV_ADDR_ZERO;
+        return true;
+    }
+
+    /* sent as kept, unless the other server has another codec */
+    len = memstore_len(h);
+    inflate = len < MS_PAGE_SIZE && codec != memstore_codec();
+    if (inflate) {
+        desc->len = MS_PAGE_SIZE;
+    } else {
+        desc->len = len;
+        if (len < MS_PAGE_SIZE)
+            desc->addr |= MEMSRV_ADDR_COMP;
+    }
+
+    if (memstore_get(h, inflate ? cbuf : buf, &r.rd) == MEMSTORE_DISK) {
+        qemu_sem_init(&r.sem, 0);
+        r.rd.buf = inflate ? cbuf : buf;
+        r.rd.done = move_read_done;
+        memstore_submit(&r.rd);
+        qemu_sem_wait(&r.sem);
+        qemu_sem_destroy(&r.sem);
+        ret = r.rd.ret;
+        memstore_release(&r.rd);
+    }
+
+    if (ret == 0 && inflate)
+        ret = page_decompress(memstore_codec(), cbuf, len, buf);
+
+    return ret == 0;
+}
+
+/*
+ * Store the pages of m on its destination as STORE frames, over a
+ * connection of its own, and count what was acknowledged.
+ */
+static void move_pages(struct ms_move *m)
+{
+    static char frame_buf[MEMSRV_MAX_FRAME];
+    struct memsrv_page desc[MEMSRV_MAX_FRAME_PAGES];
+    struct memsrv_frame frame;
+    struct memsrv_hello hello;
+    char *data;
+    uint32_t i, j, cnt, nr_frames = 0;
+    unsigned long pfn;
+    int sock;
+
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("memserver: move: socket");
+        return;
+    }
+
+    if (connect(sock, (struct sockaddr *)&m->dest, sizeof(m->dest))) {
+        printf("memserver: move: cannot connect to %s\n",
+               inet_ntoa(m->dest.sin_addr));
+        goto out;
+    }
+
+    memsrv_tune_socket(sock, 0);
+    if (memsrv_handshake(sock, MEMSRV_ROLE_MOVE, MS_MOVE_CAPS,
+                         memstore_codec(), &hello))
+        goto out;
+
+    if (!(hello.caps & MEMSRV_CAP_ACK) || !(hello.caps & MEMSRV_CAP_TENANT) ||
+        !(hello.caps & MEMSRV_CAP_BATCH)) {
+        printf("memserver: move: %s is too old\n",
+               inet_ntoa(m->dest.sin_addr));
+        goto out;
+    }
+
+    if (memsrv_select_vm(sock, m->vm->uuid) ||
+        memsrv_mem_size(sock, m->vm->size))
+        goto out;
+
+    for (i = 0; i < m->nr; i += cnt) {
+        cnt = MIN(m->nr - i, MEMSRV_MAX_FRAME_PAGES);
+        data = frame_buf + sizeof(frame) + cnt * sizeof(desc[0]);
+
+        for (j = 0; j < cnt; j++) {
+            pfn = (m->addrs[i + j] & ~MEMSRV_ADDR_FLAGS) / MS_PAGE_SIZE;
+            if (pfn >= m->vm->nr_pages ||
+                !move_page(m->vm, pfn, hello.codec, &desc[j], data))
+                goto out;
+            data += desc[j].len;
+        }
+
+        memset(&frame, 0, sizeof(frame));
+        frame.type = MEMSRV_FRAME_STORE;
+        frame.nr = cnt;
+        frame.len = data - frame_buf - sizeof(frame);
+        memcpy(frame_buf, &frame, sizeof(frame));
+        memcpy(frame_buf + sizeof(frame), desc, cnt * sizeof(desc[0]));
+
+        if (send(sock, frame_buf, data - frame_buf, MSG_NOSIGNAL) !=
+            data - frame_buf) {
+            perror("memserver: move: send");
+            goto out;
+        }
+        nr_frames++;
+    }
+
+    /* one STORED per STORE, with whatever payload the caps add */
+    while (nr_frames--) {
+        if (recv(sock, &frame, sizeof(frame), MSG_WAITALL) != sizeof(frame) ||
+            frame.type != MEMSRV_FRAME_STORED ||
+            frame.len > sizeof(frame_buf) ||
+            (frame.len &&
+             recv(sock, frame_buf, frame.len, MSG_WAITALL) != frame.len)) {
+            printf("memserver: move: no STORED from %s\n",
+                   inet_ntoa(m->dest.sin_addr));
+            goto out;
+        }
+        m->stored += frame.nr;
+    }
+
+out:
+    close(sock);
+}
+
+/*
+ * Mover: one MOVE at a time, blocking on the other server.  The worker
+ * of the connection asking for it answers with MOVED once it is done.
+ */
+static void *mover_thread(void *opaque)
+{
+    struct ms_move *m;
+    struct ms_worker *w;
+    uint64_t one = 1;
+
+    for (;;) {
+        qemu_mutex_lock(&moves_lock);
+        while ((m = QSIMPLEQ_FIRST(&moves)) == NULL)
+            qemu_cond_wait(&moves_cond, &moves_lock);
+        QSIMPLEQ_REMOVE_HEAD(&moves, next);
+        qemu_mutex_unlock(&moves_lock);
+
+        move_pages(m);
+
+        w = m->c->worker;
+        qemu_mutex_lock(&w->lock);
+        QSIMPLEQ_INSERT_TAIL(&w->moved, m, next);
+        qemu_mutex_unlock(&w->lock);
+
+        if (write(w->evfd, &one, sizeof(one)) < 0)
+            perror("memserver: eventfd");
+    }
+
+    return NULL;
+}
+
+static int handle_move(struct ms_conn *c, const struct memsrv_frame *f,
+                       const char *payload)
+{
+    struct memsrv_move req;
+    struct ms_move *m;
+
+    if (f->len != sizeof(req) + f->nr * sizeof(uint64_t) || f->nr == 0 ||
+        !(c->caps & MEMSRV_CAP_MOVE) ||
+        atomic_mb_read(&c->vm->handles) == NULL) {
+        printf("memserver: bad MOVE\n");
+        return -1;
+    }
+    memcpy(&req, payload, sizeof(req));
+
+    m = g_new0(struct ms_move, 1);
+    m->c = c;
+    m->vm = c->vm;
+    m->dest.sin_family = AF_INET;
+    m->dest.sin_addr.s_addr = req.host;
+    m->dest.sin_port = htons(req.port);
+    m->nr = f->nr;
+    m->addrs = g_memdup(payload + sizeof(req), f->nr * sizeof(uint64_t));
+    c->pending_moves++;
+
+    qemu_mutex_lock(&moves_lock);
+    QSIMPLEQ_INSERT_TAIL(&moves, m, next);
+    qemu_cond_signal(&moves_cond);
+    qemu_mutex_unlock(&moves_lock);
+
+    return 0;
+}
+
+/* forget pages moved elsewhere */
+static int handle_drop(struct ms_conn *c, const struct memsrv_frame *f,
+                       const char *payload)
+{
+    uint64_t addr;
+    unsigned long pfn;
+    uint32_t i;
+
+    if (f->len != f->nr * sizeof(addr) || !(c->caps & MEMSRV_CAP_MOVE) ||
+        atomic_mb_read(&c->vm->handles) == NULL) {
+        printf("memserver: bad DROP\n");
+        return -1;
+    }
+
+    for (i = 0; i < f->nr; i++) {
+        memcpy(&addr, payload + i * sizeof(addr), sizeof(addr));
+        pfn = (addr & ~MEMSRV_ADDR_FLAGS) / MS_PAGE_SIZE;
+        if (pfn < c->vm->nr_pages)
+            store_page(c->vm, pfn, 0);
+    }
+
+    return 0;
+}
+
+static int handle_frame(struct ms_conn *c, const struct memsrv_frame *f,
+                        char *payload)
+{
+    struct iovec iov;
+    uint64_t size;
+
+    if (!c->hello) {
+        if (f->type != MEMSRV_FRAME_HELLO)
+            return -1;
+        return handle_hello(c, f, payload);
+    }
+
+    if (f->flags & MEMSRV_FRAME_CSUM) {
+        iov.iov_base = payload;
+        iov.iov_len = f->len;
+        if (memsrv_csum(&iov, 1) != f->csum) {
+            printf("memserver: checksum error\n");
+            return -1;
+        }
+    }
+
+    if (f->type == MEMSRV_FRAME_VM) {
+        if (f->len != sizeof(c->vm->uuid) || c->vm ||
+            !(c->caps & MEMSRV_CAP_TENANT) ||
+            uuid_is_nil((const uint8_t *)payload)) {
+            printf("memserver: bad VM\n");
+            return -1;
+        }
+        c->vm = vm_get((const uint8_t *)payload);
+        return c->vm ? 0 : -1;
+    }
+
+    if (conn_vm(c) == NULL)
+        return -1;
+
+    switch (f->type) {
+    case MEMSRV_FRAME_MEM_SIZE:
+        if (f->len != sizeof(size))
+            return -1;
+        memcpy(&size, payload, sizeof(size));
+        return store_init(c->vm, size);
+    case MEMSRV_FRAME_STORE:
+        if ((uint64_t)f->nr * sizeof(struct memsrv_page) > f->len)
+            return -1;
+        return handle_store(c, f, payload);
+    case MEMSRV_FRAME_FETCH:
+        return handle_fetch(c, f, payload);
+    case MEMSRV_FRAME_SYNC:
+        conn_queue_frame(c, MEMSRV_FRAME_SYNC, 0, NULL, 0);
+        return 0;
+    case MEMSRV_FRAME_SESSION:
+        return handle_session(c, f, payload);
+    case MEMSRV_FRAME_MOVE:
+        return handle_move(c, f, payload);
+    case MEMSRV_FRAME_DROP:
+        return handle_drop(c, f, payload);
+    case MEMSRV_FRAME_RELEASE:
+        if (!(c->caps & MEMSRV_CAP_RELEASE))
+            return -1;
+        vm_release(c->vm);
+        return 0;
+    }
+
+    printf("memserver: unknown frame type %u\n", f->type);
+
+    return -1;
+}
+
+/* wait for the turn of a STORE at the head of rx_buf */
+static int conn_queue_store(struct ms_conn *c)
+{
+    struct ms_worker *w = c->worker;
+
+    if (conn_vm(c) == NULL)
+        return -1;
+
+    /* a slot taken by another VM starts over */
+    if (w->vtime_gen[c->vm->idx] != c->vm->gen) {
+        w->vtime_gen[c->vm->idx] = c->vm->gen;
+        w->vtime[c->vm->idx] = w->vclock;
+    }
+    w->vtime[c->vm->idx] = MAX(w->vtime[c->vm->idx], w->vclock);
+    QTAILQ_INSERT_TAIL(&w->stores, c, store_next);
+    c->queued = true;
+
+    return 0;
+}
+
+/*
+ * Handle the complete frames at the head of rx_buf, up to a STORE which
+ * is queued, or handled first with store.
+ */
+static int conn_received(struct ms_conn *c, bool store)
+{
+    struct memsrv_frame frame;
+    size_t off = 0;
+
+    /* the frames after a FETCH of spilled pages wait for it */
+    while (!c->pending_reads && c->rx_len - off >= sizeof(frame)) {
+        memcpy(&frame, c->rx_buf + off, sizeof(frame));
+
+        if (frame.len > MEMSRV_MAX_FRAME - sizeof(frame)) {
+            printf("memserver: frame too long\n");
+            return -1;
+        }
+
+        if (c->rx_len - off < sizeof(frame) + frame.len)
+            break;
+
+        if (frame.type == MEMSRV_FRAME_STORE && c->hello) {
+            if (!store) {
+                if (conn_queue_store(c))
+                    return -1;
+                break;
+            }
+            store = false;
+        }
+
+        if (handle_frame(c, &frame, c->rx_buf + off + sizeof(frame)))
+            return -1;
+
+        off += sizeof(frame) + frame.len;
+    }
+
+    memmove(c->rx_buf, c->rx_buf + off, c->rx_len - off);
+    c->rx_len -= off;
+
+    return 0;
+}
+
+static void conn_free(struct ms_conn *c)
+{
+    if (!c->closing) {
+        if (c->role == MEMSRV_ROLE_MIGRATION && c->vm)
+            printf("memserver: migration of VM %d done, "
+                   "%lu pages deduplicated\n",
+                   c->vm->idx, atomic_read(&c->vm->nr_shared));
+
+        if (c->queued)
+            QTAILQ_REMOVE(&c->worker->stores, c, store_next);
+        session_leave(c);
+        epoll_ctl(c->worker->epfd, EPOLL_CTL_DEL, c->sock, NULL);
+        close(c->sock);
+        c->closing = true;
+    }
+
+    if (c->pending_reads || c->pending_moves)
+        return;
+
+    if (c->vm)
+        vm_put(c->vm);
+    g_free(c->rx_buf);
+    g_free(c->tx_buf);
+    g_free(c);
+}
+
+/* put a page read from the spill file into its DATA frame */
+static void read_fill(struct ms_conn *c, struct ms_read *r)
+{
+    char *page = c->tx_buf + r->pos;
+
+    if (r->rd.ret) {
+        c->read_error = true;
+    } else if (r->inflate) {
+        if (page_decompress(memstore_codec(), r->buf, r->rd.len, page))
+            c->read_error = true;
+    } else {
+        memcpy(page, r->buf, r->rd.len);
+    }
+}
+
+/* a FETCH is complete, go on with the frames after it */
+static int conn_resume(struct ms_conn *c)
+{
+    if (c->read_error) {
+        printf("memserver: cannot read spilled pages\n");
+        return -1;
+    }
+
+    fetch_seal(c, c->tx_hold);
+
+    if (conn_received(c, false))
+        return -1;
+
+    return conn_flush(c);
+}
+
+static void worker_wakeup(struct ms_worker *w)
+{
+    QSIMPLEQ_HEAD(, ms_read) done = QSIMPLEQ_HEAD_INITIALIZER(done);
+    QSIMPLEQ_HEAD(, ms_move) moved = QSIMPLEQ_HEAD_INITIALIZER(moved);
+    QSIMPLEQ_HEAD(, ms_conn) kicked = QSIMPLEQ_HEAD_INITIALIZER(kicked);
+    struct ms_conn *c;
+    struct ms_read *r;
+    struct ms_move *m;
+    uint64_t cnt;
+
+    if (read(w->evfd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        perror("memserver: eventfd");
+
+    qemu_mutex_lock(&w->lock);
+    QSIMPLEQ_CONCAT(&done, &w->done);
+    QSIMPLEQ_CONCAT(&moved, &w->moved);
+    qemu_mutex_unlock(&w->lock);
+
+    while ((m = QSIMPLEQ_FIRST(&moved)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&moved, next);
+        c = m->c;
+        c->pending_moves--;
+
+        if (!c->closing) {
+            conn_queue_frame(c, MEMSRV_FRAME_MOVED, m->stored, &m->addrs[0],
+                             sizeof(m->addrs[0]));
+            if (conn_flush(c))
+                conn_free(c);
+        } else if (!c->pending_moves) {
+            conn_free(c);
+        }
+
+        g_free(m->addrs);
+        g_free(m);
+    }
+
+    while ((r = QSIMPLEQ_FIRST(&done)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&done, next);
+        c = r->c;
+
+        if (!c->closing)
+            read_fill(c, r);
+        memstore_release(&r->rd);
+        g_free(r);
+
+        if (--c->pending_reads)
+            continue;
+        if (c->closing)
+            conn_free(c);
+        else if (conn_resume(c))
+            conn_free(c);
+    }
+
+    /* push connections with chunks queued */
+    qemu_mutex_lock(&w->lock);
+    QSIMPLEQ_CONCAT(&kicked, &w->kicked);
+    QSIMPLEQ_FOREACH(c, &kicked, kick_next)
+        c->kicked = false;
+    qemu_mutex_unlock(&w->lock);
+
+    while ((c = QSIMPLEQ_FIRST(&kicked)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&kicked, kick_next);
+        if (conn_flush(c))
+            conn_free(c);
+    }
+}
+
+static int conn_handle(struct ms_conn *c, uint32_t events)
+{
+    ssize_t ret;
+
+    if (events & EPOLLIN) {
+        ret = recv(c->sock, c->rx_buf + c->rx_len,
+                   MS_RX_BUF_SIZE - c->rx_len, MSG_DONTWAIT);
+        if (ret == 0)
+            return -1;
+        if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+            perror("memserver: recv");
+            return -1;
+        }
+        if (ret > 0) {
+            c->rx_len += ret;
+            if (conn_received(c, false))
+                return -1;
+        }
+    } else if (events & (EPOLLERR | EPOLLHUP)) {
+        return -1;
+    }
+
+    return conn_flush(c);
+}
+
+/* the STORE of the VM furthest behind its share */
+static void worker_run_store(struct ms_worker *w)
+{
+    struct ms_conn *c, *next = NULL;
+    struct memsrv_frame frame;
+
+    QTAILQ_FOREACH(c, &w->stores, store_next) {
+        if (next == NULL || w->vtime[c->vm->idx] < w->vtime[next->vm->idx])
+            next = c;
+    }
+    if (next == NULL)
+        return;
+
+    c = next;
+    QTAILQ_REMOVE(&w->stores, c, store_next);
+    c->queued = false;
+
+    memcpy(&frame, c->rx_buf, sizeof(frame));
+    w->vclock = w->vtime[c->vm->idx];
+    w->vtime[c->vm->idx] += (sizeof(frame) + frame.len) / c->vm->weight;
+
+    if (conn_received(c, true) || conn_flush(c))
+        conn_free(c);
+}
+
+static void *worker_thread(void *opaque)
+{
+    struct ms_worker *w = opaque;
+    struct epoll_event events[MS_MAX_EVENTS];
+    int i, n;
+
+    for (;;) {
+        /* new frames are looked at between two STOREs */
+        n = epoll_wait(w->epfd, events, MS_MAX_EVENTS,
+                       QTAILQ_EMPTY(&w->stores) ? -1 : 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("memserver: epoll_wait");
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == w)
+                worker_wakeup(w);
+            else if (conn_handle(events[i].data.ptr, events[i].events))
+                conn_free(events[i].data.ptr);
+        }
+
+        worker_run_store(w);
+    }
+
+    return NULL;
+}
+
+static int conn_add(int sock, struct ms_worker *w)
+{
+    struct epoll_event ev;
+    struct ms_conn *c;
+
+    memsrv_tune_socket(sock, 1);
+
+    c = g_new0(struct ms_conn, 1);
+    c->sock = sock;
+    c->worker = w;
+    c->rx_buf = g_malloc(MS_RX_BUF_SIZE);
+    c->events = EPOLLIN;
+
+    ev.events = c->events;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, sock, &ev)) {
+        perror("memserver: epoll_ctl");
+        g_free(c->rx_buf);
+        g_free(c);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void usage(void)
+{
+    printf("usage: memserver [-p port] [-t threads] [-r] "
+           "[-d spill-file [-m dram-mb]]\n"
+           "                 [-q quota-mb] [-v uuid:quota-mb:weight]...\n");
+    exit(1);
+}
+
+/* -v uuid:quota-mb:weight */
+static int parse_vm(const char *arg)
+{
+    uint8_t uuid[16];
+    struct ms_vm_conf *conf;
+    unsigned long mb;
+    unsigned int digit;
+    int i, weight = 1;
+    char *end;
+
+    for (i = 0; i < 32; arg++) {
+        if (*arg == '-')
+            continue;
+        if (sscanf(arg, "%1x", &digit) != 1)
+            return -1;
+        uuid[i / 2] = (uuid[i / 2] << 4) | digit;
+        i++;
+    }
+
+    if (*arg++ != ':')
+        return -1;
+    mb = strtoul(arg, &end, 0);
+    if (*end == ':')
+        weight = strtol(end + 1, &end, 0);
+    if (*end || weight < 1 || uuid_is_nil(uuid) ||
+        nr_vm_confs == MS_MAX_VMS)
+        return -1;
+
+    conf = &vm_confs[nr_vm_confs++];
+    memcpy(conf->uuid, uuid, sizeof(uuid));
+    conf->quota = (uint64_t)mb << 20;
+    conf->weight = weight;
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    const char *spill_path = NULL;
+    uint64_t mem_limit = 0;
+    int codec = MS_STORE_CODEC;
+    int port = MEMSRV_PORT;
+    QemuThread mover;
+    int lsock, sock, opt, i;
+    int one = 1;
+
+    qemu_mutex_init(&vms_lock);
+
+    while ((opt = getopt(argc, argv, "p:t:rd:m:q:v:h")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 't':
+            nr_workers = atoi(optarg);
+            break;
+        case 'r':
+            codec = PAGE_CODEC_NONE;
+            break;
+        case 'd':
+            spill_path = optarg;
+            break;
+        case 'm':
+            mem_limit = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'q':
+            vm_quota = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'v':
+            if (parse_vm(optarg))
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (nr_workers < 1 || nr_workers > MS_MAX_WORKERS)
+        usage();
+
+    if (mem_limit == 0)
+        mem_limit = (uint64_t)sysconf(_SC_PHYS_PAGES) *
+                    sysconf(_SC_PAGESIZE) / 4 * 3;
+
+    signal(SIGPIPE, SIG_IGN);
+    qemu_mutex_init(&sessions_lock);
+    qemu_mutex_init(&moves_lock);
+    qemu_cond_init(&moves_cond);
+    if (memstore_init(codec, spill_path, mem_limit))
+        return 1;
+
+    /* page digests are unpredictable to the guests */
+    if (getrandom(hash_key, sizeof(hash_key), 0) != sizeof(hash_key)) {
+        perror("memserver: getrandom");
+        return 1;
+    }
+
+    lsock = socket(AF_INET, SOCK_STREAM, 0);
+    if (lsock < 0) {
+        perror("memserver: socket");
+        return 1;
+    }
+    setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(lsock, 64)) {
+        perror("memserver: bind");
+        return 1;
+    }
+
+    for (i = 0; i < nr_workers; i++) {
+        workers[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+        workers[i].evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (workers[i].epfd < 0 || workers[i].evfd < 0) {
+            perror("memserver: epoll_create1");
+            return 1;
+        }
+        qemu_mutex_init(&workers[i].lock);
+        QSIMPLEQ_INIT(&workers[i].done);
+        QSIMPLEQ_INIT(&workers[i].moved);
+        QSIMPLEQ_INIT(&workers[i].kicked);
+        QTAILQ_INIT(&workers[i].stores);
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &workers[i];
+        if (epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, workers[i].evfd, &ev)) {
+            perror("memserver: epoll_ctl");
+            return 1;
+        }
+        qemu_thread_create(&workers[i].thread, "memserver", worker_thread,
+                           &workers[i], QEMU_THREAD_JOINABLE);
+    }
+
+    qemu_thread_create(&mover, "memserver-move", mover_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+
+    printf("memserver: listening on port %d, %d workers\n", port, nr_workers);
+
+    /* connections are handed to the workers in turn */
+    for (i = 0;; i = (i + 1) % nr_workers) {
+        sock = accept4(lsock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno != EINTR)
+                perror("memserver: accept");
+            continue;
+        }
+
+        if (conn_add(sock, &workers[i]))
+            close(sock);
+    }
+
+    return 0;
+}
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "memsrv.h"
+
+#define MEMSRV_BUSY_POLL_US 50  /* spin on the NIC queue before sleeping */
+
+/*
+ * Socket options for a memory server connection: frames are assembled
+ * before they are sent, so Nagle only delays them.  Fault traffic also
+ * busy-polls the receive queue where the kernel allows it.
+ */
+void memsrv_tune_socket(int sock, int low_latency)
+{
+    int one = 1;
+#ifdef SO_BUSY_POLL
+    int usecs = MEMSRV_BUSY_POLL_US;
+#endif
+
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)))
+        perror("memsrv_tune_socket: TCP_NODELAY");
+
+    if (!low_latency)
+        return;
+
+#ifdef SO_BUSY_POLL
+    /* above net.core.busy_read it needs CAP_NET_ADMIN, not fatal */
+    if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)))
+        printf("memsrv_tune_socket: no busy polling on socket %d\n", sock);
+#endif
+}
+
+/*
+ * HELLO exchange on a new (blocking) connection.  Returns 0 with the
+ * version, capabilities and codec both sides agreed on.
+ */
+int memsrv_handshake(int sock, int role, uint32_t caps, int codec,
+                     struct memsrv_hello *agreed)
+{
+    struct memsrv_frame frame;
+    struct memsrv_hello hello;
+    struct iovec iov[2];
+    struct msghdr msg = { 0 };
+
+    memset(&frame, 0, sizeof(frame));
+    frame.len = sizeof(hello);
+    frame.type = MEMSRV_FRAME_HELLO;
+
+    memset(&hello, 0, sizeof(hello));
+    hello.magic = MEMSRV_MAGIC;
+    hello.version = MEMSRV_VERSION;
+    hello.role = role;
+    hello.caps = caps;
+    hello.codec = codec;
+
+    iov[0].iov_base = &frame;
+    iov[0].iov_len = sizeof(frame);
+    iov[1].iov_base = &hello;
+    iov[1].iov_len = sizeof(hello);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    if (sendmsg(sock, &msg, 0) != sizeof(frame) + sizeof(hello)) {
+        perror("memsrv_handshake: sendmsg");
+        return -1;
+    }
+
+    if (recv(sock, &frame, sizeof(frame), MSG_WAITALL) != sizeof(frame) ||
+        frame.type != MEMSRV_FRAME_HELLO || frame.len != sizeof(hello) ||
+        recv(sock, agreed, sizeof(*agreed), MSG_WAITALL) != sizeof(*agreed)) {
+        printf("memsrv_handshake: no HELLO from memory server\n");
+        return -1;
+    }
+
+    if (agreed->magic != MEMSRV_MAGIC || agreed->version == 0 ||
+        agreed->version > MEMSRV_VERSION) {
+        printf("memsrv_handshake: unsupported version %u\n", agreed->version);
+        return -1;
+    }
+
+    /* never use what we did not offer */
+    agreed->caps &= caps;
+    if (!(agreed->caps & MEMSRV_CAP_COMPRESS))
+        agreed->codec = 0;
+    else if (agreed->codec != 0 && agreed->codec != (uint32_t)codec) {
+        printf("memsrv_handshake: unexpected codec %u\n", agreed->codec);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* a frame with a payload, on a blocking connection */
+static int memsrv_send(int sock, int type, const void *payload, uint32_t len)
+{
+    struct memsrv_frame frame;
+    struct iovec iov[2];
+    struct msghdr msg = { 0 };
+
+    memset(&frame, 0, sizeof(frame));
+    frame.len = len;
+    frame.type = type;
+
+    iov[0].iov_base = &frame;
+    iov[0].iov_len = sizeof(frame);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    if (sendmsg(sock, &msg, 0) != sizeof(frame) + len) {
+        perror("memsrv_send: sendmsg");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* join the connection to a session, after the HELLO */
+int memsrv_join(int sock, uint64_t session)
+{
+    return memsrv_send(sock, MEMSRV_FRAME_SESSION, &session, sizeof(session));
+}
+
+/* the VM the connection is for, first after the HELLO */
+int memsrv_select_vm(int sock, const uint8_t uuid[16])
+{
+    return memsrv_send(sock, MEMSRV_FRAME_VM, uuid, 16);
+}
+
+/* memory size of the VM, before its first STORE */
+int memsrv_mem_size(int sock, uint64_t size)
+{
+    return memsrv_send(sock, MEMSRV_FRAME_MEM_SIZE, &size, sizeof(size));
+}
+
+/* CRC-32 of a frame payload */
+uint32_t memsrv_csum(const struct iovec *iov, int iovcnt)
+{
+    uLong crc = crc32(0L, Z_NULL, 0);
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        crc = crc32(crc, iov[i].iov_base, iov[i].iov_len);
+
+    return crc;
+}
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND \
+    do { \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+    } while (0)
+
+/*
+ * 128-bit SipHash-2-4 of a page.  Pages with the same digest are taken
+ * as equal, the key keeps a guest from making up collisions.
+ */
+void memsrv_page_hash(const uint64_t key[2], const void *page,
+                      uint64_t digest[2])
+{
+    uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+    uint64_t v1 = 0x646f72616e646f6dULL ^ key[1] ^ 0xee;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+    uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+    const uint8_t *p = page;
+    uint64_t m;
+    int i;
+
+    for (i = 0; i < MEMSRV_PAGE_SIZE; i += sizeof(m)) {
+        m = ldq_le_p(p + i);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    /* the length byte of the last block, 4096 & 0xff */
+    m = (uint64_t)(MEMSRV_PAGE_SIZE & 0xff) << 56;
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+
+    v2 ^= 0xee;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    digest[0] = v0 ^ v1 ^ v2 ^ v3;
+
+    v1 ^= 0xdd;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    digest[1] = v0 ^ v1 ^ v2 ^ v3;
+}
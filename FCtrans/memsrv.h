@@ -0,0 +1,186 @@
+#ifndef __MEMSRV_H_
+#define __MEMSRV_H_
+
+/*
+ * Wire protocol between QEMU and the memory servers on the sub-hosts.
+ *
+ * Everything on a connection is a frame: a struct memsrv_frame header
+ * followed by len bytes of payload.  Fields are in host byte order,
+ * both peers must have the same endianness.
+ *
+ * A connection opens with the handshake: the client sends a HELLO
+ * frame with its version, role, capabilities and preferred codec, the
+ * server answers with a HELLO holding the version both speak, the
+ * capabilities both have and the codec it will use.  Unknown
+ * capability bits must be ignored, so newer peers keep working with
+ * older ones.
+ *
+ * Page records: a page frame carries nr struct memsrv_page descriptors
+ * followed by their payloads in the same order.  The low bits of the
+ * page-aligned address are flags, like RAM_SAVE_FLAG_* in the
+ * migration stream:
+ *
+ *   (none)            4 KB page data
+ *   MEMSRV_ADDR_ZERO  all-zero page, no payload
+ *   MEMSRV_ADDR_COMP  page compressed with the agreed codec, len bytes
+ *   MEMSRV_ADDR_NONE  the server does not have the page, no payload
+ *   MEMSRV_ADDR_HASH  page with the memsrv_page_hash() of this 16-byte
+ *                     payload, if the server has one (MEMSRV_CAP_DEDUP)
+ *
+ * Frames:
+ *
+ *   HELLO      struct memsrv_hello
+ *   VM         16-byte UUID of the VM whose pages the connection carries,
+ *              first after the HELLO (MEMSRV_CAP_TENANT).  Required, a
+ *              connection without it or with the nil UUID is closed.
+ *   MEM_SIZE   VM memory size (8 bytes), first after a migration HELLO
+ *   STORE      page records to keep (split migration, page-out)
+ *   FETCH      nr page addresses (8 bytes each) to send back
+ *   DATA       page records answering FETCH, in the requested order
+ *   STORED     nr page records of the oldest unacknowledged STORE are
+ *              stored (MEMSRV_CAP_ACK), with MEMSRV_CAP_PUSH followed by
+ *              the version of the chunk of its last record (4 bytes),
+ *              with MEMSRV_CAP_ROOM by the bytes the VM may still store
+ *              on the server (8 bytes, all ones without a quota).
+ *              MEMSRV_FRAME_FULL: the VM is over its quota on the
+ *              server, further page-out should go elsewhere.
+ *   MISSING    nr addresses of MEMSRV_ADDR_HASH records the server
+ *              had no page for, to be stored again in full
+ *   SYNC       no payload, answered with SYNC once everything sent
+ *              before it is handled
+ *   SESSION    8-byte id chosen by the client, joining the connection
+ *              to the others with that id (MEMSRV_CAP_PUSH)
+ *   PUSH       page records of a chunk the server expects the session
+ *              to fetch next, sent on its MEMSRV_ROLE_PUSH connection.
+ *              The last frame of a chunk has MEMSRV_FRAME_END, each
+ *              record the version of the chunk when it was read.
+ *   MOVE       struct memsrv_move, then nr page addresses: store those
+ *              pages on the memory server at host:port, for the same
+ *              VM, and answer MOVED (MEMSRV_CAP_MOVE).  They stay here
+ *              until dropped.
+ *   MOVED      the first address of a MOVE (8 bytes), nr pages the other
+ *              server stored.  Fewer than asked: the move failed.
+ *   DROP       nr page addresses to forget, all other copies are
+ *              elsewhere (MEMSRV_CAP_MOVE)
+ *   RELEASE    no payload, the client is done with the VM: its pages
+ *              are dropped once its last connection is closed
+ *              (MEMSRV_CAP_RELEASE).  A VM never released is kept.
+ *
+ * Without MEMSRV_CAP_BATCH a page frame has one record.  With
+ * MEMSRV_CAP_CSUM a frame may set MEMSRV_FRAME_CSUM, then csum is the
+ * CRC-32 of its payload.
+ *
+ * Frames of one connection are handled in order, connections of a
+ * client are not ordered among themselves.  MOVED is the exception: it
+ * is sent once the move is done, frames after the MOVE do not wait.
+ * A client fetching over one connection what it stored over another
+ * waits for STORED first.  For the same reason a pushed chunk may be
+ * older than a STORE: the version of a chunk is bumped by every STORE
+ * into it, a push older than the last STORED of the chunk is stale.
+ */
+
+#define MEMSRV_PORT 9737
+#define MEMSRV_PAGE_SIZE 4096
+#define MEMSRV_CHUNK_PAGES 512  /* unit of push and versions, 2 MB */
+
+#define MEMSRV_MAGIC 0x5652534d  /* "MSRV" */
+#define MEMSRV_VERSION 1
+
+/* frame types */
+#define MEMSRV_FRAME_HELLO 1
+#define MEMSRV_FRAME_MEM_SIZE 2
+#define MEMSRV_FRAME_STORE 3
+#define MEMSRV_FRAME_FETCH 4
+#define MEMSRV_FRAME_DATA 5
+#define MEMSRV_FRAME_STORED 6
+#define MEMSRV_FRAME_MISSING 7
+#define MEMSRV_FRAME_SYNC 8
+#define MEMSRV_FRAME_SESSION 9
+#define MEMSRV_FRAME_PUSH 10
+#define MEMSRV_FRAME_VM 11
+#define MEMSRV_FRAME_MOVE 12
+#define MEMSRV_FRAME_MOVED 13
+#define MEMSRV_FRAME_DROP 14
+#define MEMSRV_FRAME_RELEASE 15
+
+/* frame flags */
+#define MEMSRV_FRAME_CSUM 0x1
+#define MEMSRV_FRAME_END 0x2  /* last PUSH frame of a chunk */
+#define MEMSRV_FRAME_FULL 0x4  /* STORED over the quota of the VM */
+
+/* roles */
+#define MEMSRV_ROLE_MIGRATION 1  /* source of a split migration */
+#define MEMSRV_ROLE_PAGING 2  /* destination paging at runtime */
+#define MEMSRV_ROLE_PUSH 3  /* receives PUSH frames of its session */
+#define MEMSRV_ROLE_MOVE 4  /* another memory server, storing a MOVE */
+
+/* capabilities */
+#define MEMSRV_CAP_BATCH 0x1  /* multi-page frames */
+#define MEMSRV_CAP_COMPRESS 0x2  /* MEMSRV_ADDR_COMP */
+#define MEMSRV_CAP_ZERO 0x4  /* MEMSRV_ADDR_ZERO */
+#define MEMSRV_CAP_CSUM 0x8  /* MEMSRV_FRAME_CSUM */
+#define MEMSRV_CAP_ACK 0x10  /* STORED after each STORE */
+#define MEMSRV_CAP_DEDUP 0x20  /* MEMSRV_ADDR_HASH */
+#define MEMSRV_CAP_PUSH 0x40  /* SESSION, PUSH, versions in STORED */
+#define MEMSRV_CAP_TENANT 0x80  /* VM, MEMSRV_FRAME_FULL */
+#define MEMSRV_CAP_ROOM 0x100  /* room of the VM in STORED */
+#define MEMSRV_CAP_MOVE 0x200  /* MOVE, MOVED, DROP */
+#define MEMSRV_CAP_RELEASE 0x400  /* RELEASE */
+
+#define MEMSRV_CAPS (MEMSRV_CAP_BATCH | MEMSRV_CAP_COMPRESS | \
+                     MEMSRV_CAP_ZERO | MEMSRV_CAP_CSUM | MEMSRV_CAP_ACK | \
+                     MEMSRV_CAP_DEDUP | MEMSRV_CAP_PUSH | MEMSRV_CAP_TENANT | \
+                     MEMSRV_CAP_ROOM | MEMSRV_CAP_MOVE | MEMSRV_CAP_RELEASE)
+
+/* page address flags */
+#define MEMSRV_ADDR_ZERO 0x1
+#define MEMSRV_ADDR_COMP 0x2
+#define MEMSRV_ADDR_NONE 0x4
+#define MEMSRV_ADDR_HASH 0x8
+#define MEMSRV_ADDR_FLAGS ((uint64_t)MEMSRV_PAGE_SIZE - 1)
+
+#define MEMSRV_MAX_FRAME_PAGES 64  /* page records per frame */
+#define MEMSRV_MAX_FRAME \
+    (sizeof(struct memsrv_frame) + \
+     MEMSRV_MAX_FRAME_PAGES * (sizeof(struct memsrv_page) + MEMSRV_PAGE_SIZE))
+
+struct memsrv_frame {
+    uint32_t len;  /* payload bytes after this header */
+    uint16_t type;
+    uint16_t flags;
+    uint32_t nr;  /* # of page records or addresses */
+    uint32_t csum;
+} __attribute__((packed));
+
+struct memsrv_hello {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t role;
+    uint32_t caps;
+    uint32_t codec;  /* PAGE_CODEC_* */
+    uint64_t hash_key[2];  /* of memsrv_page_hash(), chosen by the server */
+} __attribute__((packed));
+
+struct memsrv_move {
+    uint32_t host;  /* IPv4 address, network order */
+    uint16_t port;
+    uint16_t pad;
+} __attribute__((packed));
+
+struct memsrv_page {
+    uint64_t addr;  /* | MEMSRV_ADDR_* */
+    uint32_t len;  /* payload bytes */
+    uint32_t version;  /* of the chunk in a PUSH frame, else 0 */
+} __attribute__((packed));
+
+void memsrv_tune_socket(int sock, int low_latency);
+int memsrv_handshake(int sock, int role, uint32_t caps, int codec,
+                     struct memsrv_hello *agreed);
+int memsrv_join(int sock, uint64_t session);
+int memsrv_select_vm(int sock, const uint8_t uuid[16]);
+int memsrv_mem_size(int sock, uint64_t size);
+uint32_t memsrv_csum(const struct iovec *iov, int iovcnt);
+void memsrv_page_hash(const uint64_t key[2], const void *page,
+                      uint64_t digest[2]);
+
+#endif /* __MEMSRV_H_ */
@@ -0,0 +1,1047 @@
+/*
+ * Page objects of the memory server.
+ *
+ * Object data is packed like zsmalloc: a compressed page goes to the
+ * smallest size class it fits, each class cutting MS_SLAB_SIZE slabs
+ * into equal slots.  Pages that do not compress go to the last class
+ * as they are.  Slabs are never freed, freed slots are reused by the
+ * next object of their class.
+ *
+ * Objects are found by digest: a page with the digest of an object
+ * already stored, and the same bytes, takes a reference on it instead
+ * of a copy.  A page whose digest collides with another one gets an
+ * object of its own, outside the digest table and never spilled.  The
+ * lock of the digest shard covers everything in its objects but the
+ * data.
+ *
+ * With a spill file, the coldest objects go to disk once the data in
+ * DRAM is over its limit.  The spill thread sweeps the digest shards
+ * like a clock, passing over objects used since its last turn, and
+ * writes up to MS_SPILL_BATCH of them at once to a log of MS_SEG_SIZE
+ * segments.  A segment is reused once none of its objects is left in
+ * it.  When no segment is free and a quarter of the log is dead, the
+ * spill thread cleans the emptiest segments first: their live objects
+ * are written again at the tail of the log.  Objects on disk are read
+ * by I/O threads and kept in DRAM again if there is room.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "memsrv.h"
+#include "memstore.h"
+#include "codec.h"
+
+#define MS_PAGE_SIZE MEMSRV_PAGE_SIZE
+
+#define MS_CLASS_STEP 64
+#define MS_NR_CLASSES (MS_PAGE_SIZE / MS_CLASS_STEP)
+#define MS_SLAB_SIZE (64 * 1024)
+
+#define MS_MAX_OBJS (1UL << 30)  /* reserved, touched as used */
+#define MS_DEDUP_SHARDS 64
+
+#define MS_SPILL_BATCH (1 << 20)  /* bytes written at once */
+#define MS_SPILL_RECS (MS_SPILL_BATCH / MS_CLASS_STEP)
+#define MS_SEG_SIZE (4 << 20)
+#define MS_IO_ALIGN 4096  /* of O_DIRECT */
+#define MS_IO_THREADS 8
+#define MS_CLEAN_SEGS 16  /* segments cleaned in one pass, at most half full */
+
+/* spilled down to, read back up to */
+#define MS_MEM_LOW(limit) ((limit) - (limit) / 8)
+
+/* where an object is */
+#define MS_OBJ_FREE 0
+#define MS_OBJ_MEM 1
+#define MS_OBJ_DISK 2
+
+struct ms_obj {
+    uint32_t refs;  /* page handles and readers */
+    uint16_t len;  /* bytes kept */
+    uint8_t where;  /* MS_OBJ_* */
+    uint8_t used;  /* fetched or shared since the last sweep */
+    uint32_t readers;  /* memstore_get() on disk, not released */
+    uint8_t indexed;  /* in the digest table */
+    uint64_t digest[2];  /* memsrv_page_hash() of the page */
+    union {
+        char *mem;
+        uint64_t off;  /* in the spill file */
+    } loc;
+};
+
+struct ms_class {
+    QemuMutex lock;
+    uint32_t size;  /* of a slot */
+    char *slab;  /* being cut */
+    uint32_t slab_used;
+    char **free;  /* freed slots */
+    unsigned long nr_free;
+    unsigned long free_size;
+};
+
+struct ms_dedup_ent {
+    uint64_t digest[2];
+    uint64_t h;  /* 0 if the slot is free */
+};
+
+struct ms_dedup_shard {
+    QemuMutex lock;
+    struct ms_dedup_ent *tab;  /* open addressing */
+    unsigned long size;  /* power of 2 */
+    unsigned long used;
+};
+
+/* an object in the batch being spilled or cleaned */
+struct ms_spill_rec {
+    uint64_t h;
+    uint64_t digest[2];
+    char *mem;
+    uint64_t from;  /* in the spill file, of an object cleaned */
+    uint32_t off;  /* in the batch */
+    uint32_t len;
+};
+
+struct ms_spill {
+    int fd;  /* -1 without a spill file */
+    bool direct;  /* O_DIRECT */
+    uint64_t mem_limit;  /* of object data in DRAM */
+
+    QemuMutex lock;  /* segments */
+    QemuCond wake;  /* over the limit */
+    uint32_t *seg_live;  /* bytes of objects in each segment */
+    uint64_t live_bytes;  /* of all segments */
+    unsigned long *free_segs;
+    unsigned long nr_segs;
+    unsigned long nr_free_segs;
+    unsigned long segs_size;
+    long cur_seg;  /* being filled, -1 if none */
+    uint32_t cur_off;
+
+    /* spill thread */
+    unsigned int hand_shard;
+    unsigned long hand_slot;
+    unsigned int clean_shard;  /* MS_DEDUP_SHARDS once swept */
+    unsigned long clean_slot;
+    char *buf;
+    struct ms_spill_rec *recs;
+    QemuThread thread;
+
+    /* reads */
+    QemuMutex io_lock;
+    QemuCond io_cond;
+    QSIMPLEQ_HEAD(, memstore_read) io_queue;
+    QemuThread io_threads[MS_IO_THREADS];
+};
+
+/* objects of all the pages, shared by all connections */
+struct ms_objects {
+    int codec;  /* PAGE_CODEC_*, of the compressed objects */
+    struct ms_obj *objs;  /* by id, from 1 */
+
+    QemuMutex id_lock;
+    unsigned long next_id;
+    unsigned long *free_ids;
+    unsigned long nr_free_ids;
+    unsigned long free_ids_size;
+
+    uint64_t mem_bytes;  /* in slots */
+    struct ms_class classes[MS_NR_CLASSES];
+    struct ms_dedup_shard dedup[MS_DEDUP_SHARDS];
+    struct ms_spill spill;
+};
+
+static struct ms_objects ms;
+
+static struct ms_obj *h_obj(uint64_t h)
+{
+    return &ms.objs[h >> 1];
+}
+
+static struct ms_class *len_class(uint32_t len)
+{
+    return &ms.classes[DIV_ROUND_UP(len, MS_CLASS_STEP) - 1];
+}
+
+static void spill_kick(void)
+{
+    qemu_mutex_lock(&ms.spill.lock);
+    qemu_cond_signal(&ms.spill.wake);
+    qemu_mutex_unlock(&ms.spill.lock);
+}
+
+/* a slot for len bytes, NULL when out of memory */
+static char *slot_alloc(uint32_t len)
+{
+    struct ms_class *cl = len_class(len);
+    char *p;
+
+    qemu_mutex_lock(&cl->lock);
+
+    if (cl->nr_free) {
+        p = cl->free[--cl->nr_free];
+    } else {
+        if (cl->slab == NULL || cl->slab_used + cl->size > MS_SLAB_SIZE) {
+            cl->slab = g_try_malloc(MS_SLAB_SIZE);
+            cl->slab_used = 0;
+            if (cl->slab == NULL) {
+                qemu_mutex_unlock(&cl->lock);
+                printf("memserver: out of memory\n");
+                return NULL;
+            }
+        }
+        p = cl->slab + cl->slab_used;
+        cl->slab_used += cl->size;
+    }
+
+    qemu_mutex_unlock(&cl->lock);
+
+    if (atomic_fetch_add(&ms.mem_bytes, cl->size) + cl->size >
+        ms.spill.mem_limit && ms.spill.fd >= 0)
+        spill_kick();
+
+    return p;
+}
+
+static void slot_free(char *p, uint32_t len)
+{
+    struct ms_class *cl = len_class(len);
+
+    qemu_mutex_lock(&cl->lock);
+    if (cl->nr_free == cl->free_size) {
+        cl->free_size = MAX(cl->free_size * 2, 1024);
+        cl->free = g_renew(char *, cl->free, cl->free_size);
+    }
+    cl->free[cl->nr_free++] = p;
+    qemu_mutex_unlock(&cl->lock);
+
+    atomic_sub(&ms.mem_bytes, cl->size);
+}
+
+/* a handle for a new object, 0 if there are too many */
+static uint64_t id_alloc(void)
+{
+    unsigned long id = 0;
+
+    qemu_mutex_lock(&ms.id_lock);
+    if (ms.nr_free_ids)
+        id = ms.free_ids[--ms.nr_free_ids];
+    else if (ms.next_id < MS_MAX_OBJS)
+        id = ms.next_id++;
+    qemu_mutex_unlock(&ms.id_lock);
+
+    return (uint64_t)id << 1;
+}
+
+static void id_free(uint64_t h)
+{
+    qemu_mutex_lock(&ms.id_lock);
+    if (ms.nr_free_ids == ms.free_ids_size) {
+        ms.free_ids_size = MAX(ms.free_ids_size * 2, 1024);
+        ms.free_ids = g_renew(unsigned long, ms.free_ids, ms.free_ids_size);
+    }
+    ms.free_ids[ms.nr_free_ids++] = h >> 1;
+    qemu_mutex_unlock(&ms.id_lock);
+}
+
+/* room for len bytes at the tail of the log (spill locked) */
+static uint64_t seg_reserve(uint32_t len)
+{
+    struct ms_spill *sp = &ms.spill;
+
+    if (sp->cur_seg < 0 || sp->cur_off + len > MS_SEG_SIZE) {
+        if (sp->cur_seg >= 0 && sp->seg_live[sp->cur_seg] == 0)
+            sp->free_segs[sp->nr_free_segs++] = sp->cur_seg;
+
+        if (sp->nr_free_segs) {
+            sp->cur_seg = sp->free_segs[--sp->nr_free_segs];
+        } else {
+            if (sp->nr_segs == sp->segs_size) {
+                sp->segs_size = MAX(sp->segs_size * 2, 256);
+                sp->seg_live = g_renew(uint32_t, sp->seg_live, sp->segs_size);
+                sp->free_segs = g_renew(unsigned long, sp->free_segs,
+                                        sp->segs_size);
+            }
+            sp->seg_live[sp->nr_segs] = 0;
+            sp->cur_seg = sp->nr_segs++;
+        }
+        sp->cur_off = 0;
+    }
+
+    sp->cur_off += len;
+
+    return (uint64_t)sp->cur_seg * MS_SEG_SIZE + sp->cur_off - len;
+}
+
+static void seg_add(uint64_t off, uint32_t len)
+{
+    qemu_mutex_lock(&ms.spill.lock);
+    ms.spill.seg_live[off / MS_SEG_SIZE] += len;
+    ms.spill.live_bytes += len;
+    qemu_mutex_unlock(&ms.spill.lock);
+}
+
+static void seg_release(uint64_t off, uint32_t len)
+{
+    struct ms_spill *sp = &ms.spill;
+    unsigned long seg = off / MS_SEG_SIZE;
+
+    qemu_mutex_lock(&sp->lock);
+    sp->seg_live[seg] -= len;
+    sp->live_bytes -= len;
+    if (sp->seg_live[seg] == 0 && seg != sp->cur_seg)
+        sp->free_segs[sp->nr_free_segs++] = seg;
+    qemu_mutex_unlock(&sp->lock);
+}
+
+static struct ms_dedup_shard *dedup_shard(const uint64_t digest[2])
+{
+    return &ms.dedup[digest[0] % MS_DEDUP_SHARDS];
+}
+
+/* the slot of digest, or the free one where it goes (shard locked) */
+static struct ms_dedup_ent *dedup_slot(struct ms_dedup_shard *sh,
+                                       const uint64_t digest[2])
+{
+    unsigned long mask = sh->size - 1;
+    unsigned long i = digest[1] & mask;
+
+    while (sh->tab[i].h &&
+           (sh->tab[i].digest[0] != digest[0] ||
+            sh->tab[i].digest[1] != digest[1]))
+        i = (i + 1) & mask;
+
+    return &sh->tab[i];
+}
+
+static void dedup_grow(struct ms_dedup_shard *sh)
+{
+    struct ms_dedup_ent *old = sh->tab;
+    unsigned long i, size = sh->size;
+
+    sh->size = size ? size * 2 : 1024;
+    sh->tab = g_new0(struct ms_dedup_ent, sh->size);
+
+    for (i = 0; i < size; i++) {
+        if (old[i].h)
+            *dedup_slot(sh, old[i].digest) = old[i];
+    }
+    g_free(old);
+}
+
+/* free a slot, moving up what was displaced past it (shard locked) */
+static void dedup_remove(struct ms_dedup_shard *sh, struct ms_dedup_ent *ent)
+{
+    unsigned long mask = sh->size - 1;
+    unsigned long i = ent - sh->tab, j = i, home;
+
+    for (;;) {
+        sh->tab[i].h = 0;
+
+        for (;;) {
+            j = (j + 1) & mask;
+            if (sh->tab[j].h == 0) {
+                sh->used--;
+                return;
+            }
+
+            /* stays unless its home is outside (i, j] */
+            home = sh->tab[j].digest[1] & mask;
+            if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+                continue;
+            break;
+        }
+
+        sh->tab[i] = sh->tab[j];
+        i = j;
+    }
+}
+
+/* drop a reference (shard locked) */
+static void obj_unref(struct ms_dedup_shard *sh, uint64_t h)
+{
+    struct ms_obj *o = h_obj(h);
+
+    if (--o->refs)
+        return;
+
+    if (o->indexed)
+        dedup_remove(sh, dedup_slot(sh, o->digest));
+    if (o->where == MS_OBJ_MEM)
+        slot_free(o->loc.mem, o->len);
+    else
+        seg_release(o->loc.off, o->len);
+    o->where = MS_OBJ_FREE;
+    id_free(h);
+}
+
+int memstore_codec(void)
+{
+    return ms.codec;
+}
+
+static int spill_read(uint64_t off, uint32_t len, char *buf);
+
+/*
+ * Whether the object h, which the caller holds a reference on, keeps
+ * page.  A spilled object is read back here.
+ */
+static bool obj_holds(uint64_t h, const void *page)
+{
+    struct memstore_read rd;
+    char buf[MS_PAGE_SIZE], raw[MS_PAGE_SIZE];
+    uint32_t len = memstore_len(h);
+
+    if (memstore_get(h, buf, &rd) == MEMSTORE_DISK) {
+        rd.buf = buf;
+        rd.ret = spill_read(rd.off, rd.len, buf);
+        memstore_release(&rd);
+        if (rd.ret)
+            return false;
+    }
+
+    if (len == MS_PAGE_SIZE)
+        return memcmp(buf, page, MS_PAGE_SIZE) == 0;
+
+    return page_decompress(ms.codec, buf, len, raw) == 0 &&
+           memcmp(raw, page, MS_PAGE_SIZE) == 0;
+}
+
+/*
+ * A reference on the object with digest, 0 if there is none.  With
+ * page, only on an object with the same bytes.
+ */
+uint64_t memstore_lookup(const uint64_t digest[2], const void *page)
+{
+    struct ms_dedup_shard *sh = dedup_shard(digest);
+    uint64_t h = 0;
+
+    qemu_mutex_lock(&sh->lock);
+    if (sh->size) {
+        h = dedup_slot(sh, digest)->h;
+        if (h) {
+            h_obj(h)->refs++;
+            h_obj(h)->used = 1;
+        }
+    }
+    qemu_mutex_unlock(&sh->lock);
+
+    if (h && page && !obj_holds(h, page)) {
+        memstore_put(h);
+        h = 0;
+    }
+
+    return h;
+}
+
+/* a new object with len bytes of data, indexed unless ent is NULL */
+static uint64_t obj_new(struct ms_dedup_shard *sh, struct ms_dedup_ent *ent,
+                        const uint64_t digest[2], const void *data,
+                        uint32_t len)
+{
+    struct ms_obj *o;
+    uint64_t h;
+    char *p;
+
+    p = slot_alloc(len);
+    if (p == NULL)
+        return 0;
+    h = id_alloc();
+    if (h == 0) {
+        printf("memserver: too many objects\n");
+        slot_free(p, len);
+        return 0;
+    }
+
+    memcpy(p, data, len);
+    o = h_obj(h);
+    o->refs = 1;
+    o->len = len;
+    o->where = MS_OBJ_MEM;
+    o->used = 0;
+    o->readers = 0;
+    o->indexed = ent != NULL;
+    o->digest[0] = digest[0];
+    o->digest[1] = digest[1];
+    o->loc.mem = p;
+
+    if (ent) {
+        ent->digest[0] = digest[0];
+        ent->digest[1] = digest[1];
+        ent->h = h;
+        sh->used++;
+    }
+
+    return h;
+}
+
+/*
+ * Like memstore_lookup() with page, storing len bytes of data, the
+ * form page is kept in, if there is no object for it.
+ */
+uint64_t memstore_add(const uint64_t digest[2], const void *data,
+                      uint32_t len, const void *page)
+{
+    struct ms_dedup_shard *sh = dedup_shard(digest);
+    struct ms_dedup_ent *ent;
+    uint64_t h;
+
+    qemu_mutex_lock(&sh->lock);
+
+    if (2 * (sh->used + 1) > sh->size)
+        dedup_grow(sh);
+
+    ent = dedup_slot(sh, digest);
+    if (ent->h == 0) {
+        h = obj_new(sh, ent, digest, data, len);
+        qemu_mutex_unlock(&sh->lock);
+        return h;
+    }
+
+    /* stored by another connection meanwhile, or a collision */
+    h = ent->h;
+    h_obj(h)->refs++;
+    qemu_mutex_unlock(&sh->lock);
+
+    if (obj_holds(h, page))
+        return h;
+    memstore_put(h);
+
+    printf("memserver: digest collision\n");
+
+    qemu_mutex_lock(&sh->lock);
+    h = obj_new(sh, NULL, digest, data, len);
+    qemu_mutex_unlock(&sh->lock);
+
+    return h;
+}
+
+/* drop the reference of a page handle */
+void memstore_put(uint64_t h)
+{
+    struct ms_dedup_shard *sh;
+
+    if (h == 0 || h == MEMSTORE_H_ZERO)
+        return;
+
+    sh = dedup_shard(h_obj(h)->digest);
+
+    qemu_mutex_lock(&sh->lock);
+    obj_unref(sh, h);
+    qemu_mutex_unlock(&sh->lock);
+}
+
+/* bytes kept for an object, MEMSRV_PAGE_SIZE if not compressed */
+uint32_t memstore_len(uint64_t h)
+{
+    return h_obj(h)->len;
+}
+
+/*
+ * Copy an object into buf, or if it is on disk, fill in rd for
+ * memstore_submit() and keep it there until memstore_release().
+ */
+int memstore_get(uint64_t h, void *buf, struct memstore_read *rd)
+{
+    struct ms_obj *o = h_obj(h);
+    struct ms_dedup_shard *sh = dedup_shard(o->digest);
+    int ret = MEMSTORE_MEM;
+
+    qemu_mutex_lock(&sh->lock);
+
+    o->used = 1;
+    if (o->where == MS_OBJ_MEM) {
+        memcpy(buf, o->loc.mem, o->len);
+    } else {
+        o->refs++;
+        o->readers++;
+        rd->h = h;
+        rd->off = o->loc.off;
+        rd->len = o->len;
+        ret = MEMSTORE_DISK;
+    }
+
+    qemu_mutex_unlock(&sh->lock);
+
+    return ret;
+}
+
+/* read rd on an I/O thread, rd->done() is called when it is there */
+void memstore_submit(struct memstore_read *rd)
+{
+    struct ms_spill *sp = &ms.spill;
+
+    qemu_mutex_lock(&sp->io_lock);
+    QSIMPLEQ_INSERT_TAIL(&sp->io_queue, rd, next);
+    qemu_cond_signal(&sp->io_cond);
+    qemu_mutex_unlock(&sp->io_lock);
+}
+
+/* done with a read, its object may come back to DRAM from rd->buf */
+void memstore_release(struct memstore_read *rd)
+{
+    struct ms_obj *o = h_obj(rd->h);
+    struct ms_dedup_shard *sh = dedup_shard(o->digest);
+    char *p;
+
+    qemu_mutex_lock(&sh->lock);
+
+    if (--o->readers == 0 && rd->ret == 0 && o->where == MS_OBJ_DISK &&
+        atomic_read(&ms.mem_bytes) + MS_PAGE_SIZE <
+        MS_MEM_LOW(ms.spill.mem_limit)) {
+        p = slot_alloc(o->len);
+        if (p) {
+            memcpy(p, rd->buf, o->len);
+            seg_release(o->loc.off, o->len);
+            o->loc.mem = p;
+            o->where = MS_OBJ_MEM;
+        }
+    }
+    obj_unref(sh, rd->h);
+
+    qemu_mutex_unlock(&sh->lock);
+}
+
+/* the aligned blocks around len bytes at off, for O_DIRECT */
+static int spill_read(uint64_t off, uint32_t len, char *buf)
+{
+    char blocks[2 * MS_IO_ALIGN] __attribute__((aligned(MS_IO_ALIGN)));
+    uint64_t start = QEMU_ALIGN_DOWN(off, MS_IO_ALIGN);
+    size_t span = QEMU_ALIGN_UP(off + len, MS_IO_ALIGN) - start;
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < off + len - start) {
+        ret = pread(ms.spill.fd, blocks + done, span - done, start + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            perror("memserver: spill read");
+            return ret < 0 ? -errno : -EIO;
+        }
+        done += ret;
+    }
+
+    memcpy(buf, blocks + (off - start), len);
+
+    return 0;
+}
+
+static void *io_thread(void *opaque)
+{
+    struct ms_spill *sp = &ms.spill;
+    struct memstore_read *rd;
+
+    for (;;) {
+        qemu_mutex_lock(&sp->io_lock);
+        while (QSIMPLEQ_EMPTY(&sp->io_queue))
+            qemu_cond_wait(&sp->io_cond, &sp->io_lock);
+        rd = QSIMPLEQ_FIRST(&sp->io_queue);
+        QSIMPLEQ_REMOVE_HEAD(&sp->io_queue, next);
+        qemu_mutex_unlock(&sp->io_lock);
+
+        rd->ret = spill_read(rd->off, rd->len, rd->buf);
+        rd->done(rd);
+    }
+
+    return NULL;
+}
+
+/* pick cold objects of the shards in turn and copy them into the batch */
+static int spill_collect(uint32_t *blen)
+{
+    struct ms_spill *sp = &ms.spill;
+    struct ms_dedup_shard *sh;
+    struct ms_spill_rec *rec;
+    struct ms_obj *o;
+    unsigned long i;
+    int turns, n = 0;
+
+    /* twice round: the first turn may only find objects used */
+    for (turns = 0; turns <= 2 * MS_DEDUP_SHARDS; turns++) {
+        sh = &ms.dedup[sp->hand_shard];
+
+        qemu_mutex_lock(&sh->lock);
+        for (i = sp->hand_slot; i < sh->size; i++) {
+            if (*blen + MS_PAGE_SIZE > MS_SPILL_BATCH || n == MS_SPILL_RECS)
+                break;
+            if (sh->tab[i].h == 0)
+                continue;
+
+            o = h_obj(sh->tab[i].h);
+            if (o->where != MS_OBJ_MEM)
+                continue;
+            if (o->used) {
+                o->used = 0;
+                continue;
+            }
+
+            rec = &sp->recs[n++];
+            rec->h = sh->tab[i].h;
+            rec->digest[0] = o->digest[0];
+            rec->digest[1] = o->digest[1];
+            rec->mem = o->loc.mem;
+            rec->off = *blen;
+            rec->len = o->len;
+            memcpy(sp->buf + *blen, o->loc.mem, o->len);
+            *blen += o->len;
+        }
+        qemu_mutex_unlock(&sh->lock);
+
+        if (i < sh->size) {
+            sp->hand_slot = i;
+            break;
+        }
+        sp->hand_shard = (sp->hand_shard + 1) % MS_DEDUP_SHARDS;
+        sp->hand_slot = 0;
+    }
+
+    return n;
+}
+
+/* write blen bytes of the batch at the tail of the log, at *base */
+static int spill_write(uint32_t blen, uint64_t *base)
+{
+    struct ms_spill *sp = &ms.spill;
+    uint32_t len;
+    size_t done = 0;
+    ssize_t ret;
+
+    len = QEMU_ALIGN_UP(blen, MS_IO_ALIGN);
+    memset(sp->buf + blen, 0, len - blen);
+
+    qemu_mutex_lock(&sp->lock);
+    *base = seg_reserve(len);
+    qemu_mutex_unlock(&sp->lock);
+
+    while (done < len) {
+        ret = pwrite(sp->fd, sp->buf + done, len - done, *base + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            perror("memserver: spill write");
+            return -1;
+        }
+        done += ret;
+    }
+
+    /* written through the page cache, which must not keep it */
+    if (!sp->direct) {
+        sync_file_range(sp->fd, *base, len, SYNC_FILE_RANGE_WAIT_BEFORE |
+                        SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(sp->fd, *base, len, POSIX_FADV_DONTNEED);
+    }
+
+    return 0;
+}
+
+/* write out one batch, the number of objects spilled or -1 */
+static int spill_batch(void)
+{
+    struct ms_spill *sp = &ms.spill;
+    struct ms_dedup_shard *sh;
+    struct ms_spill_rec *rec;
+    struct ms_obj *o;
+    uint32_t blen = 0;
+    uint64_t base;
+    int i, n;
+
+    n = spill_collect(&blen);
+    if (n == 0)
+        return 0;
+
+    if (spill_write(blen, &base))
+        return -1;
+
+    /* objects freed or stored again meanwhile stay as they are */
+    for (i = 0; i < n; i++) {
+        rec = &sp->recs[i];
+        sh = dedup_shard(rec->digest);
+
+        qemu_mutex_lock(&sh->lock);
+        o = h_obj(rec->h);
+        if (o->where == MS_OBJ_MEM && o->loc.mem == rec->mem &&
+            o->digest[0] == rec->digest[0] &&
+            o->digest[1] == rec->digest[1]) {
+            o->where = MS_OBJ_DISK;
+            o->loc.off = base + rec->off;
+            seg_add(o->loc.off, rec->len);
+            slot_free(rec->mem, rec->len);
+        }
+        qemu_mutex_unlock(&sh->lock);
+    }
+
+    return n;
+}
+
+/* the emptiest segments, if the log is to be cleaned */
+static int clean_pick(long *victims)
+{
+    struct ms_spill *sp = &ms.spill;
+    uint64_t size;
+    unsigned long seg;
+    int i, n = 0;
+
+    qemu_mutex_lock(&sp->lock);
+
+    size = (uint64_t)(sp->nr_segs - sp->nr_free_segs) * MS_SEG_SIZE;
+    if (sp->nr_free_segs || size - sp->live_bytes < size / 4)
+        goto out;
+
+    for (seg = 0; seg < sp->nr_segs; seg++) {
+        if (seg == sp->cur_seg || sp->seg_live[seg] == 0 ||
+            sp->seg_live[seg] > MS_SEG_SIZE / 2)
+            continue;
+        if (n == MS_CLEAN_SEGS &&
+            sp->seg_live[seg] >= sp->seg_live[victims[n - 1]])
+            continue;
+
+        /* kept sorted, the emptiest first */
+        if (n < MS_CLEAN_SEGS)
+            n++;
+        for (i = n - 1; i > 0 &&
+             sp->seg_live[victims[i - 1]] > sp->seg_live[seg]; i--)
+            victims[i] = victims[i - 1];
+        victims[i] = seg;
+    }
+
+out:
+    qemu_mutex_unlock(&sp->lock);
+
+    return n;
+}
+
+static bool clean_victim(const long *victims, int n, uint64_t off)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (victims[i] == off / MS_SEG_SIZE)
+            return true;
+    }
+
+    return false;
+}
+
+/* the objects of the victims not being read, swept from the last turn */
+static int clean_collect(const long *victims, int nr_victims, uint32_t *blen)
+{
+    struct ms_spill *sp = &ms.spill;
+    struct ms_dedup_shard *sh;
+    struct ms_spill_rec *rec;
+    struct ms_obj *o;
+    unsigned long i;
+    int n = 0;
+
+    for (; sp->clean_shard < MS_DEDUP_SHARDS; sp->clean_shard++) {
+        sh = &ms.dedup[sp->clean_shard];
+
+        qemu_mutex_lock(&sh->lock);
+        for (i = sp->clean_slot; i < sh->size; i++) {
+            if (*blen + MS_PAGE_SIZE > MS_SPILL_BATCH || n == MS_SPILL_RECS)
+                break;
+            if (sh->tab[i].h == 0)
+                continue;
+
+            o = h_obj(sh->tab[i].h);
+            if (o->where != MS_OBJ_DISK || o->readers ||
+                !clean_victim(victims, nr_victims, o->loc.off))
+                continue;
+
+            rec = &sp->recs[n++];
+            rec->h = sh->tab[i].h;
+            rec->digest[0] = o->digest[0];
+            rec->digest[1] = o->digest[1];
+            rec->from = o->loc.off;
+            rec->off = *blen;
+            rec->len = o->len;
+            *blen += o->len;
+        }
+        qemu_mutex_unlock(&sh->lock);
+
+        if (i < sh->size) {
+            sp->clean_slot = i;
+            break;
+        }
+        sp->clean_slot = 0;
+    }
+
+    return n;
+}
+
+/* move one batch of live objects out of the victims, as spill_batch() */
+static int clean_batch(long *victims, int nr_victims)
+{
+    struct ms_spill *sp = &ms.spill;
+    struct ms_dedup_shard *sh;
+    struct ms_spill_rec *rec;
+    struct ms_obj *o;
+    uint32_t blen = 0;
+    uint64_t base;
+    int i, n;
+
+    /* emptied ones may be reused for the batch itself */
+    qemu_mutex_lock(&sp->lock);
+    for (i = 0; i < nr_victims; i++) {
+        if (victims[i] >= 0 && sp->seg_live[victims[i]] == 0)
+            victims[i] = -1;
+    }
+    qemu_mutex_unlock(&sp->lock);
+
+    n = clean_collect(victims, nr_victims, &blen);
+    if (n == 0)
+        return 0;
+
+    for (i = 0; i < n; i++) {
+        rec = &sp->recs[i];
+        if (spill_read(rec->from, rec->len, sp->buf + rec->off))
+            return -1;
+    }
+
+    if (spill_write(blen, &base))
+        return -1;
+
+    /* objects read, freed or moved meanwhile stay as they are */
+    for (i = 0; i < n; i++) {
+        rec = &sp->recs[i];
+        sh = dedup_shard(rec->digest);
+
+        qemu_mutex_lock(&sh->lock);
+        o = h_obj(rec->h);
+        if (o->where == MS_OBJ_DISK && o->loc.off == rec->from &&
+            o->readers == 0 && o->digest[0] == rec->digest[0] &&
+            o->digest[1] == rec->digest[1]) {
+            o->loc.off = base + rec->off;
+            seg_add(o->loc.off, rec->len);
+            seg_release(rec->from, rec->len);
+        }
+        qemu_mutex_unlock(&sh->lock);
+    }
+
+    return n;
+}
+
+/* clean the emptiest segments for the next batches to go to */
+static void spill_clean(void)
+{
+    struct ms_spill *sp = &ms.spill;
+    long victims[MS_CLEAN_SEGS];
+    int n;
+
+    n = clean_pick(victims);
+    if (n == 0)
+        return;
+
+    sp->clean_shard = 0;
+    sp->clean_slot = 0;
+    while (clean_batch(victims, n) > 0)
+        ;
+}
+
+static void *spill_thread(void *opaque)
+{
+    struct ms_spill *sp = &ms.spill;
+    int ret;
+
+    for (;;) {
+        qemu_mutex_lock(&sp->lock);
+        while (atomic_read(&ms.mem_bytes) <= sp->mem_limit)
+            qemu_cond_wait(&sp->wake, &sp->lock);
+        qemu_mutex_unlock(&sp->lock);
+
+        spill_clean();
+
+        do {
+            ret = spill_batch();
+        } while (ret > 0 &&
+                 atomic_read(&ms.mem_bytes) > MS_MEM_LOW(sp->mem_limit));
+
+        /* nothing cold enough, or the disk failed: give it time */
+        if (ret <= 0)
+            sleep(1);
+    }
+
+    return NULL;
+}
+
+static int spill_init(const char *path)
+{
+    struct ms_spill *sp = &ms.spill;
+    int i;
+
+    sp->direct = true;
+    sp->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT,
+                  0600);
+    if (sp->fd < 0 && errno == EINVAL) {
+        /* tmpfs and a few others */
+        sp->direct = false;
+        sp->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    }
+    if (sp->fd < 0) {
+        perror("memserver: spill file");
+        return -1;
+    }
+
+    sp->cur_seg = -1;
+    sp->buf = qemu_memalign(MS_IO_ALIGN, MS_SPILL_BATCH);
+    sp->recs = g_new(struct ms_spill_rec, MS_SPILL_RECS);
+    qemu_cond_init(&sp->wake);
+    qemu_mutex_init(&sp->io_lock);
+    qemu_cond_init(&sp->io_cond);
+    QSIMPLEQ_INIT(&sp->io_queue);
+
+    qemu_thread_create(&sp->thread, "memserver-spill", spill_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+    for (i = 0; i < MS_IO_THREADS; i++)
+        qemu_thread_create(&sp->io_threads[i], "memserver-io", io_thread,
+                           NULL, QEMU_THREAD_DETACHED);
+
+    printf("memserver: spilling to %s over %lu MB\n", path,
+           (unsigned long)(sp->mem_limit >> 20));
+
+    return 0;
+}
+
+/* objects compressed with codec, spilled to spill_path if not NULL */
+int memstore_init(int codec, const char *spill_path, uint64_t mem_limit)
+{
+    struct ms_class *cl;
+    int i;
+
+    ms.codec = codec;
+
+    /* only touched where objects are */
+    ms.objs = mmap(NULL, MS_MAX_OBJS * sizeof(ms.objs[0]),
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ms.objs == MAP_FAILED) {
+        perror("memserver: mmap");
+        return -1;
+    }
+    ms.next_id = 1;
+    qemu_mutex_init(&ms.id_lock);
+
+    for (i = 0; i < MS_NR_CLASSES; i++) {
+        cl = &ms.classes[i];
+        qemu_mutex_init(&cl->lock);
+        cl->size = (i + 1) * MS_CLASS_STEP;
+    }
+
+    for (i = 0; i < MS_DEDUP_SHARDS; i++)
+        qemu_mutex_init(&ms.dedup[i].lock);
+
+    ms.spill.fd = -1;
+    ms.spill.mem_limit = mem_limit;
+    qemu_mutex_init(&ms.spill.lock);
+
+    if (spill_path)
+        return spill_init(spill_path);
+
+    return 0;
+}
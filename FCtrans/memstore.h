@@ -0,0 +1,46 @@
+#ifndef __MEMSTORE_H_
+#define __MEMSTORE_H_
+
+/*
+ * Page objects of the memory server.  An object holds one page content,
+ * compressed or not, referenced by every page handle with that content.
+ * It is kept in DRAM, or in the spill file once cold.
+ *
+ * A page handle: 0 if never stored, MEMSTORE_H_ZERO for a zero page,
+ * else the object.
+ */
+
+#include "qemu/queue.h"
+
+#define MEMSTORE_H_ZERO 1
+
+/* where memstore_get() found an object */
+#define MEMSTORE_MEM 0  /* copied out */
+#define MEMSTORE_DISK 1  /* to be read with memstore_submit() */
+
+/* reading a spilled object, which stays on disk until released */
+struct memstore_read {
+    uint64_t h;
+    uint64_t off;  /* in the spill file */
+    uint32_t len;
+    char *buf;  /* set by the caller, len bytes land here */
+    int ret;  /* 0 or -errno */
+    /* called on an I/O thread */
+    void (*done)(struct memstore_read *rd);
+    QSIMPLEQ_ENTRY(memstore_read) next;
+};
+
+int memstore_init(int codec, const char *spill_path, uint64_t mem_limit);
+int memstore_codec(void);
+
+uint64_t memstore_lookup(const uint64_t digest[2], const void *page);
+uint64_t memstore_add(const uint64_t digest[2], const void *data,
+                      uint32_t len, const void *page);
+void memstore_put(uint64_t h);
+
+uint32_t memstore_len(uint64_t h);
+int memstore_get(uint64_t h, void *buf, struct memstore_read *rd);
+void memstore_submit(struct memstore_read *rd);
+void memstore_release(struct memstore_read *rd);
+
+#endif /* __MEMSTORE_H_ */
@@ -0,0 +1,543 @@
+#include "smemv.h"
+
+#ifdef SMEMV
+#ifdef CONFIG_LINUX_IO_URING
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <liburing.h>
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "qemu/queue.h"
+#include "exec/ram_addr.h"
+#include "paging.h"
+
+/*
+ * io_uring transport: userfaultfd polling, socket receives and sends
+ * all go through one ring.  Submissions queued while handling a batch
+ * of completions are pushed with a single io_uring_submit_and_wait().
+ * Receive buffers and a pool of send slabs are registered with the
+ * ring, so that fixed reads and writes skip the page pinning per I/O.
+ */
+
+#define URING_ENTRIES 256
+#define URING_MAX_CONNS 64
+#define URING_TX_SLAB_SIZE (1024 * 1024)
+#define URING_TX_SLABS 16  /* registered send slabs shared by all sockets */
+
+enum {
+    URING_OP_POLL_UFD,
+    URING_OP_POLL_NOTIFY,
+    URING_OP_POLL_TIMER,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_POLL_ERR,
+};
+
+struct uring_conn;
+
+/* user_data of a submission */
+struct uring_op {
+    int type;
+    struct uring_conn *uc;
+};
+
+/* a piece of the send queue of a connection */
+struct uring_slab {
+    char *buf;
+    size_t len;  /* queued bytes */
+    size_t off;  /* bytes already sent */
+    int index;  /* registered buffer index, -1 if not registered */
+    QSIMPLEQ_ENTRY(uring_slab) next;
+};
+
+struct uring_conn {
+    struct paging_conn *conn;
+    int rx_index;  /* registered buffer index of rx_buf, -1 if not */
+    struct uring_op recv_op;
+    struct uring_op send_op;
+    struct uring_op err_op;  /* zero-copy completions on the error queue */
+    bool recv_busy;
+    bool send_busy;
+    bool err_busy;
+    struct uring_slab *tail;  /* slab being filled */
+    QSIMPLEQ_HEAD(, uring_slab) tx;
+};
+
+static struct io_uring ring;
+static int uring_ufd;
+static int uring_notify_fd;
+static int uring_timer_fd;
+static bool uring_running;
+static struct uring_op poll_op = { .type = URING_OP_POLL_UFD };
+static struct uring_op notify_op = { .type = URING_OP_POLL_NOTIFY };
+static struct uring_op timer_op = { .type = URING_OP_POLL_TIMER };
+
+static struct uring_conn *uconns[URING_MAX_CONNS];
+static int nr_uconns;
+
+static struct uring_slab slabs[URING_TX_SLABS];
+static QSIMPLEQ_HEAD(, uring_slab) free_slabs =
+    QSIMPLEQ_HEAD_INITIALIZER(free_slabs);
+
+/* get a submission entry, pushing queued ones if the ring is full */
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+
+    while ((sqe = io_uring_get_sqe(&ring)) == NULL)
+        io_uring_submit(&ring);
+
+    return sqe;
+}
+
+static void uring_arm_poll(struct uring_op *op, int fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    io_uring_prep_poll_add(sqe, fd, POLLIN);
+    io_uring_sqe_set_data(sqe, op);
+}
+
+static void uring_arm_err(struct uring_conn *uc)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    io_uring_prep_poll_add(sqe, uc->conn->sock, POLLERR);
+    io_uring_sqe_set_data(sqe, &uc->err_op);
+    uc->err_busy = true;
+}
+
+static void uring_arm_recv(struct uring_conn *uc)
+{
+    struct paging_conn *conn = uc->conn;
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    char *buf = conn->rx_buf + conn->rx_len;
+    size_t len = PAGING_RX_BUF_SIZE - conn->rx_len;
+
+    if (uc->rx_index >= 0)
+        io_uring_prep_read_fixed(sqe, conn->sock, buf, len, 0, uc->rx_index);
+    else
+        io_uring_prep_recv(sqe, conn->sock, buf, len, 0);
+
+    io_uring_sqe_set_data(sqe, &uc->recv_op);
+    uc->recv_busy = true;
+}
+
+static struct uring_slab *uring_slab_get(void)
+{
+    struct uring_slab *slab = QSIMPLEQ_FIRST(&free_slabs);
+
+    if (slab) {
+        QSIMPLEQ_REMOVE_HEAD(&free_slabs, next);
+    } else {
+        /* pool exhausted, use an unregistered one */
+        slab = g_new0(struct uring_slab, 1);
+        slab->buf = g_malloc(URING_TX_SLAB_SIZE);
+        slab->index = -1;
+    }
+
+    slab->len = 0;
+    slab->off = 0;
+
+    return slab;
+}
+
+static void uring_slab_put(struct uring_slab *slab)
+{
+    if (slab < slabs || slab >= slabs + URING_TX_SLABS) {
+        g_free(slab->buf);
+        g_free(slab);
+        return;
+    }
+
+    QSIMPLEQ_INSERT_HEAD(&free_slabs, slab, next);
+}
+
+static void *uring_tx_reserve(struct paging_conn *conn, size_t len)
+{
+    struct uring_conn *uc = conn->opaque;
+    struct uring_slab *slab = uc->tail;
+    void *p;
+
+    assert(len <= URING_TX_SLAB_SIZE);
+
+    /* bytes past the submitted range may still be appended */
+    if (slab == NULL || slab->len + len > URING_TX_SLAB_SIZE) {
+        slab = uring_slab_get();
+        QSIMPLEQ_INSERT_TAIL(&uc->tx, slab, next);
+        uc->tail = slab;
+    }
+
+    p = slab->buf + slab->len;
+    slab->len += len;
+
+    return p;
+}
+
+static int uring_flush(struct paging_conn *conn)
+{
+    struct uring_conn *uc = conn->opaque;
+    struct uring_slab *slab = QSIMPLEQ_FIRST(&uc->tx);
+    struct io_uring_sqe *sqe;
+    char *buf;
+    size_t len;
+
+    /* keep one send in flight per socket to preserve the byte order */
+    if (uc->send_busy || slab == NULL || slab->off == slab->len)
+        return 0;
+
+    buf = slab->buf + slab->off;
+    len = slab->len - slab->off;
+
+    sqe = uring_get_sqe();
+    if (slab->index >= 0)
+        io_uring_prep_write_fixed(sqe, conn->sock, buf, len, 0, slab->index);
+    else
+        io_uring_prep_send(sqe, conn->sock, buf, len, 0);
+
+    io_uring_sqe_set_data(sqe, &uc->send_op);
+    uc->send_busy = true;
+
+    return 0;
+}
+
+static int uring_send_iov(struct paging_conn *conn, const struct iovec *iov,
+                          int iovcnt)
+{
+    struct uring_conn *uc = conn->opaque;
+    struct uring_slab *slab = QSIMPLEQ_FIRST(&uc->tx);
+    ssize_t sent = 0;
+
+    /*
+     * With no send in flight and nothing queued, the socket is ours:
+     * write directly and leave only the rest to the ring.
+     */
+    if (!uc->send_busy && (slab == NULL || slab->off == slab->len)) {
+        sent = paging_sendv_nowait(conn, iov, iovcnt);
+        if (sent < 0)
+            return -1;
+    }
+
+    paging_conn_queue_iov(conn, iov, iovcnt, sent);
+
+    return uring_flush(conn);
+}
+
+/* a closing connection with no I/O left, see uring_close_conn() */
+static void uring_conn_free(struct uring_conn *uc)
+{
+    struct uring_slab *slab;
+    int i;
+
+    for (i = 0; i < nr_uconns; i++) {
+        if (uconns[i] == uc) {
+            uconns[i] = uconns[--nr_uconns];
+            break;
+        }
+    }
+
+    while ((slab = QSIMPLEQ_FIRST(&uc->tx)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&uc->tx, next);
+        uring_slab_put(slab);
+    }
+
+    /* a registered rx_buf keeps its slot, it is just not read into */
+    paging_conn_free(uc->conn);
+    g_free(uc);
+}
+
+static void uring_close_conn(struct paging_conn *conn)
+{
+    struct uring_conn *uc = conn->opaque;
+
+    conn->closing = true;
+
+    /* otherwise uring_complete_send() shuts down once the queue is out */
+    if (!uc->send_busy && shutdown(conn->sock, SHUT_WR))
+        perror("paging: shutdown");
+}
+
+static int uring_complete_send(struct uring_conn *uc, int res)
+{
+    struct paging_conn *conn = uc->conn;
+    struct uring_slab *slab = QSIMPLEQ_FIRST(&uc->tx);
+
+    uc->send_busy = false;
+
+    if (conn->closing && !uc->recv_busy && !uc->err_busy) {
+        uring_conn_free(uc);
+        return 0;
+    }
+
+    if (res < 0) {
+        if (conn->closing)
+            return 0;  /* the memory server is gone, its EOF frees uc */
+        if (res != -EINTR && res != -EAGAIN) {
+            fprintf(stderr, "paging: send: %s\n", strerror(-res));
+            return -1;
+        }
+    } else {
+        slab->off += res;
+    }
+
+    if (slab->off == slab->len) {
+        if (slab == uc->tail) {
+            /* reuse the slab being filled */
+            slab->len = 0;
+            slab->off = 0;
+        } else {
+            QSIMPLEQ_REMOVE_HEAD(&uc->tx, next);
+            uring_slab_put(slab);
+        }
+    }
+
+    if (uring_flush(conn))
+        return -1;
+
+    if (conn->closing && !uc->send_busy && shutdown(conn->sock, SHUT_WR))
+        perror("paging: shutdown");
+
+    return 0;
+}
+
+static int uring_complete_recv(struct uring_conn *uc, int res)
+{
+    struct paging_conn *conn = uc->conn;
+
+    uc->recv_busy = false;
+
+    if (conn->closing) {
+        if (res > 0 || res == -EINTR || res == -EAGAIN) {
+            uring_arm_recv(uc);  /* late responses are dropped */
+        } else if (!uc->send_busy && !uc->err_busy) {
+            uring_conn_free(uc);
+        }
+        return 0;
+    }
+
+    if (res == 0) {
+        printf("pagein: host %u closed connection\n", conn->host_id);
+        return -1;
+    }
+
+    if (res < 0) {
+        if (res != -EINTR && res != -EAGAIN) {
+            fprintf(stderr, "pagein: recv: %s\n", strerror(-res));
+            return -1;
+        }
+    } else {
+        conn->rx_len += res;
+
+        if (paging_conn_received(conn))
+            return -1;
+    }
+
+    uring_arm_recv(uc);
+
+    return 0;
+}
+
+static int uring_complete_err(struct uring_conn *uc, int res)
+{
+    struct paging_conn *conn = uc->conn;
+
+    uc->err_busy = false;
+
+    paging_conn_reap(conn);
+
+    /* a hung up socket stays readable, its EOF is seen by the receive */
+    if (conn->closing) {
+        if (!uc->recv_busy && !uc->send_busy)
+            uring_conn_free(uc);
+    } else if (res < 0 || !(res & POLLHUP)) {
+        uring_arm_err(uc);
+    }
+
+    return 0;
+}
+
+static int uring_complete(struct uring_op *op, int res)
+{
+    switch (op->type) {
+    case URING_OP_POLL_UFD:
+        if (res < 0 && res != -EINTR) {
+            fprintf(stderr, "poll ufd: %s\n", strerror(-res));
+            return -1;
+        }
+        if (paging_handle_ufd())
+            return -1;
+        uring_arm_poll(&poll_op, uring_ufd);
+        return 0;
+
+    case URING_OP_POLL_NOTIFY:
+        if (paging_handle_notify())
+            return -1;
+        uring_arm_poll(&notify_op, uring_notify_fd);
+        return 0;
+
+    case URING_OP_POLL_TIMER:
+        if (paging_handle_timer())
+            return -1;
+        uring_arm_poll(&timer_op, uring_timer_fd);
+        return 0;
+
+    case URING_OP_RECV:
+        return uring_complete_recv(op->uc, res);
+
+    case URING_OP_SEND:
+        return uring_complete_send(op->uc, res);
+
+    case URING_OP_POLL_ERR:
+        return uring_complete_err(op->uc, res);
+    }
+
+    return -1;
+}
+
+/* register receive buffers and send slabs of the known connections */
+static void uring_register_buffers(void)
+{
+    struct iovec iov[URING_MAX_CONNS + URING_TX_SLABS];
+    struct uring_slab *slab;
+    int i, n = 0;
+
+    for (i = 0; i < nr_uconns; i++) {
+        iov[n].iov_base = uconns[i]->conn->rx_buf;
+        iov[n].iov_len = PAGING_RX_BUF_SIZE;
+        n++;
+    }
+
+    for (i = 0; i < URING_TX_SLABS; i++) {
+        iov[n].iov_base = slabs[i].buf;
+        iov[n].iov_len = URING_TX_SLAB_SIZE;
+        n++;
+    }
+
+    if (io_uring_register_buffers(&ring, iov, n)) {
+        /* e.g. RLIMIT_MEMLOCK, plain recv/send still work */
+        printf("paging: io_uring buffers not registered\n");
+        return;
+    }
+
+    for (i = 0; i < nr_uconns; i++)
+        uconns[i]->rx_index = i;
+
+    QSIMPLEQ_FOREACH(slab, &free_slabs, next)
+        slab->index = nr_uconns + (slab - slabs);
+}
+
+static int uring_init(int fd, int nfd, int tfd)
+{
+    struct io_uring_probe *probe;
+    bool supported;
+    int i;
+
+    if (io_uring_queue_init(URING_ENTRIES, &ring, 0))
+        return -1;
+
+    /* sockets need IORING_OP_SEND/RECV (Linux 5.6) */
+    probe = io_uring_get_probe_ring(&ring);
+    supported = probe &&
+                io_uring_opcode_supported(probe, IORING_OP_SEND) &&
+                io_uring_opcode_supported(probe, IORING_OP_RECV);
+    io_uring_free_probe(probe);
+
+    if (!supported) {
+        io_uring_queue_exit(&ring);
+        return -1;
+    }
+
+    uring_ufd = fd;
+    uring_notify_fd = nfd;
+    uring_timer_fd = tfd;
+
+    for (i = 0; i < URING_TX_SLABS; i++) {
+        slabs[i].buf = qemu_memalign(TARGET_PAGE_SIZE, URING_TX_SLAB_SIZE);
+        slabs[i].index = -1;
+        QSIMPLEQ_INSERT_TAIL(&free_slabs, &slabs[i], next);
+    }
+
+    return 0;
+}
+
+static int uring_add_conn(struct paging_conn *conn)
+{
+    struct uring_conn *uc;
+
+    if (nr_uconns == URING_MAX_CONNS) {
+        printf("paging: too many io_uring connections\n");
+        return -1;
+    }
+
+    uc = g_new0(struct uring_conn, 1);
+    uc->conn = conn;
+    uc->rx_index = -1;
+    uc->recv_op.type = URING_OP_RECV;
+    uc->recv_op.uc = uc;
+    uc->send_op.type = URING_OP_SEND;
+    uc->send_op.uc = uc;
+    uc->err_op.type = URING_OP_POLL_ERR;
+    uc->err_op.uc = uc;
+    QSIMPLEQ_INIT(&uc->tx);
+
+    conn->opaque = uc;
+    uconns[nr_uconns++] = uc;
+
+    /* added after the loop started, receive into the unregistered buffer */
+    if (uring_running) {
+        uring_arm_recv(uc);
+        uring_arm_err(uc);
+    }
+
+    return 0;
+}
+
+static void uring_run(void)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head, n;
+    int i, ret;
+
+    uring_register_buffers();
+    uring_running = true;
+
+    uring_arm_poll(&poll_op, uring_ufd);
+    uring_arm_poll(&notify_op, uring_notify_fd);
+    uring_arm_poll(&timer_op, uring_timer_fd);
+    for (i = 0; i < nr_uconns; i++) {
+        uring_arm_recv(uconns[i]);
+        uring_arm_err(uconns[i]);
+    }
+
+    while (1) {
+        ret = io_uring_submit_and_wait(&ring, 1);
+        if (ret < 0 && ret != -EINTR) {
+            fprintf(stderr, "io_uring_submit_and_wait: %s\n", strerror(-ret));
+            return;
+        }
+
+        n = 0;
+        io_uring_for_each_cqe(&ring, head, cqe) {
+            n++;
+            if (uring_complete(io_uring_cqe_get_data(cqe), cqe->res)) {
+                io_uring_cq_advance(&ring, n);
+                return;
+            }
+        }
+        io_uring_cq_advance(&ring, n);
+    }
+}
+
+const struct paging_transport paging_uring_transport = {
+    .name = "io_uring",
+    .init = uring_init,
+    .add_conn = uring_add_conn,
+    .tx_reserve = uring_tx_reserve,
+    .flush = uring_flush,
+    .send_iov = uring_send_iov,
+    .close_conn = uring_close_conn,
+    .run = uring_run,
+};
+#endif /* CONFIG_LINUX_IO_URING */
+#endif /* SMEMV */
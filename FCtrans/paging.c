@@ -4,18 +4,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
-#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
 #include "qemu/osdep.h"
 #include "cpu.h"
 #include "qemu/sockets.h"
 #include "qemu/rcu_queue.h"
 #include "qemu/bitops.h"
+#include "qemu/queue.h"
+#include "qemu/iov.h"
 #include "exec/ram_addr.h"
 #include "qapi/error.h"
 #include "rp.h"
+#include "evict.h"
+#include "paging.h"
+#include "memsrv.h"
+#include "codec.h"
+#include "qemu/cutils.h"
 #include "qemu/timer.h"
+#include "sysemu/sysemu.h"
 
 #define __NR_userfaultfd 323
 #include "userfaultfd.h"
@@ -34,388 +44,3029 @@
 #define FCtrans_log
 extern unsigned long pagein_num;
 extern unsigned long pageout_num;
+
+#define PAGING_MAX_EVENTS 64  /* events handled per epoll_wait() */
+#define PAGING_MAX_MSGS 16  /* userfaultfd messages read at once */
+
+#define EVICT_LOW_WMARK (4 * CHUNK_PAGES)
+#define EVICT_HIGH_WMARK (16 * CHUNK_PAGES)
+
+/*
+ * A paged-out chunk is stored on up to this many sub-hosts.  Page-in
+ * asks the copy expected to answer first and, if the faulted page is
+ * late, the other one as well.
+ */
+#define PAGING_REPLICAS 2
+#define PAGING_HEDGE_MIN_US 500  /* never hedge earlier than this */
+#define PAGING_HEDGE_FACTOR 4  /* hedge after so many usual latencies */
+#define PAGING_LAT_WEIGHT 8  /* a new latency sample counts 1/8 */
+
+/*
+ * Chunks held by one sub-host are moved to another by their memory
+ * servers, without going through the main host, when a sub-host is
+ * full or holds that many more pages than the emptiest one.
+ */
+#define PAGING_REBALANCE_MS 1000  /* one move started per tick at most */
+#define PAGING_REBALANCE_SLACK (64 * CHUNK_PAGES)
+#define PAGING_REBALANCE_SCAN 1024  /* chunks looked at per tick */
+#define PAGING_MAX_MOVES 4
+
+/*
+ * Drain, see paging_drain(): the chunks on the sub-hosts are fetched
+ * back hottest first, whole chunks over the bulk connections, at the
+ * rate asked for.
+ */
+#define PAGING_DRAIN_TICK_MS 10
+#define PAGING_DRAIN_IDLE_MS 100  /* after a pass found only busy chunks */
+#define PAGING_DRAIN_DEPTH 4  /* chunks in flight */
+#define PAGING_DRAIN_MAX_RATE (1ULL << 40)  /* bytes/s, taken as unlimited */
+
+/* zero-copy completions looked for while sent batches wait on them */
+#define PAGING_ZC_REAP_MS 10
+
+/* free main-host pages the reclaimer keeps in reserve */
+unsigned long evict_low_wmark = EVICT_LOW_WMARK;  /* wake up below this */
+unsigned long evict_high_wmark = EVICT_HIGH_WMARK;  /* reclaim up to this */
+
+/* a chunk pulled out of the guest, waiting to be sent */
+struct evict_batch {
+    ram_addr_t pa_start;
+    unsigned int host_id;
+    unsigned int replica;  /* second sub-host, RP_HID_UNDEF if none */
+    bool clean;  /* dropped, host_id still has the contents */
+    char *data;  /* pages at their offset in the chunk */
+    unsigned long pulled[BITS_TO_LONGS(CHUNK_PAGES)];
+
+    /* zero-copy sends referencing the batch, conn NULL if none */
+    struct paging_conn *conn;
+    uint32_t zc_id;
+    struct paging_conn *replica_conn;
+    uint32_t replica_zc_id;
+
+    /* STORE frames, kept until the kernel is done with them */
+    struct memsrv_frame frames[CHUNK_PAGES];
+    struct memsrv_page desc[CHUNK_PAGES];  /* one per pulled page */
+    char *payload[CHUNK_PAGES];  /* NULL for zero pages */
+    int nr_desc;
+    char *cbuf;  /* compressed pages */
+    QSIMPLEQ_ENTRY(evict_batch) next;
+};
+
+/* a chunk being moved between sub-hosts, see rebalance() */
+struct paging_move {
+    bool busy;
+    unsigned long chunk;
+    unsigned int from, to;
+    uint64_t addrs[CHUNK_PAGES];  /* its pages on from */
+    int nr_pages;
+    bool paged_in;  /* meanwhile, kept off the evict index until done */
+};
+
+/*
+ * a fault on a chunk being evicted, retried as it came once the chunk
+ * is sent or kept: a write fault on a chunk that stayed must still be
+ * write-enabled
+ */
+struct deferred_fault {
+    char *addr;
+    ram_addr_t pa;
+    bool wp;
+    QSIMPLEQ_ENTRY(deferred_fault) next;
+};
+
+static int ufd;
+static int epfd;
+
+static const struct paging_transport *transport;
+
+/*
+ * host id -> connections: faults are fetched over the first one, the
+ * others carry the page-out of chunks, so a large write-back does not
+ * hold up a page-in behind it.
+ */
+#define PAGING_CHAN_FAULT 0
+
+static struct paging_conn *conns[RP_HID_UNDEF][SUBHOST_CHANNELS];
+static int host_channels[RP_HID_UNDEF];  /* # of connections in use */
+
+/*
+ * The connections to all sub-hosts are one session, each sub-host
+ * pushes the chunks it expects to be faulted next over another one.
+ */
+static uint64_t paging_session;
+static struct paging_conn *push_conns[RP_HID_UNDEF];
+
+/* over the quota of the VM, no page-out there until the next aging */
+static bool host_full[RP_HID_UNDEF];
+
+/* page-ins sent and not fully answered, time to the first page (ns) */
+static unsigned int pagein_queued[RP_HID_UNDEF];
+static int64_t pagein_latency[RP_HID_UNDEF];
+/* chunks stored and not acknowledged, bytes the VM may still store */
+static unsigned int pageout_queued[RP_HID_UNDEF];
+static uint64_t host_room[RP_HID_UNDEF];
+
+/* page-ins waiting for their first page, the replica asked when late */
+static QTAILQ_HEAD(, pagein_req) hedge_list =
+    QTAILQ_HEAD_INITIALIZER(hedge_list);
+static int timer_fd;  /* timerfd, at the earliest hedge or rebalance */
+static int64_t timer_deadline;  /* 0 if disarmed */
+
+/*
+ * Outgoing migration: the pages on the sub-hosts are handed over where
+ * they are, see ram_save_page_1_n().  Meanwhile no sub-host drops a
+ * chunk, and once the guest is stopped nothing is paged out.
+ */
+static bool handing_over;
+static bool pageout_frozen;  /* under evict_lock */
+static int evict_running;  /* evict_chunk() calls, under evict_lock */
+
+/* fault thread only */
+static struct paging_move moves[PAGING_MAX_MOVES];
+static unsigned long *moving_chunks;
+static unsigned long rebalance_cursor;
+static int64_t rebalance_next;  /* 0 if the sub-hosts cannot move */
+
+/* bytes/s the drain may fetch, 0 if not draining (any thread) */
+static uint64_t drain_rate;
+static bool draining;  /* under evict_lock, no page-out meanwhile */
+
+/* fault thread only */
+static bool drain_active;
+static int64_t drain_next;  /* next tick, 0 if none */
+static int64_t drain_last;  /* of the last tick */
+static int64_t drain_budget;  /* bytes that may be fetched now */
+static unsigned long *drain_order;  /* remote chunks, hottest first */
+static uint16_t *drain_hot;  /* 1 + hotness of a remote chunk, else 0 */
+static unsigned long drain_len, drain_pos;
+static int drain_inflight;
+static bool drain_starved;  /* short of main-host memory */
+
+/* STOREs of a chunk not acknowledged yet (fault thread) */
+static uint16_t *storing_chunks;
+/* of each chunk at its last STORED, older pushes are stale */
+static uint32_t *chunk_version;
+
+/* chunks with a page-in in flight */
+static unsigned long *inflight_chunks;
+
+/* main-host chunks by hotness */
+static struct evict_index *evict_index;
+static unsigned long nr_chunks;
+
+static QemuMutex evict_lock;  /* evicting_chunks, evicted */
+static QemuCond evict_cond;
+static bool evict_kicked;
+static unsigned long *evicting_chunks;  /* pulled but not sent yet */
+static unsigned long *clean_chunks;  /* unmodified since paged in */
+static unsigned char *clean_host;  /* sub-host holding the clean copy */
+static unsigned char *clean_replica;  /* and a second one, or undef */
+static bool wp_enabled;  /* userfaultfd write-protect is available */
+static bool pull_enabled = true;  /* until UFFDIO_PULL is refused */
+static char *zero_page;  /* source of write-protected zero pages */
+static char *inflate_page;  /* the faulted page, decompressed */
+
+/*
+ * Compressed page-in responses are inflated by codec workers, only the
+ * faulted page is decompressed by the fault thread itself.
+ */
+#define PAGING_CODEC_WORKERS 2
+
+static bool codec_running;  /* with the compress capability */
+static QemuMutex codec_lock;
+static QemuCond codec_cond;
+static QSIMPLEQ_HEAD(, pagein_req) codec_queue =
+    QSIMPLEQ_HEAD_INITIALIZER(codec_queue);  /* waiting for a worker */
+static QSIMPLEQ_HEAD(, pagein_req) inflated =
+    QSIMPLEQ_HEAD_INITIALIZER(inflated);  /* ready to be installed */
+/* sent batches the kernel may still read from (fault thread) */
+static QSIMPLEQ_HEAD(, evict_batch) zc_batches =
+    QSIMPLEQ_HEAD_INITIALIZER(zc_batches);
+static QSIMPLEQ_HEAD(, evict_batch) evicted =
+    QSIMPLEQ_HEAD_INITIALIZER(evicted);
+static int notify_fd;  /* eventfd, batches are ready */
+
+/* fault thread only */
+static QSIMPLEQ_HEAD(, deferred_fault) deferred_faults =
+    QSIMPLEQ_HEAD_INITIALIZER(deferred_faults);
+
+void *qemu_get_ram_ptr_safe(ram_addr_t addr);
+
+#ifdef FCtrans
+extern unsigned long *FCtrans_bitmap;
+extern unsigned long FCtrans_bitmap_size;
+extern unsigned long free_pages_in_main_host;
+int guest_flag = 0;
+#endif
+
+#define PAGING_MAX_STAGING 16  /* cached staging buffers */
+
+/* free staging buffers of CHUNK_SIZE */
+static char *staging_cache[PAGING_MAX_STAGING];
+static int nr_staging_cache;
+
+/* append bytes to the send queue of a connection */
+static void paging_conn_queue(struct paging_conn *conn, const void *buf,
+                              size_t len)
+{
+    memcpy(transport->tx_reserve(conn, len), buf, len);
+}
+
+/*
+ * Write as much of iov as the socket takes without blocking and return
+ * the # of bytes written.  Only to be used while nothing else is queued
+ * on the connection.  Sent with MSG_ZEROCOPY when the socket allows it,
+ * see paging_conn_reap().
+ */
+ssize_t paging_sendv_nowait(struct paging_conn *conn, const struct iovec *iov,
+                            int iovcnt)
+{
+    struct msghdr msg = { 0 };
+    ssize_t ret, sent = 0;
+    int i, cnt;
+
+    for (i = 0; i < iovcnt; i += cnt) {
+        cnt = MIN(iovcnt - i, IOV_MAX);
+        msg.msg_iov = (struct iovec *)iov + i;
+        msg.msg_iovlen = cnt;
+
+        ret = zc_sendmsg(&conn->zc, &msg, MSG_DONTWAIT);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                cnt = 0;
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            perror("paging: sendmsg");
+            return -1;
+        }
+        sent += ret;
+
+        if ((size_t)ret < iov_size(iov + i, cnt))
+            break;  /* socket buffer full */
+    }
+
+    return sent;
+}
+
+/* queue iov from byte offset skip on, copying it into the send queue */
+void paging_conn_queue_iov(struct paging_conn *conn, const struct iovec *iov,
+                           int iovcnt, size_t skip)
+{
+    size_t len;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+
+        len = iov[i].iov_len - skip;
+        memcpy(transport->tx_reserve(conn, len),
+               (char *)iov[i].iov_base + skip, len);
+        skip = 0;
+    }
+}
+
+/* connection carrying the page-out of a chunk */
+static struct paging_conn *bulk_conn(unsigned int host_id,
+                                     unsigned long chunk)
+{
+    int width = host_channels[host_id];
+
+    if (width <= 1)
+        return conns[host_id][PAGING_CHAN_FAULT];
+
+    return conns[host_id][1 + chunk % (width - 1)];
+}
+
+static struct paging_conn *paging_conn_new(int sock, unsigned int host_id,
+                                           int role)
+{
+    struct paging_conn *conn;
+    struct memsrv_hello hello;
+
+    memsrv_tune_socket(sock, role == MEMSRV_ROLE_PAGING);
+
+    /* the socket is still blocking here */
+    /* compressed only with the codec workers running */
+    if (memsrv_handshake(sock, role,
+                         codec_running ? MEMSRV_CAPS :
+                         MEMSRV_CAPS & ~MEMSRV_CAP_COMPRESS,
+                         codec_running ? page_codec_wanted() : PAGE_CODEC_NONE,
+                         &hello))
+        return NULL;
+
+    /* pages are kept by the UUID of the VM */
+    if (!(hello.caps & MEMSRV_CAP_TENANT)) {
+        printf("paging: memory server without VMs\n");
+        return NULL;
+    }
+    if (memsrv_select_vm(sock, qemu_uuid.data))
+        return NULL;
+
+    if ((hello.caps & MEMSRV_CAP_PUSH) && memsrv_join(sock, paging_session))
+        return NULL;
+
+    conn = g_new0(struct paging_conn, 1);
+    conn->sock = sock;
+    conn->caps = hello.caps;
+    conn->codec = hello.codec;
+    conn->host_id = host_id;
+    conn->rx_buf = g_malloc(PAGING_RX_BUF_SIZE);
+    QSIMPLEQ_INIT(&conn->pending);
+    QSIMPLEQ_INIT(&conn->stores);
+
+    qemu_set_nonblock(sock);
+    zc_init(&conn->zc, sock);
+
+    if (transport->add_conn(conn)) {
+        g_free(conn->rx_buf);
+        g_free(conn);
+        return NULL;
+    }
+
+    return conn;
+}
+
+/* free a connection closed by close_conn, for the transports */
+void paging_conn_free(struct paging_conn *conn)
+{
+    close(conn->sock);
+    g_free(conn->rx_buf);
+    g_free(conn->tx_buf);
+    g_free(conn);
+}
+
+/* queue FETCH frames for the addresses of a chunk, in that order */
+static void send_pagein_request(struct paging_conn *conn, uint64_t *addrs,
+                                int nr)
+{
+    struct memsrv_frame frame;
+    struct iovec iov;
+    int per_frame, cnt;
+
+    per_frame = (conn->caps & MEMSRV_CAP_BATCH) ? CHUNK_PAGES : 1;
+
+    for (; nr > 0; addrs += cnt, nr -= cnt) {
+        cnt = MIN(nr, per_frame);
+
+        memset(&frame, 0, sizeof(frame));
+        frame.len = cnt * sizeof(addrs[0]);
+        frame.type = MEMSRV_FRAME_FETCH;
+        frame.nr = cnt;
+
+        if (conn->caps & MEMSRV_CAP_CSUM) {
+            iov.iov_base = addrs;
+            iov.iov_len = frame.len;
+            frame.flags |= MEMSRV_FRAME_CSUM;
+            frame.csum = memsrv_csum(&iov, 1);
+        }
+
+        paging_conn_queue(conn, &frame, sizeof(frame));
+        paging_conn_queue(conn, addrs, frame.len);
+    }
+}
+
+static char *staging_get(void)
+{
+    if (nr_staging_cache)
+        return staging_cache[--nr_staging_cache];
+
+    return qemu_memalign(TARGET_PAGE_SIZE, CHUNK_SIZE);
+}
+
+static void staging_put(char *buf)
+{
+    if (nr_staging_cache < PAGING_MAX_STAGING)
+        staging_cache[nr_staging_cache++] = buf;
+    else
+        qemu_vfree(buf);
+}
+
+/*
+ * Map len bytes at dst from src with one UFFDIO_COPY.  Pages already
+ * present are skipped.  With UFFDIO_COPY_MODE_DONTWAKE the faulting
+ * threads must be woken by uffd_wake() afterwards.
+ */
+static int uffd_copy_range(unsigned long dst, unsigned long src,
+                           unsigned long len, __u64 mode)
+{
+    struct uffdio_copy copy_struct;
+    unsigned long done;
+
+    while (len) {
+        copy_struct.dst = dst;
+        copy_struct.src = src;
+        copy_struct.len = len;
+        copy_struct.mode = mode;
+        copy_struct.copy = 0;
+
+        if (ioctl(ufd, UFFDIO_COPY, &copy_struct) == 0)
+            return 0;
+
+        if (copy_struct.copy > 0) {
+            done = copy_struct.copy;  /* partially copied */
+        } else if (errno == EEXIST) {
+            done = TARGET_PAGE_SIZE;
+        } else if (errno == EAGAIN) {
+            done = 0;
+        } else {
+            perror("pagein: uffdio_copy");
+            return -1;
+        }
+
+        dst += done;
+        src += done;
+        len -= done;
+    }
+
+    return 0;
+}
+
+/* map zero pages to [start, start + len) with one UFFDIO_ZEROPAGE */
+static int uffd_zero_range(unsigned long start, unsigned long len)
+{
+    struct uffdio_zeropage zero_struct;
+    unsigned long done;
+
+    while (len) {
+        zero_struct.range.start = start;
+        zero_struct.range.len = len;
+        zero_struct.mode = 0;
+        zero_struct.zeropage = 0;
+
+        if (ioctl(ufd, UFFDIO_ZEROPAGE, &zero_struct) == 0)
+            return 0;
+
+        if (zero_struct.zeropage > 0) {
+            done = zero_struct.zeropage;
+        } else if (errno == EEXIST) {
+            done = TARGET_PAGE_SIZE;
+        } else if (errno == EAGAIN) {
+            done = 0;
+        } else {
+            perror("ioctl: uffdio_zeropage");
+            return -1;
+        }
+
+        start += done;
+        len -= done;
+    }
+
+    return 0;
+}
+
+static int uffd_wake(unsigned long start, unsigned long len)
+{
+    struct uffdio_range range;
+
+    range.start = start;
+    range.len = len;
+
+    if (ioctl(ufd, UFFDIO_WAKE, &range)) {
+        perror("ioctl: uffdio_wake");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void mark_paged_in(ram_addr_t pa, unsigned long nr_pages)
+{
+    unsigned long pfn = pa / TARGET_PAGE_SIZE;
+    unsigned long i;
+
+    for (i = 0; i < nr_pages; i++) {
+        rp_insert(rp_src, pa + i * TARGET_PAGE_SIZE, RP_HID_MAIN);
+
+        /* set access history for the paged-in page */
+        history[pfn + i] |= (1 << 7);
+    }
+}
+
+static void clear_clean(unsigned long chunk)
+{
+    qemu_mutex_lock(&evict_lock);
+    clear_bit(chunk, clean_chunks);
+    qemu_mutex_unlock(&evict_lock);
+}
+
+/* map pages of a clean chunk write-protected to catch the first write */
+static __u64 copy_mode(unsigned long chunk)
+{
+    if (wp_enabled && test_bit(chunk, clean_chunks))
+        return UFFDIO_COPY_MODE_WP;
+
+    return 0;
+}
+
+/* install the faulted page at once, without waiting for its chunk */
+static int install_page(ram_addr_t pa, char *data)
+{
+    char *addr;
+
+    addr = qemu_get_ram_ptr_safe(pa);
+    if (addr == NULL) {
+        printf("pagein: no host page\n");
+        return -1;
+    }
+
+    if (uffd_copy_range((unsigned long)addr, (unsigned long)data,
+                        TARGET_PAGE_SIZE, copy_mode(pa / CHUNK_SIZE)))
+        return -1;
+
+    mark_paged_in(pa, 1);
+
+    return 0;
+}
+
+/* map a page answered as zero */
+static int install_zero_page(ram_addr_t pa)
+{
+    char *addr;
+
+    addr = qemu_get_ram_ptr_safe(pa);
+    if (addr == NULL) {
+        printf("pagein: no host page\n");
+        return -1;
+    }
+
+    /*
+     * The shared zero page cannot be write-protected, a clean chunk
+     * gets a private copy so that the first write is still noticed.
+     */
+    if (copy_mode(pa / CHUNK_SIZE)) {
+        if (uffd_copy_range((unsigned long)addr, (unsigned long)zero_page,
+                            TARGET_PAGE_SIZE, copy_mode(pa / CHUNK_SIZE)))
+            return -1;
+    } else if (uffd_zero_range((unsigned long)addr, TARGET_PAGE_SIZE)) {
+        return -1;
+    }
+
+    mark_paged_in(pa, 1);
+
+    return 0;
+}
+
+/* install the staged pages of a chunk as contiguous runs */
+static int install_chunk(struct pagein_req *req)
+{
+    unsigned long start, end;
+    char *addr;
+
+    addr = qemu_get_ram_ptr_safe(req->pa_start);
+    if (addr == NULL) {
+        printf("pagein: no host page\n");
+        return -1;
+    }
+
+    /* zero pages of a clean chunk are copied write-protected as well */
+    if (copy_mode(req->pa_start / CHUNK_SIZE)) {
+        start = find_next_bit(req->zeroed, CHUNK_PAGES, 0);
+        while (start < CHUNK_PAGES) {
+            memset(req->staging + start * TARGET_PAGE_SIZE, 0,
+                   TARGET_PAGE_SIZE);
+            set_bit(start, req->staged);
+            start = find_next_bit(req->zeroed, CHUNK_PAGES, start + 1);
+        }
+        bitmap_zero(req->zeroed, CHUNK_PAGES);
+    }
+
+    start = find_next_bit(req->zeroed, CHUNK_PAGES, 0);
+
+    while (start < CHUNK_PAGES) {
+        end = find_next_zero_bit(req->zeroed, CHUNK_PAGES, start);
+
+        if (uffd_zero_range((unsigned long)addr + start * TARGET_PAGE_SIZE,
+                            (end - start) * TARGET_PAGE_SIZE))
+            return -1;
+
+        mark_paged_in(req->pa_start + start * TARGET_PAGE_SIZE, end - start);
+
+        start = find_next_bit(req->zeroed, CHUNK_PAGES, end);
+    }
+
+    start = find_next_bit(req->staged, CHUNK_PAGES, 0);
+
+    while (start < CHUNK_PAGES) {
+        end = find_next_zero_bit(req->staged, CHUNK_PAGES, start);
+
+        if (uffd_copy_range((unsigned long)addr + start * TARGET_PAGE_SIZE,
+                            (unsigned long)req->staging +
+                            start * TARGET_PAGE_SIZE,
+                            (end - start) * TARGET_PAGE_SIZE,
+                            UFFDIO_COPY_MODE_DONTWAKE |
+                            copy_mode(req->pa_start / CHUNK_SIZE)))
+            return -1;
+
+        mark_paged_in(req->pa_start + start * TARGET_PAGE_SIZE, end - start);
+
+        start = find_next_bit(req->staged, CHUNK_PAGES, end);
+    }
+
+    /* one wake-up for every thread blocked on the chunk */
+    return uffd_wake((unsigned long)addr, CHUNK_SIZE);
+}
+
+/* OR of the access history of the pages in a chunk */
+static unsigned int chunk_hotness(unsigned long chunk)
+{
+    unsigned char *h = &history[chunk * CHUNK_PAGES];
+    unsigned char max_history = 0;
+    int i;
+
+    for (i = 0; i < CHUNK_PAGES; i++)
+        max_history |= h[i];
+
+    return max_history;
+}
+
+/* time from a page-in request to its first page, per sub-host */
+static void pagein_latency_sample(unsigned int host_id, int64_t ns)
+{
+    if (pagein_latency[host_id] == 0)
+        pagein_latency[host_id] = ns;
+    else
+        pagein_latency[host_id] += (ns - pagein_latency[host_id]) /
+                                   PAGING_LAT_WEIGHT;
+}
+
+/* expected wait for a page-in from host_id */
+static int64_t pagein_cost(unsigned int host_id)
+{
+    /* a sub-host not measured yet looks fast, so it gets measured */
+    return (int64_t)(pagein_queued[host_id] + 1) *
+           (pagein_latency[host_id] + 1);
+}
+
+/* fire the timerfd at deadline (get_clock() time), never if 0 */
+static void timer_set(int64_t deadline)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline / NANOSECONDS_PER_SECOND;
+    its.it_value.tv_nsec = deadline % NANOSECONDS_PER_SECOND;
+
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL))
+        perror("paging: timerfd_settime");
+
+    timer_deadline = deadline;
+}
+
+/* ask the other copy too if the first page of req is late */
+static void hedge_add(struct pagein_req *req)
+{
+    req->deadline = req->sent +
+                    MAX(PAGING_HEDGE_MIN_US * 1000LL,
+                        PAGING_HEDGE_FACTOR * pagein_latency[req->host_id]);
+    req->hedging = true;
+    QTAILQ_INSERT_TAIL(&hedge_list, req, hedge_next);
+
+    if (timer_deadline == 0 || req->deadline < timer_deadline)
+        timer_set(req->deadline);
+}
+
+static void hedge_del(struct pagein_req *req)
+{
+    QTAILQ_REMOVE(&hedge_list, req, hedge_next);
+    req->hedging = false;
+}
+
+static struct paging_move *move_find(unsigned long chunk)
+{
+    int i;
+
+    for (i = 0; i < PAGING_MAX_MOVES; i++) {
+        if (moves[i].busy && moves[i].chunk == chunk)
+            return &moves[i];
+    }
+
+    return NULL;
+}
+
+/* all pages of the chunk at the head of the queue have arrived */
+static int pagein_req_finish(struct pagein_req *req)
+{
+    ram_addr_t pa_start = req->pa_start;
+    bool last = req->twin == NULL;
+    bool drain = req->drain;
+    int ret = 0;
+
+    /*
+     * Of a hedged pair the first one in installs the chunk, the other
+     * one keeps it off the evict index until it is in as well, so that
+     * its pages never land on a chunk evicted again meanwhile.
+     */
+    if (!req->stale)
+        ret = install_chunk(req);
+    if (req->twin) {
+        req->twin->twin = NULL;
+        req->twin->stale = true;
+    }
+
+    staging_put(req->staging);
+    g_free(req->cbuf);
+    g_free(req);
+
+    if (ret)
+        return -1;
+    if (!last)
+        return 0;
+
+    clear_bit(pa_start / CHUNK_SIZE, inflight_chunks);
+    if (drain)
+        drain_inflight--;
+
+    /* a chunk being moved is evicted again once the move is done */
+    if (test_bit(pa_start / CHUNK_SIZE, moving_chunks))
+        move_find(pa_start / CHUNK_SIZE)->paged_in = true;
+    else
+        evict_index_update(evict_index, pa_start / CHUNK_SIZE,
+                           chunk_hotness(pa_start / CHUNK_SIZE));
+
+    pagein_num++;
+
+    return 0;
+}
+
+/* every page of a request is in */
+static int pagein_req_done(struct pagein_req *req)
+{
+    if (req->clen == 0)
+        return pagein_req_finish(req);
+
+    /* installed by paging_handle_notify() once inflated */
+    qemu_mutex_lock(&codec_lock);
+    QSIMPLEQ_INSERT_TAIL(&codec_queue, req, next);
+    qemu_cond_signal(&codec_cond);
+    qemu_mutex_unlock(&codec_lock);
+
+    return 0;
+}
+
+static int pagein_chunk_done(struct paging_conn *conn)
+{
+    struct pagein_req *req = QSIMPLEQ_FIRST(&conn->pending);
+
+    QSIMPLEQ_REMOVE_HEAD(&conn->pending, next);
+    pagein_queued[conn->host_id]--;
+
+    return pagein_req_done(req);
+}
+
+/* decompress the pages of a request into its staging buffer */
+static void inflate_req(struct pagein_req *req)
+{
+    struct pagein_crec rec;
+    size_t off = 0;
+
+    while (off < req->clen) {
+        memcpy(&rec, req->cbuf + off, sizeof(rec));
+        off += sizeof(rec);
+
+        if (page_decompress(req->codec, req->cbuf + off, rec.len,
+                            req->staging + rec.pfn * TARGET_PAGE_SIZE))
+            req->bad = true;
+        else
+            set_bit(rec.pfn, req->staged);
+
+        off += rec.len;
+    }
+}
+
+static void *codec_worker(void *arg)
+{
+    struct pagein_req *req;
+    uint64_t one = 1;
+
+    while (1) {
+        qemu_mutex_lock(&codec_lock);
+        while ((req = QSIMPLEQ_FIRST(&codec_queue)) == NULL)
+            qemu_cond_wait(&codec_cond, &codec_lock);
+        QSIMPLEQ_REMOVE_HEAD(&codec_queue, next);
+        qemu_mutex_unlock(&codec_lock);
+
+        inflate_req(req);
+
+        qemu_mutex_lock(&codec_lock);
+        QSIMPLEQ_INSERT_TAIL(&inflated, req, next);
+        qemu_mutex_unlock(&codec_lock);
+
+        if (write(notify_fd, &one, sizeof(one)) < 0)
+            perror("codec: write eventfd");
+    }
+
+    return NULL;
+}
+
+/* keep a compressed page of a chunk for the codec workers */
+static void pagein_req_add_compressed(struct pagein_req *req, int codec,
+                                      unsigned long pfn, const char *data,
+                                      uint32_t len)
+{
+    struct pagein_crec rec = { .pfn = pfn, .len = len };
+
+    if (req->clen + sizeof(rec) + len > req->csize) {
+        req->csize = MAX(req->csize * 2, req->clen + sizeof(rec) + len);
+        req->cbuf = g_realloc(req->cbuf, req->csize);
+    }
+
+    memcpy(req->cbuf + req->clen, &rec, sizeof(rec));
+    memcpy(req->cbuf + req->clen + sizeof(rec), data, len);
+    req->clen += sizeof(rec) + len;
+    req->codec = codec;
+}
+
+/* stage a page record of a chunk, to be installed with it */
+static int pagein_req_add(struct pagein_req *req, int codec,
+                          unsigned long pfn, uint64_t addr, char *data,
+                          uint32_t len)
+{
+    if (addr & MEMSRV_ADDR_ZERO) {
+        set_bit(pfn, req->zeroed);
+    } else if (addr & MEMSRV_ADDR_COMP) {
+        pagein_req_add_compressed(req, codec, pfn, data, len);
+    } else {
+        if (len != TARGET_PAGE_SIZE) {
+            printf("pagein: bad page length %u\n", len);
+            return -1;
+        }
+
+        memcpy(req->staging + pfn * TARGET_PAGE_SIZE, data, TARGET_PAGE_SIZE);
+        set_bit(pfn, req->staged);
+    }
+
+    return 0;
+}
+
+/* one page record of a DATA frame, for the oldest pending request */
+static int pagein_record(struct paging_conn *conn, uint64_t addr,
+                         char *data, uint32_t len)
+{
+    struct pagein_req *req = QSIMPLEQ_FIRST(&conn->pending);
+    ram_addr_t pa = addr & ~MEMSRV_ADDR_FLAGS;
+    unsigned long pfn;
+
+    if (req == NULL) {
+        printf("pagein: unexpected response from host %u\n", conn->host_id);
+        return -1;
+    }
+
+    pfn = (pa - req->pa_start) / TARGET_PAGE_SIZE;
+    if (pa < req->pa_start || pfn >= CHUNK_PAGES) {
+        printf("pagein: page %lx outside chunk\n", pa);
+        return -1;
+    }
+
+    if (req->nr_recvd == 0) {
+        /* behind the page-out on a bulk connection, not a fault's wait */
+        if (!req->drain)
+            pagein_latency_sample(conn->host_id, get_clock() - req->sent);
+        if (req->hedging)
+            hedge_del(req);
+    }
+
+    if (addr & MEMSRV_ADDR_NONE) {
+        printf("pagein: no page in sub-host\n");  /* race condition */
+        clear_clean(req->pa_start / CHUNK_SIZE);
+    } else if (req->nr_recvd > 0) {
+        if (pagein_req_add(req, conn->codec, pfn, addr, data, len))
+            return -1;
+    } else if (addr & MEMSRV_ADDR_ZERO) {
+        if (install_zero_page(pa))
+            return -1;
+    } else if (addr & MEMSRV_ADDR_COMP) {
+        /* the faulted page is not worth a round trip to a worker */
+        if (page_decompress(conn->codec, data, len, inflate_page) ||
+            install_page(pa, inflate_page))
+            return -1;
+    } else {
+        if (len != TARGET_PAGE_SIZE) {
+            printf("pagein: bad page length %u\n", len);
+            return -1;
+        }
+
+        /* the faulted page is answered first */
+        if (install_page(pa, data))
+            return -1;
+    }
+
+    if (++req->nr_recvd == req->nr_pages)
+        return pagein_chunk_done(conn);
+
+    return 0;
+}
+
+static void charge_chunk(ram_addr_t pa_start);
+static void mark_clean(unsigned long chunk, unsigned int host_id,
+                       unsigned int replica);
+
+/*
+ * Take a pushed chunk, unless a page-in or page-out of it is under way,
+ * a STORE passed the push, or paging it in would make room by evicting.
+ * pa is the page of the first record, one the sub-host holds.
+ */
+static struct pagein_req *push_accept(struct paging_conn *conn, ram_addr_t pa,
+                                      uint32_t version)
+{
+    unsigned long chunk = pa / CHUNK_SIZE;
+    struct pagein_req *req;
+
+    if (chunk >= nr_chunks || test_bit(chunk, inflight_chunks) ||
+        storing_chunks[chunk] ||
+        (int32_t)(version - chunk_version[chunk]) < 0 ||
+        rp_search(rp_src, pa) != conn->host_id)
+        return NULL;
+
+    if (atomic_read(&free_pages_in_main_host) <
+        CHUNK_PAGES + evict_low_wmark)
+        return NULL;
+
+    charge_chunk(chunk * CHUNK_SIZE);
+    mark_clean(chunk, conn->host_id, rp_search_replica(rp_src, pa));
+
+    req = g_new0(struct pagein_req, 1);
+    req->pa_start = chunk * CHUNK_SIZE;
+    req->staging = staging_get();
+    set_bit(chunk, inflight_chunks);
+
+    return req;
+}
+
+/* one page record of a PUSH frame */
+static int push_record(struct paging_conn *conn, uint64_t addr,
+                       uint32_t version, char *data, uint32_t len)
+{
+    ram_addr_t pa = addr & ~MEMSRV_ADDR_FLAGS;
+    struct pagein_req *req;
+
+    /* the first record decides on the chunk */
+    if (!conn->pushing) {
+        conn->pushing = true;
+        conn->push_req = push_accept(conn, pa, version);
+    }
+
+    req = conn->push_req;
+    if (req == NULL)
+        return 0;
+
+    if (pa < req->pa_start || pa - req->pa_start >= CHUNK_SIZE) {
+        printf("pagein: pushed page %lx outside chunk\n", pa);
+        return -1;
+    }
+
+#ifdef FCtrans
+    if (test_bit(pa / TARGET_PAGE_SIZE, FCtrans_bitmap) == 0)
+        return 0;
+#endif
+
+    if (addr & MEMSRV_ADDR_NONE) {
+        clear_clean(req->pa_start / CHUNK_SIZE);
+        return 0;
+    }
+
+    return pagein_req_add(req, conn->codec,
+                          (pa - req->pa_start) / TARGET_PAGE_SIZE, addr,
+                          data, len);
+}
+
+/* the last PUSH frame of a chunk */
+static int push_done(struct paging_conn *conn)
+{
+    struct pagein_req *req = conn->push_req;
+
+    conn->pushing = false;
+    conn->push_req = NULL;
+
+    if (req == NULL)
+        return 0;
+
+    return pagein_req_done(req);
+}
+
+/* the oldest STORE on conn is stored on its sub-host */
+static int paging_store_acked(struct paging_conn *conn,
+                              const struct memsrv_frame *frame,
+                              const char *payload)
+{
+    struct paging_store *st = QSIMPLEQ_FIRST(&conn->stores);
+    size_t room_len = (conn->caps & MEMSRV_CAP_ROOM) ? sizeof(uint64_t) : 0;
+    uint32_t version;
+    uint64_t room;
+
+    if (st == NULL) {
+        printf("pageout: unexpected ack from host %u\n", conn->host_id);
+        return -1;
+    }
+
+    if (frame->len != room_len && frame->len != room_len + sizeof(version)) {
+        printf("pageout: bad ack from host %u\n", conn->host_id);
+        return -1;
+    }
+
+    /* each copy has its own versions, pushes come from the first one */
+    if (frame->len > room_len &&
+        rp_search(rp_src, st->chunk * CHUNK_SIZE) == conn->host_id) {
+        memcpy(&version, payload, sizeof(version));
+        chunk_version[st->chunk] = version;
+    }
+
+    if (room_len) {
+        memcpy(&room, payload + frame->len - room_len, sizeof(room));
+        atomic_set(&host_room[conn->host_id], room);
+    }
+
+    if ((frame->flags & MEMSRV_FRAME_FULL) &&
+        !atomic_xchg(&host_full[conn->host_id], true))
+        printf("pageout: host %u is full\n", conn->host_id);
+
+    if (--st->nr_frames)
+        return 0;
+
+    QSIMPLEQ_REMOVE_HEAD(&conn->stores, next);
+    storing_chunks[st->chunk]--;
+    atomic_dec(&pageout_queued[conn->host_id]);
+    g_free(st);
+
+    return 0;
+}
+
+/* queue a frame of a header and page addresses, MOVE or DROP */
+static void send_addr_frame(struct paging_conn *conn, int type,
+                            const void *head, size_t head_len,
+                            const uint64_t *addrs, int nr)
+{
+    struct memsrv_frame frame;
+    struct iovec iov[2];
+    int n = 0;
+
+    if (head_len) {
+        iov[n].iov_base = (void *)head;
+        iov[n].iov_len = head_len;
+        n++;
+    }
+    iov[n].iov_base = (void *)addrs;
+    iov[n].iov_len = nr * sizeof(addrs[0]);
+    n++;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.len = iov_size(iov, n);
+    frame.type = type;
+    frame.nr = nr;
+
+    if (conn->caps & MEMSRV_CAP_CSUM) {
+        frame.flags |= MEMSRV_FRAME_CSUM;
+        frame.csum = memsrv_csum(iov, n);
+    }
+
+    paging_conn_queue(conn, &frame, sizeof(frame));
+    paging_conn_queue_iov(conn, iov, n, 0);
+    transport->flush(conn);
+}
+
+/*
+ * A move is done.  The pages still on its source now belong to its
+ * destination, in one step on the fault thread, so a fault goes to one
+ * or the other but never finds neither.  The source forgets them only
+ * after any fetch sent to it before.
+ */
+static int paging_moved(struct paging_conn *conn,
+                        const struct memsrv_frame *frame, const char *payload)
+{
+    struct paging_move *m = NULL;
+    unsigned long chunk;
+    uint64_t first;
+    int i;
+
+    if (frame->len == sizeof(first)) {
+        memcpy(&first, payload, sizeof(first));
+        m = move_find(first / CHUNK_SIZE);
+    }
+
+    if (m == NULL || m->from != conn->host_id || m->addrs[0] != first) {
+        printf("rebalance: unexpected MOVED from host %u\n", conn->host_id);
+        return -1;
+    }
+    chunk = m->chunk;
+
+    if (frame->nr == m->nr_pages) {
+        for (i = 0; i < m->nr_pages; i++) {
+            if (rp_search(rp_src, m->addrs[i]) == m->from)
+                rp_insert(rp_src, m->addrs[i], m->to);
+        }
+
+        /* paged in meanwhile and not written, to holds the same */
+        qemu_mutex_lock(&evict_lock);
+        if (clean_host[chunk] == m->from)
+            clean_host[chunk] = m->to;
+        qemu_mutex_unlock(&evict_lock);
+
+        /* a migration may have sent the source as their location */
+        if (!atomic_read(&handing_over))
+            send_addr_frame(conn, MEMSRV_FRAME_DROP, NULL, 0, m->addrs,
+                            m->nr_pages);
+    } else {
+        printf("rebalance: chunk %lu not moved from host %u to %u\n",
+               chunk, m->from, m->to);
+        if (host_channels[m->to])
+            send_addr_frame(conns[m->to][PAGING_CHAN_FAULT], MEMSRV_FRAME_DROP,
+                            NULL, 0, m->addrs, m->nr_pages);
+    }
+
+    clear_bit(chunk, moving_chunks);
+    if (m->paged_in)
+        evict_index_update(evict_index, chunk, chunk_hotness(chunk));
+    m->busy = false;
+
+    return 0;
+}
+
+/* the page records of a DATA or PUSH frame */
+static int paging_frame_records(struct paging_conn *conn,
+                                const struct memsrv_frame *frame,
+                                char *payload)
+{
+    struct memsrv_page desc;
+    struct iovec iov;
+    char *data, *end = payload + frame->len;
+    uint32_t i;
+
+    if ((uint64_t)frame->nr * sizeof(desc) > frame->len) {
+        printf("pagein: bad frame from host %u\n", conn->host_id);
+        return -1;
+    }
+
+    if (frame->flags & MEMSRV_FRAME_CSUM) {
+        iov.iov_base = payload;
+        iov.iov_len = frame->len;
+        if (memsrv_csum(&iov, 1) != frame->csum) {
+            printf("pagein: checksum error from host %u\n", conn->host_id);
+            return -1;
+        }
+    }
+
+    data = payload + frame->nr * sizeof(desc);
+
+    for (i = 0; i < frame->nr; i++) {
+        memcpy(&desc, payload + i * sizeof(desc), sizeof(desc));
+
+        if (desc.len > end - data) {
+            printf("pagein: truncated frame from host %u\n", conn->host_id);
+            return -1;
+        }
+
+        if (frame->type == MEMSRV_FRAME_PUSH) {
+            if (push_record(conn, desc.addr, desc.version, data, desc.len))
+                return -1;
+        } else if (pagein_record(conn, desc.addr, data, desc.len)) {
+            return -1;
+        }
+
+        data += desc.len;
+    }
+
+    if (frame->type == MEMSRV_FRAME_PUSH && (frame->flags & MEMSRV_FRAME_END))
+        return push_done(conn);
+
+    return 0;
+}
+
+/* parse the complete frames at the head of rx_buf */
+int paging_conn_received(struct paging_conn *conn)
+{
+    struct memsrv_frame frame;
+    char *payload;
+    size_t off = 0;
+    int ret;
+
+    while (conn->rx_len - off >= sizeof(frame)) {
+        memcpy(&frame, conn->rx_buf + off, sizeof(frame));
+
+        if (frame.len > MEMSRV_MAX_FRAME - sizeof(frame)) {
+            printf("pagein: bad frame from host %u\n", conn->host_id);
+            return -1;
+        }
+
+        if (conn->rx_len - off < sizeof(frame) + frame.len)
+            break;
+
+        payload = conn->rx_buf + off + sizeof(frame);
+
+        switch (frame.type) {
+        case MEMSRV_FRAME_STORED:
+            ret = paging_store_acked(conn, &frame, payload);
+            break;
+        case MEMSRV_FRAME_DATA:
+        case MEMSRV_FRAME_PUSH:
+            ret = paging_frame_records(conn, &frame, payload);
+            break;
+        case MEMSRV_FRAME_MOVED:
+            ret = paging_moved(conn, &frame, payload);
+            break;
+        default:
+            printf("pagein: bad frame from host %u\n", conn->host_id);
+            ret = -1;
+        }
+
+        if (ret)
+            return -1;
+
+        off += sizeof(frame) + frame.len;
+    }
+
+    memmove(conn->rx_buf, conn->rx_buf + off, conn->rx_len - off);
+    conn->rx_len -= off;
+
+    return 0;
+}
+
+/* expected wait behind the requests outstanding on a sub-host */
+static uint64_t host_cost(unsigned int host_id)
+{
+    return (uint64_t)(atomic_read(&pageout_queued[host_id]) +
+                      atomic_read(&pagein_queued[host_id]) + 1) *
+           (atomic_read(&pagein_latency[host_id]) / 1000 + 1);
+}
+
+/*
+ * Sub-host receiving evicted chunks: the one with the most room per
+ * expected wait, so that cold memory spreads over the pool by free
+ * capacity and stays off busy or slow servers.  RP_HID_UNDEF if none
+ * has room.  Called by the reclaimer, the counters are the fault
+ * thread's and only need to be roughly right.
+ *
+ * For a replica, another one than the first copy went to: it gets the
+ * same STORE frames, so it must have agreed on the same capabilities
+ * and codec.
+ */
+static unsigned int evict_target_host(unsigned int first)
+{
+    struct paging_conn *like = NULL, *conn;
+    unsigned int host_id, best = RP_HID_UNDEF;
+    uint64_t room, cost, best_room = 0, best_cost = 1;
+
+    if (first != RP_HID_UNDEF)
+        like = conns[first][PAGING_CHAN_FAULT];
+
+    for (host_id = rp_get_next_host(rp_src, RP_HID_MAIN);
+         rp_is_host_sub(rp_src, host_id);
+         host_id = rp_get_next_host(rp_src, host_id)) {
+        if (host_id == first || host_channels[host_id] == 0 ||
+            atomic_read(&host_full[host_id]))
+            continue;
+
+        conn = conns[host_id][PAGING_CHAN_FAULT];
+        if (like && (conn->caps != like->caps || conn->codec != like->codec))
+            continue;
+
+        /* in chunks, more than the whole VM makes no difference */
+        room = MIN(atomic_read(&host_room[host_id]) / CHUNK_SIZE, nr_chunks);
+        if (room == 0)
+            continue;
+
+        cost = host_cost(host_id);
+        if (best == RP_HID_UNDEF || room * best_cost > best_room * cost) {
+            best = host_id;
+            best_room = room;
+            best_cost = cost;
+        }
+    }
+
+    return best;
+}
+
+/* drop the pages of a chunk, it faults as missing on the next access */
+static void discard_chunk(char *addr)
+{
+    ram_addr_t offset;
+    RAMBlock *block;
+    int advice = MADV_DONTNEED;
+
+    /* shared file backing, e.g. memory-backend-file,share=on */
+    block = qemu_ram_block_from_host(addr, false, &offset);
+    if (block && block->fd >= 0)
+        advice = MADV_REMOVE;
+
+    if (madvise(addr, CHUNK_SIZE, advice))
+        perror("pageout: madvise");
+}
+
+/* move the used pages into b->data, one pull per run (patched kernel) */
+static void evict_pull(struct evict_batch *b, char *addr,
+                       const unsigned long *used)
+{
+    struct uffdio_pull pull_struct;
+    unsigned long start, end;
+
+    start = find_next_bit(used, CHUNK_PAGES, 0);
+
+    while (start < CHUNK_PAGES) {
+        end = find_next_zero_bit(used, CHUNK_PAGES, start);
+
+        pull_struct.dst = (unsigned long)b->data + start * TARGET_PAGE_SIZE;
+        pull_struct.src = (unsigned long)addr + start * TARGET_PAGE_SIZE;
+        pull_struct.len = (end - start) * TARGET_PAGE_SIZE;
+
+        if (ioctl(ufd, UFFDIO_PULL, &pull_struct)) {
+            if (errno == ENOTTY || errno == EINVAL) {
+                /* stock kernel */
+                printf("pageout: no UFFDIO_PULL, %s\n", wp_enabled ?
+                       "copying pages out" : "page-out disabled");
+                pull_enabled = false;
+                return;
+            }
+            perror("pageout: uffdio_pull");
+        } else {
+            bitmap_set(b->pulled, start, end - start);
+        }
+
+        start = find_next_bit(used, CHUNK_PAGES, end);
+    }
+}
+
+/*
+ * Same with stock kernel primitives: write-protect the chunk, copy the
+ * used pages out and drop the whole chunk.  Guest writes in between
+ * fault as write-protect faults and are deferred like any other fault
+ * on an evicting chunk, so no update is lost.
+ */
+static void evict_copy_out(struct evict_batch *b, char *addr,
+                           const unsigned long *used)
+{
+    struct uffdio_writeprotect wp_struct;
+    unsigned long start, end;
+
+    wp_struct.range.start = (unsigned long)addr;
+    wp_struct.range.len = CHUNK_SIZE;
+    wp_struct.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+
+    if (ioctl(ufd, UFFDIO_WRITEPROTECT, &wp_struct)) {
+        perror("pageout: uffdio_writeprotect");
+        return;
+    }
+
+    start = find_next_bit(used, CHUNK_PAGES, 0);
+
+    while (start < CHUNK_PAGES) {
+        end = find_next_zero_bit(used, CHUNK_PAGES, start);
+
+        memcpy(b->data + start * TARGET_PAGE_SIZE,
+               addr + start * TARGET_PAGE_SIZE,
+               (end - start) * TARGET_PAGE_SIZE);
+
+        start = find_next_bit(used, CHUNK_PAGES, end);
+    }
+
+    discard_chunk(addr);
+    bitmap_copy(b->pulled, used, CHUNK_PAGES);
+}
+
+/*
+ * Describe each pulled page for the STORE frames: zero pages as a
+ * flag, with compress pages that shrink compressed into cbuf, the
+ * rest as they are.
+ */
+static void pack_evict_batch(struct evict_batch *b, struct paging_conn *conn,
+                             bool compress)
+{
+    struct memsrv_page *desc;
+    unsigned long i;
+    uint32_t off = 0;
+    char *data;
+    int len;
+
+    if (compress && conn->codec != PAGE_CODEC_NONE)
+        b->cbuf = g_malloc(bitmap_count_one(b->pulled, CHUNK_PAGES) *
+                           PAGE_CODEC_BOUND);
+
+    for (i = 0; i < CHUNK_PAGES; i++) {
+        if (!test_bit(i, b->pulled))
+            continue;
+
+        data = b->data + i * TARGET_PAGE_SIZE;
+        desc = &b->desc[b->nr_desc];
+        desc->addr = b->pa_start + i * TARGET_PAGE_SIZE;
+        desc->len = TARGET_PAGE_SIZE;
+        desc->version = 0;
+        b->payload[b->nr_desc++] = data;
+
+        if ((conn->caps & MEMSRV_CAP_ZERO) &&
+            buffer_is_zero(data, TARGET_PAGE_SIZE)) {
+            desc->addr |= MEMSRV_ADDR_ZERO;
+            desc->len = 0;
+            b->payload[b->nr_desc - 1] = NULL;
+            continue;
+        }
+
+        if (b->cbuf == NULL)
+            continue;
+
+        len = page_compress(conn->codec, data, b->cbuf + off,
+                            PAGE_CODEC_BOUND);
+        if (len < 0)
+            continue;
+
+        desc->addr |= MEMSRV_ADDR_COMP;
+        desc->len = len;
+        b->payload[b->nr_desc - 1] = b->cbuf + off;
+        off += len;
+    }
+}
+
+/* an evicting chunk stays on the main host after all */
+static void evict_keep(unsigned long chunk)
+{
+    uint64_t one = 1;
+
+    qemu_mutex_lock(&evict_lock);
+    clear_bit(chunk, evicting_chunks);
+    qemu_mutex_unlock(&evict_lock);
+
+    evict_index_update(evict_index, chunk, chunk_hotness(chunk));
+
+    /* let the fault thread retry what was deferred meanwhile */
+    if (write(notify_fd, &one, sizeof(one)) < 0)
+        perror("pageout: write eventfd");
+}
+
+/*
+ * Take the coldest chunk off the main host: its pages are pulled into
+ * a batch and the chunk is marked as evicting until the batch is sent.
+ * Called by the reclaimer and, as direct reclaim, by the fault thread,
+ * which sends the pages uncompressed to get back to the fault sooner.
+ */
+static struct evict_batch *evict_chunk(unsigned long exclude, bool direct)
+{
+    unsigned long used[BITS_TO_LONGS(CHUNK_PAGES)];
+    struct evict_batch *b;
+    unsigned int host_id = RP_HID_UNDEF;
+    long chunk;
+    char *addr;
+    bool clean;
+
+    /* without UFFDIO_PULL, write-protect keeps the copy consistent */
+    if (!pull_enabled && !wp_enabled)
+        return NULL;
+
+    /* Select memory address in destination Main host */
+    chunk = evict_index_take_coldest(evict_index, exclude);
+    if (chunk == EVICT_NONE)
+        return NULL;
+
+    addr = qemu_get_ram_ptr_safe(chunk * CHUNK_SIZE);
+    if (addr == NULL) {
+        printf("pageout: no host memory\n");
+        return NULL;
+    }
+
+    /*
+     * From here on write faults on the chunk are deferred, so a clean
+     * chunk stays clean until it is dropped.
+     */
+    qemu_mutex_lock(&evict_lock);
+    set_bit(chunk, evicting_chunks);
+    clean = test_and_clear_bit(chunk, clean_chunks) &&
+            host_channels[clean_host[chunk]] != 0;
+    qemu_mutex_unlock(&evict_lock);
+
+    /* only a dirty chunk needs room on a sub-host */
+    if (!clean) {
+        host_id = evict_target_host(RP_HID_UNDEF);
+        if (!rp_is_host_sub(rp_src, host_id)) {
+            evict_keep(chunk);
+            return NULL;
+        }
+    }
+
+    b = g_new0(struct evict_batch, 1);
+    b->pa_start = chunk * CHUNK_SIZE;
+    b->host_id = host_id;
+    b->replica = RP_HID_UNDEF;
+
+#ifdef FCtrans
+    bitmap_copy(used, FCtrans_bitmap + chunk * BITS_TO_LONGS(CHUNK_PAGES),
+                CHUNK_PAGES);
+#else
+    bitmap_fill(used, CHUNK_PAGES);
+#endif
+
+    if (clean) {
+        b->clean = true;
+        b->host_id = clean_host[chunk];
+        b->replica = clean_replica[chunk];
+        bitmap_copy(b->pulled, used, CHUNK_PAGES);
+
+        /* nothing to write back, just drop the pages */
+        discard_chunk(addr);
+
+        return b;
+    }
+
+    b->data = qemu_memalign(TARGET_PAGE_SIZE, CHUNK_SIZE);
+
+    if (pull_enabled)
+        evict_pull(b, addr, used);
+    if (!pull_enabled && wp_enabled && bitmap_empty(b->pulled, CHUNK_PAGES))
+        evict_copy_out(b, addr, used);
+
+    if (!bitmap_empty(b->pulled, CHUNK_PAGES)) {
+        pack_evict_batch(b, bulk_conn(host_id, chunk), !direct);
+        if (PAGING_REPLICAS > 1)
+            b->replica = evict_target_host(host_id);
+        return b;
+    }
+
+    /* nothing moved, the chunk stays on the main host */
+    qemu_vfree(b->data);
+    g_free(b);
+    evict_keep(chunk);
+
+    return NULL;
+}
+
+static void handle_fault(char *addr, ram_addr_t pa, bool wp);
+
+/* give the faults deferred on evicting chunks another try */
+static void retry_deferred_faults(void)
+{
+    QSIMPLEQ_HEAD(, deferred_fault) list = QSIMPLEQ_HEAD_INITIALIZER(list);
+    struct deferred_fault *f;
+
+    QSIMPLEQ_CONCAT(&list, &deferred_faults);
+
+    while ((f = QSIMPLEQ_FIRST(&list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&list, next);
+        handle_fault(f->addr, f->pa, f->wp);
+        g_free(f);
+    }
+}
+
+static void free_evict_batch(struct evict_batch *b)
+{
+    if (b->data)
+        qemu_vfree(b->data);
+    g_free(b->cbuf);
+    g_free(b);
+}
+
+/* the kernel is done with the zero-copy sends of a batch */
+static bool evict_batch_sent(struct evict_batch *b)
+{
+    return (b->conn == NULL || zc_is_done(&b->conn->zc, b->zc_id)) &&
+           (b->replica_conn == NULL ||
+            zc_is_done(&b->replica_conn->zc, b->replica_zc_id));
+}
+
+/* release the batches whose zero-copy sends on conn completed */
+void paging_conn_reap(struct paging_conn *conn)
+{
+    QSIMPLEQ_HEAD(, evict_batch) list = QSIMPLEQ_HEAD_INITIALIZER(list);
+    struct evict_batch *b;
+
+    if (zc_reap(&conn->zc) <= 0)
+        return;
+
+    QSIMPLEQ_CONCAT(&list, &zc_batches);
+
+    while ((b = QSIMPLEQ_FIRST(&list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&list, next);
+
+        if ((b->conn == conn || b->replica_conn == conn) &&
+            evict_batch_sent(b))
+            free_evict_batch(b);
+        else
+            QSIMPLEQ_INSERT_TAIL(&zc_batches, b, next);
+    }
+}
+
+/*
+ * Release the batches the kernel is done with, whatever connection
+ * they were sent on.  From the timer, in case the transport does not
+ * report the completions of a connection.
+ */
+static void reap_zc_batches(void)
+{
+    QSIMPLEQ_HEAD(, evict_batch) list = QSIMPLEQ_HEAD_INITIALIZER(list);
+    struct evict_batch *b;
+
+    QSIMPLEQ_CONCAT(&list, &zc_batches);
+
+    while ((b = QSIMPLEQ_FIRST(&list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&list, next);
+
+        if (b->conn)
+            zc_reap(&b->conn->zc);
+        if (b->replica_conn)
+            zc_reap(&b->replica_conn->zc);
+
+        if (evict_batch_sent(b))
+            free_evict_batch(b);
+        else
+            QSIMPLEQ_INSERT_TAIL(&zc_batches, b, next);
+    }
+}
+
+/*
+ * Send the STORE frames of a chunk on conn.  Returns true with the id
+ * of the last zero-copy send if the kernel still refers to them.
+ */
+static bool send_evict_frames(struct paging_conn *conn, unsigned long chunk,
+                              const struct iovec *iov, int iovcnt,
+                              int nr_frames, uint32_t *zc_id)
+{
+    struct paging_store *st;
+    uint32_t zc_next = conn->zc.next;
+
+    /* the whole chunk in one vectored send */
+    transport->send_iov(conn, iov, iovcnt);
+
+    /* until acknowledged, the chunk is fetched behind its STOREs */
+    if (conn->caps & MEMSRV_CAP_ACK) {
+        st = g_new(struct paging_store, 1);
+        st->chunk = chunk;
+        st->nr_frames = nr_frames;
+        QSIMPLEQ_INSERT_TAIL(&conn->stores, st, next);
+        storing_chunks[chunk]++;
+        atomic_inc(&pageout_queued[conn->host_id]);
+    }
+
+    if (conn->zc.next == zc_next)
+        return false;
+
+    *zc_id = conn->zc.next - 1;
+
+    return true;
+}
+
+/* send the pages of an evicted chunk to its sub-hosts (fault thread) */
+static void send_evict_batch(struct evict_batch *b)
+{
+    unsigned long chunk = b->pa_start / CHUNK_SIZE;
+    struct paging_conn *conn = bulk_conn(b->host_id, chunk), *rconn;
+    struct iovec iov[3 * CHUNK_PAGES];
+    struct memsrv_frame *frame;
+    int i, j, first, cnt, per_frame, n = 0, nr_frames = 0;
+    int64_t deadline;
+
+    per_frame = (conn->caps & MEMSRV_CAP_BATCH) ? MEMSRV_MAX_FRAME_PAGES : 1;
+
+    for (i = 0; !b->clean && i < b->nr_desc; i += cnt) {
+        cnt = MIN(b->nr_desc - i, per_frame);
+
+        frame = &b->frames[nr_frames++];
+        memset(frame, 0, sizeof(*frame));
+        frame->type = MEMSRV_FRAME_STORE;
+        frame->nr = cnt;
+
+        iov[n].iov_base = frame;
+        iov[n].iov_len = sizeof(*frame);
+        n++;
+
+        first = n;
+        iov[n].iov_base = &b->desc[i];
+        iov[n].iov_len = cnt * sizeof(b->desc[0]);
+        n++;
+
+        for (j = i; j < i + cnt; j++) {
+            if (b->desc[j].len == 0)
+                continue;
+            iov[n].iov_base = b->payload[j];
+            iov[n].iov_len = b->desc[j].len;
+            n++;
+        }
+
+        frame->len = iov_size(&iov[first], n - first);
+
+        /* the batch stays untouched until sent, so this matches */
+        if (conn->caps & MEMSRV_CAP_CSUM) {
+            frame->flags |= MEMSRV_FRAME_CSUM;
+            frame->csum = memsrv_csum(&iov[first], n - first);
+        }
+    }
+
+    if (!rp_is_host_sub(rp_src, b->replica))
+        b->replica = RP_HID_UNDEF;
+
+    for (i = 0; i < CHUNK_PAGES; i++) {
+        if (!test_bit(i, b->pulled))
+            continue;
+        rp_insert(rp_src, b->pa_start + i * TARGET_PAGE_SIZE, b->host_id);
+        if (b->replica != RP_HID_UNDEF)
+            rp_insert_replica(rp_src, b->pa_start + i * TARGET_PAGE_SIZE,
+                              b->replica);
+    }
+    pageout_num++;
+
+    if (n > 0) {
+        if (send_evict_frames(conn, chunk, iov, n, nr_frames, &b->zc_id))
+            b->conn = conn;
+
+        /* the replica gets the very same frames */
+        if (b->replica != RP_HID_UNDEF) {
+            rconn = bulk_conn(b->replica, chunk);
+            if (send_evict_frames(rconn, chunk, iov, n, nr_frames,
+                                  &b->replica_zc_id))
+                b->replica_conn = rconn;
+        }
+    }
+
+    qemu_mutex_lock(&evict_lock);
+    clear_bit(chunk, evicting_chunks);
+    qemu_mutex_unlock(&evict_lock);
+
+    if (b->conn || b->replica_conn) {
+        /* the kernel still refers to the batch, freed once completed */
+        conn = b->conn;
+        rconn = b->replica_conn;
+        QSIMPLEQ_INSERT_TAIL(&zc_batches, b, next);
+        if (conn)
+            paging_conn_reap(conn);
+        if (rconn)
+            paging_conn_reap(rconn);
+
+        deadline = get_clock() + PAGING_ZC_REAP_MS * SCALE_MS;
+        if (!QSIMPLEQ_EMPTY(&zc_batches) &&
+            (timer_deadline == 0 || deadline < timer_deadline))
+            timer_set(deadline);
+    } else {
+        free_evict_batch(b);
+    }
+
+    if (!QSIMPLEQ_EMPTY(&deferred_faults))
+        retry_deferred_faults();
+}
+
+static void drain_update(void);
+
+/* send the batches prepared by the reclaimer and the inflated chunks */
+int paging_handle_notify(void)
+{
+    QSIMPLEQ_HEAD(, evict_batch) list = QSIMPLEQ_HEAD_INITIALIZER(list);
+    QSIMPLEQ_HEAD(, pagein_req) reqs = QSIMPLEQ_HEAD_INITIALIZER(reqs);
+    struct pagein_req *req;
+    struct evict_batch *b;
+    uint64_t cnt;
+
+    if (read(notify_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+        perror("paging: read eventfd");
+        return -1;
+    }
+
+    qemu_mutex_lock(&evict_lock);
+    QSIMPLEQ_CONCAT(&list, &evicted);
+    qemu_mutex_unlock(&evict_lock);
+
+    while ((b = QSIMPLEQ_FIRST(&list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&list, next);
+        send_evict_batch(b);
+    }
+
+    /* faults deferred on a chunk that was given up */
+    if (!QSIMPLEQ_EMPTY(&deferred_faults))
+        retry_deferred_faults();
+
+    qemu_mutex_lock(&codec_lock);
+    QSIMPLEQ_CONCAT(&reqs, &inflated);
+    qemu_mutex_unlock(&codec_lock);
+
+    while ((req = QSIMPLEQ_FIRST(&reqs)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&reqs, next);
+        /* as for the faulted page, never install part of a chunk */
+        if (req->bad) {
+            printf("pagein: bad compressed page in chunk %lx\n",
+                   req->pa_start);
+            return -1;
+        }
+        if (pagein_req_finish(req))
+            return -1;
+    }
+
+    drain_update();
+
+    return 0;
+}
+
+static void evict_kick(void)
+{
+    qemu_mutex_lock(&evict_lock);
+    evict_kicked = true;
+    qemu_cond_signal(&evict_cond);
+    qemu_mutex_unlock(&evict_lock);
+}
+
+/* around evict_chunk(), false while page-out is frozen or draining */
+static bool evict_begin(void)
+{
+    bool ok;
+
+    qemu_mutex_lock(&evict_lock);
+    ok = !pageout_frozen && !draining;
+    if (ok)
+        evict_running++;
+    qemu_mutex_unlock(&evict_lock);
+
+    return ok;
+}
+
+/*
+ * Reclaimer: woken below the low watermark, it pulls the coldest chunks
+ * until the high watermark is reached and hands them to the fault
+ * thread, which owns the sockets.
+ */
+static void *evict_thread(void *arg)
+{
+    struct evict_batch *b;
+    uint64_t one = 1;
+
+    while (1) {
+        qemu_mutex_lock(&evict_lock);
+        while (!evict_kicked)
+            qemu_cond_wait(&evict_cond, &evict_lock);
+        evict_kicked = false;
+        qemu_mutex_unlock(&evict_lock);
+
+        while (atomic_read(&free_pages_in_main_host) < evict_high_wmark) {
+            if (!evict_begin())
+                break;
+
+            b = evict_chunk((unsigned long)EVICT_NONE, false);
+
+            qemu_mutex_lock(&evict_lock);
+            if (b)
+                QSIMPLEQ_INSERT_TAIL(&evicted, b, next);
+            evict_running--;
+            qemu_mutex_unlock(&evict_lock);
+
+            if (b == NULL)
+                break;
+
+            atomic_add(&free_pages_in_main_host, CHUNK_PAGES);
+
+            if (write(notify_fd, &one, sizeof(one)) < 0)
+                perror("evict: write eventfd");
+        }
+    }
+
+    return NULL;
+}
+
+/* reserve main-host memory for a chunk about to be paged in */
+static void charge_chunk(ram_addr_t pa_start)
+{
+    struct evict_batch *b;
+    unsigned long free_pages;
+
+    /* the reserve ran out, reclaim one chunk here */
+    if (atomic_read(&free_pages_in_main_host) < CHUNK_PAGES &&
+        evict_begin()) {
+        b = evict_chunk(pa_start / CHUNK_SIZE, true);
+        if (b) {
+            atomic_add(&free_pages_in_main_host, CHUNK_PAGES);
+            send_evict_batch(b);
+        }
+
+        qemu_mutex_lock(&evict_lock);
+        evict_running--;
+        qemu_mutex_unlock(&evict_lock);
+    }
+
+    /* only the reclaimer adds concurrently */
+    free_pages = atomic_read(&free_pages_in_main_host);
+    atomic_sub(&free_pages_in_main_host, MIN(free_pages, CHUNK_PAGES));
+
+    if (atomic_read(&free_pages_in_main_host) < evict_low_wmark)
+        evict_kick();
+}
+
+/* the sub-hosts keep their copies until the chunk is written */
+static void mark_clean(unsigned long chunk, unsigned int host_id,
+                       unsigned int replica)
+{
+    if (!wp_enabled)
+        return;
+
+    qemu_mutex_lock(&evict_lock);
+    set_bit(chunk, clean_chunks);
+    clean_host[chunk] = host_id;
+    clean_replica[chunk] = replica;
+    qemu_mutex_unlock(&evict_lock);
+}
+
+/* ask host_id for the chunk of pa_target, the faulted page first */
+static struct pagein_req *pagein_send(ram_addr_t pa_target,
+                                      unsigned int host_id, bool bulk)
+{
+    uint64_t addrs[CHUNK_PAGES];
+    struct paging_conn *conn;
+    struct pagein_req *req;
+    ram_addr_t pa_start, pa;
+
+    pa_start = pa_target & ~(CHUNK_SIZE - 1);
+
+    if (bulk || storing_chunks[pa_start / CHUNK_SIZE])
+        conn = bulk_conn(host_id, pa_start / CHUNK_SIZE);
+    else
+        conn = conns[host_id][PAGING_CHAN_FAULT];
+
+    req = g_new0(struct pagein_req, 1);
+    req->pa_start = pa_start;
+    req->pa_target = pa_target;
+    req->host_id = host_id;
+    req->staging = staging_get();
+
+    /* fault page first */
+    addrs[req->nr_pages++] = pa_target;
+
+    for (pa = pa_start; pa < pa_start + CHUNK_SIZE; pa += TARGET_PAGE_SIZE) {
+        if (pa == pa_target)
+            continue;
+#ifdef FCtrans
+			if(test_bit(pa / TARGET_PAGE_SIZE, FCtrans_bitmap) == 0)
+				continue;
+#endif
+        addrs[req->nr_pages++] = pa;
+    }
+
+    send_pagein_request(conn, addrs, req->nr_pages);
+
+    QSIMPLEQ_INSERT_TAIL(&conn->pending, req, next);
+    req->sent = get_clock();
+    pagein_queued[host_id]++;
+
+    transport->flush(conn);
+
+    return req;
+}
+
+static void pagein_chunk(ram_addr_t pa_target)
+{
+    struct pagein_req *req;
+    unsigned int host_id, replica, tmp;
+    ram_addr_t pa_start;
+
+    pa_start = pa_target & ~(CHUNK_SIZE - 1);
+
+    /* the fault is resolved by the page-in already in flight */
+    if (test_bit(pa_start / CHUNK_SIZE, inflight_chunks))
+        return;
+
+    host_id = rp_search(rp_src, pa_target);
+
+    if (!rp_is_host_sub(rp_src, host_id)) {
+        printf("pagein: no sub-host's memory: %lx\n", pa_target);
+        return;
+    }
+
+    if (host_channels[host_id] == 0) {
+        printf("pagein: invalid socket\n");
+        return;
+    }
+
+    replica = rp_search_replica(rp_src, pa_target);
+    if (!rp_is_host_sub(rp_src, replica) || host_channels[replica] == 0)
+        replica = RP_HID_UNDEF;
+
+    charge_chunk(pa_start);
+
+    mark_clean(pa_start / CHUNK_SIZE, host_id, replica);
+
+    /* of two copies, the one expected to answer first */
+    if (replica != RP_HID_UNDEF &&
+        pagein_cost(replica) < pagein_cost(host_id)) {
+        tmp = host_id;
+        host_id = replica;
+        replica = tmp;
+    }
+
+    req = pagein_send(pa_target, host_id, false);
+    set_bit(pa_start / CHUNK_SIZE, inflight_chunks);
+
+    if (replica != RP_HID_UNDEF)
+        hedge_add(req);
+}
+
+/* the first page of req is late, ask the other copy as well */
+static void pagein_hedge(struct pagein_req *req)
+{
+    unsigned int host_id;
+
+    host_id = rp_search(rp_src, req->pa_target);
+    if (host_id == req->host_id)
+        host_id = rp_search_replica(rp_src, req->pa_target);
+
+    if (!rp_is_host_sub(rp_src, host_id) || host_channels[host_id] == 0)
+        return;
+
+    req->twin = pagein_send(req->pa_target, host_id, false);
+    req->twin->twin = req;
+}
+
+/* a sub-host whose memory server moves chunks, MOVE on its fault conn */
+static bool host_can_move(unsigned int host_id)
+{
+    return host_channels[host_id] &&
+           (conns[host_id][PAGING_CHAN_FAULT]->caps & MEMSRV_CAP_MOVE);
+}
+
+static bool host_has_room(unsigned int host_id)
+{
+    return !atomic_read(&host_full[host_id]) &&
+           atomic_read(&host_room[host_id]) >= CHUNK_SIZE;
+}
+
+/*
+ * The pages of a chunk that only from holds, none if the chunk is
+ * anywhere else too or busy: being paged in or out, already moving,
+ * with a replica to keep in step.
+ */
+static int movable_pages(unsigned long chunk, unsigned int from,
+                      uint64_t *addrs)
+{
+    ram_addr_t pa = chunk * CHUNK_SIZE;
+    unsigned int host_id;
+    int i, nr = 0;
+
+    if (test_bit(chunk, inflight_chunks) || test_bit(chunk, moving_chunks) ||
+        storing_chunks[chunk])
+        return 0;
+
+    for (i = 0; i < CHUNK_PAGES; i++, pa += TARGET_PAGE_SIZE) {
+        host_id = rp_search(rp_src, pa);
+        if (host_id == RP_HID_UNDEF)
+            continue;
+        if (host_id != from || rp_search_replica(rp_src, pa) != RP_HID_UNDEF)
+            return 0;
+        addrs[nr++] = pa;
+    }
+
+    return nr;
+}
+
+/*
+ * Start moving a chunk from the sub-host that is full or holds the
+ * most pages to the one with room holding the fewest, if they are far
+ * enough apart.  Both memory servers must support MOVE, the chunk goes
+ * from one to the other directly.
+ */
+static void rebalance(void)
+{
+    struct memsrv_move req;
+    struct paging_move *m = NULL;
+    unsigned int host_id, from = RP_HID_UNDEF, to = RP_HID_UNDEF;
+    unsigned long pages, most = 0, fewest = ULONG_MAX, chunk;
+    bool from_full = false, full;
+    int i;
+
+    if (atomic_read(&handing_over) || drain_active)
+        return;
+
+    for (i = 0; i < PAGING_MAX_MOVES && m == NULL; i++) {
+        if (!moves[i].busy)
+            m = &moves[i];
+    }
+    if (m == NULL)
+        return;
+
+    for (host_id = rp_get_next_host(rp_src, RP_HID_MAIN);
+         rp_is_host_sub(rp_src, host_id);
+         host_id = rp_get_next_host(rp_src, host_id)) {
+        if (!host_can_move(host_id))
+            continue;
+
+        pages = rp_get_host_pages(rp_src, host_id);
+        full = !host_has_room(host_id);
+
+        if (full > from_full || (full == from_full && pages > most)) {
+            from = host_id;
+            from_full = full;
+            most = pages;
+        }
+        if (!full && pages < fewest) {
+            to = host_id;
+            fewest = pages;
+        }
+    }
+
+    if (from == RP_HID_UNDEF || to == RP_HID_UNDEF || from == to ||
+        (!from_full && most - fewest <= PAGING_REBALANCE_SLACK))
+        return;
+
+    for (i = 0; i < PAGING_REBALANCE_SCAN; i++) {
+        chunk = rebalance_cursor++ % nr_chunks;
+        m->nr_pages = movable_pages(chunk, from, m->addrs);
+        if (m->nr_pages)
+            break;
+    }
+    if (m->nr_pages == 0)
+        return;
+
+    m->busy = true;
+    m->chunk = chunk;
+    m->from = from;
+    m->to = to;
+    m->paged_in = false;
+    set_bit(chunk, moving_chunks);
+
+    memset(&req, 0, sizeof(req));
+    req.host = rp_get_host_addr(rp_src, to);
+    req.port = MEMSRV_PORT;
+    send_addr_frame(conns[from][PAGING_CHAN_FAULT], MEMSRV_FRAME_MOVE,
+                    &req, sizeof(req), m->addrs, m->nr_pages);
+}
+
+/* the first page of a chunk on a sub-host, RAM_ADDR_INVALID if none */
+static ram_addr_t chunk_remote_page(unsigned long chunk)
+{
+    ram_addr_t pa = chunk * CHUNK_SIZE;
+    int i;
+
+    for (i = 0; i < CHUNK_PAGES; i++, pa += TARGET_PAGE_SIZE) {
+        if (rp_is_host_sub(rp_src, rp_search(rp_src, pa)))
+            return pa;
+    }
+
+    return RAM_ADDR_INVALID;
+}
+
+/* the pages of a chunk a sub-host may hold */
+static int chunk_addrs(unsigned long chunk, uint64_t *addrs)
+{
+    ram_addr_t pa = chunk * CHUNK_SIZE;
+    int i, nr = 0;
+
+    for (i = 0; i < CHUNK_PAGES; i++, pa += TARGET_PAGE_SIZE) {
+#ifdef FCtrans
+        if (test_bit(pa / TARGET_PAGE_SIZE, FCtrans_bitmap) == 0)
+            continue;
 #endif
+        addrs[nr++] = pa;
+    }
+
+    return nr;
+}
+
+/* host_id may forget its copy of a chunk, after anything sent before */
+static void drop_copy(unsigned int host_id, unsigned long chunk,
+                      const uint64_t *addrs, int nr)
+{
+    struct paging_conn *conn;
+
+    if (!rp_is_host_sub(rp_src, host_id) || host_channels[host_id] == 0)
+        return;
+
+    conn = bulk_conn(host_id, chunk);
+    if (conn->caps & MEMSRV_CAP_MOVE)
+        send_addr_frame(conn, MEMSRV_FRAME_DROP, NULL, 0, addrs, nr);
+}
+
+/* host_id drops everything of the VM on RELEASE */
+static bool host_releases(unsigned int host_id)
+{
+    return rp_is_host_sub(rp_src, host_id) && host_channels[host_id] &&
+           (conns[host_id][PAGING_CHAN_FAULT]->caps & MEMSRV_CAP_RELEASE);
+}
+
+/* the chunks on the sub-hosts into drain_order, hottest first */
+static void drain_fill(void)
+{
+    unsigned long count[256] = { 0 }, start[256];
+    unsigned long chunk, n = 0;
+    int h;
+
+    if (drain_order == NULL) {
+        drain_order = g_new(unsigned long, nr_chunks);
+        drain_hot = g_new(uint16_t, nr_chunks);
+    }
+
+    for (chunk = 0; chunk < nr_chunks; chunk++) {
+        drain_hot[chunk] = 0;
+        if (chunk_remote_page(chunk) != RAM_ADDR_INVALID) {
+            h = chunk_hotness(chunk);
+            drain_hot[chunk] = h + 1;
+            count[h]++;
+        }
+    }
+
+    for (h = 255; h >= 0; h--) {
+        start[h] = n;
+        n += count[h];
+    }
+
+    for (chunk = 0; chunk < nr_chunks; chunk++) {
+        if (drain_hot[chunk])
+            drain_order[start[drain_hot[chunk] - 1]++] = chunk;
+    }
+
+    drain_len = n;
+    drain_pos = 0;
+}
+
+/*
+ * Fetch a chunk for the drain, from the copy expected to answer first.
+ * Nothing is paged out while draining, so both copies are dropped
+ * right behind the fetch.  Returns the bytes asked for, 0 if the chunk
+ * is busy or back already.
+ */
+static int64_t drain_chunk(unsigned long chunk)
+{
+    uint64_t addrs[CHUNK_PAGES];
+    struct pagein_req *req;
+    unsigned int host_id, replica, tmp;
+    ram_addr_t pa_target;
+    bool evicting;
+    int nr;
+
+    if (test_bit(chunk, inflight_chunks) || test_bit(chunk, moving_chunks) ||
+        storing_chunks[chunk])
+        return 0;
+
+    qemu_mutex_lock(&evict_lock);
+    evicting = test_bit(chunk, evicting_chunks);
+    qemu_mutex_unlock(&evict_lock);
+    if (evicting)
+        return 0;
+
+    pa_target = chunk_remote_page(chunk);
+    if (pa_target == RAM_ADDR_INVALID)
+        return 0;
+
+    host_id = rp_search(rp_src, pa_target);
+    if (host_channels[host_id] == 0)
+        return 0;
+
+    replica = rp_search_replica(rp_src, pa_target);
+    if (!rp_is_host_sub(rp_src, replica) || host_channels[replica] == 0)
+        replica = RP_HID_UNDEF;
+
+    if (replica != RP_HID_UNDEF &&
+        pagein_cost(replica) < pagein_cost(host_id)) {
+        tmp = host_id;
+        host_id = replica;
+        replica = tmp;
+    }
+
+    charge_chunk(chunk * CHUNK_SIZE);
+
+    req = pagein_send(pa_target, host_id, true);
+    req->drain = true;
+    set_bit(chunk, inflight_chunks);
+    drain_inflight++;
+
+    nr = chunk_addrs(chunk, addrs);
+    drop_copy(host_id, chunk, addrs, nr);
+    drop_copy(replica, chunk, addrs, nr);
+
+    return (int64_t)req->nr_pages * TARGET_PAGE_SIZE;
+}
+
+/* nothing left under way with the sub-hosts */
+static bool drain_idle(void)
+{
+    unsigned int host_id;
+    bool busy;
+
+    if (drain_inflight || !bitmap_empty(inflight_chunks, nr_chunks) ||
+        !bitmap_empty(moving_chunks, nr_chunks) ||
+        !QSIMPLEQ_EMPTY(&zc_batches))
+        return false;
+
+    for (host_id = 0; host_id < RP_HID_UNDEF; host_id++) {
+        if (atomic_read(&pageout_queued[host_id]))
+            return false;
+    }
+
+    qemu_mutex_lock(&evict_lock);
+    busy = evict_running || !bitmap_empty(evicting_chunks, nr_chunks) ||
+           !QSIMPLEQ_EMPTY(&evicted);
+    qemu_mutex_unlock(&evict_lock);
+
+    return !busy;
+}
+
+/*
+ * Every chunk is back.  The pages never sent anywhere are the main
+ * host's as well, the clean copies left on the sub-hosts are dropped
+ * and the connections to them closed.
+ */
+static void drain_release(void)
+{
+    uint64_t addrs[CHUNK_PAGES];
+    struct memsrv_frame frame;
+    unsigned long *clean;
+    unsigned long chunk;
+    unsigned int host_id;
+    ram_addr_t pa;
+    int i, n, nr;
+
+    for (pa = 0; pa < rp_get_mem_size(rp_src); pa += TARGET_PAGE_SIZE) {
+        if (rp_search(rp_src, pa) != RP_HID_MAIN)
+            rp_insert(rp_src, pa, RP_HID_MAIN);
+    }
+
+    /* a write to a chunk still write-protected only unprotects it */
+    clean = bitmap_new(nr_chunks);
+    qemu_mutex_lock(&evict_lock);
+    bitmap_copy(clean, clean_chunks, nr_chunks);
+    bitmap_zero(clean_chunks, nr_chunks);
+    qemu_mutex_unlock(&evict_lock);
+
+    /*
+     * A sub-host that knows RELEASE drops everything of the VM once the
+     * connections are closed, stale copies of chunks written since they
+     * came back included.  Older ones are only told of the clean chunks.
+     */
+    for (chunk = find_first_bit(clean, nr_chunks); chunk < nr_chunks;
+         chunk = find_next_bit(clean, nr_chunks, chunk + 1)) {
+        nr = chunk_addrs(chunk, addrs);
+        if (!host_releases(clean_host[chunk]))
+            drop_copy(clean_host[chunk], chunk, addrs, nr);
+        if (!host_releases(clean_replica[chunk]))
+            drop_copy(clean_replica[chunk], chunk, addrs, nr);
+    }
+    g_free(clean);
+
+    memset(&frame, 0, sizeof(frame));
+    frame.type = MEMSRV_FRAME_RELEASE;
+
+    for (host_id = 0; host_id < RP_HID_UNDEF; host_id++) {
+        if (host_releases(host_id))
+            paging_conn_queue(conns[host_id][PAGING_CHAN_FAULT], &frame,
+                              sizeof(frame));
+
+        n = host_channels[host_id];
+        host_channels[host_id] = 0;
+
+        for (i = 0; i < n; i++) {
+            transport->close_conn(conns[host_id][i]);
+            conns[host_id][i] = NULL;
+            rp_set_host_chan_sock(rp_src, host_id, i, -1);
+        }
+
+        if (push_conns[host_id]) {
+            transport->close_conn(push_conns[host_id]);
+            push_conns[host_id] = NULL;
+        }
+    }
+
+    drain_active = false;
+    rebalance_next = 0;
+    atomic_set(&drain_rate, 0);
+
+    qemu_mutex_lock(&evict_lock);
+    draining = false;
+    qemu_mutex_unlock(&evict_lock);
+
+    printf("drain: done, sub-hosts released\n");
+}
+
+/* fetch what the budget allows, returns the time of the next tick */
+static int64_t drain_tick(int64_t now)
+{
+    uint64_t rate = atomic_read(&drain_rate);
+    uint64_t us = MIN(MAX(now - drain_last, 0) / 1000, 1000000);
+    int64_t max = (int64_t)PAGING_DRAIN_DEPTH * CHUNK_SIZE;
+    bool refilled = false, issued = false;
+    int64_t bytes;
+
+    /* at most 2^40 * 10^6, no overflow */
+    bytes = MIN(rate * us / 1000000, (uint64_t)max);
+    drain_budget = MIN(drain_budget + bytes, max);
+    drain_last = now;
+
+    /* an outgoing migration sends the pages where they are */
+    if (atomic_read(&handing_over))
+        return now + PAGING_DRAIN_TICK_MS * SCALE_MS;
+
+    while (drain_inflight < PAGING_DRAIN_DEPTH && drain_budget > 0) {
+        if (drain_pos == drain_len) {
+            if (refilled)
+                break;
+            drain_fill();
+            refilled = true;
+
+            if (drain_len == 0) {
+                if (!drain_idle())
+                    break;
+                drain_release();
+                return 0;
+            }
+            continue;
+        }
+
+        if (atomic_read(&free_pages_in_main_host) < CHUNK_PAGES) {
+            if (!drain_starved)
+                printf("drain: waiting for main-host memory\n");
+            drain_starved = true;
+            break;
+        }
+        drain_starved = false;
+
+        bytes = drain_chunk(drain_order[drain_pos++]);
+        drain_budget -= bytes;
+        issued |= bytes > 0;
+    }
+
+    if (refilled && !issued)
+        return now + PAGING_DRAIN_IDLE_MS * SCALE_MS;
+
+    return now + PAGING_DRAIN_TICK_MS * SCALE_MS;
+}
+
+/* paging_drain() was called, start or stop */
+static void drain_update(void)
+{
+    bool want = atomic_read(&drain_rate) != 0;
+
+    if (want == drain_active)
+        return;
+
+    drain_active = want;
+    if (!want) {
+        /* what is in flight is installed as usual */
+        drain_next = 0;
+        printf("drain: stopped\n");
+        return;
+    }
+
+    drain_last = get_clock();
+    drain_budget = 0;
+    drain_len = drain_pos = 0;
+    drain_next = drain_last + PAGING_DRAIN_TICK_MS * SCALE_MS;
+
+    if (timer_deadline == 0 || drain_next < timer_deadline)
+        timer_set(drain_next);
+}
+
+/* a hedge deadline, the rebalance or drain tick is due */
+int paging_handle_timer(void)
+{
+    struct pagein_req *req, *tmp;
+    int64_t now, next;
+    uint64_t cnt;
+
+    if (read(timer_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+        perror("paging: read timerfd");
+        return -1;
+    }
+
+    now = get_clock();
+    timer_deadline = 0;
+
+    if (drain_next && drain_next <= now)
+        drain_next = drain_tick(now);
+
+    if (rebalance_next && rebalance_next <= now) {
+        rebalance();
+        rebalance_next = now + PAGING_REBALANCE_MS * SCALE_MS;
+    }
+    next = rebalance_next;
+    if (drain_next && (next == 0 || drain_next < next))
+        next = drain_next;
+
+    QTAILQ_FOREACH_SAFE(req, &hedge_list, hedge_next, tmp) {
+        if (req->deadline > now) {
+            if (next == 0 || req->deadline < next)
+                next = req->deadline;
+            continue;
+        }
+
+        hedge_del(req);
+        pagein_hedge(req);
+    }
+
+    if (!QSIMPLEQ_EMPTY(&zc_batches)) {
+        reap_zc_batches();
+        if (!QSIMPLEQ_EMPTY(&zc_batches) &&
+            (next == 0 || now + PAGING_ZC_REAP_MS * SCALE_MS < next))
+            next = now + PAGING_ZC_REAP_MS * SCALE_MS;
+    }
+
+    if (next)
+        timer_set(next);
 
-static char page[4096];
-static int ufd;
+    return 0;
+}
 
-void *qemu_get_ram_ptr_safe(ram_addr_t addr);
+#ifdef FCtrans
+/* map zero pages to a page never used by the guest */
+static void zero_fill(char *addr, ram_addr_t pa)
+{
+    char *addr_0;
+    ram_addr_t pa_0;
+    unsigned long PA;
+
+    addr_0 = (char *)((unsigned long)addr & ~(CHUNK_SIZE - 1));
+    pa_0 = pa & ~(CHUNK_SIZE - 1);
+
+    if (find_next_bit(FCtrans_bitmap, (pa_0 / TARGET_PAGE_SIZE) + CHUNK_PAGES,
+                      pa_0 / TARGET_PAGE_SIZE) <
+        (pa_0 / TARGET_PAGE_SIZE) + CHUNK_PAGES) {
+        /* the chunk is in use, fill the faulted page only */
+        if (uffd_zero_range((unsigned long)addr, TARGET_PAGE_SIZE))
+            exit(1);
+
+        /* a page the sub-host does not have */
+        clear_clean(pa_0 / CHUNK_SIZE);
+
+        bitmap_set(FCtrans_bitmap, pa / TARGET_PAGE_SIZE, 1);
+        if (guest_flag == 1)
+            rp_insert(rp_src, pa, RP_HID_MAIN);
+    } else {
+        if (uffd_zero_range((unsigned long)addr_0, CHUNK_SIZE))
+            exit(1);
+
+        bitmap_set(FCtrans_bitmap, pa_0 / TARGET_PAGE_SIZE, CHUNK_PAGES);
+        if (guest_flag == 1) {
+            for (PA = 0; PA < CHUNK_SIZE; PA += TARGET_PAGE_SIZE)
+                rp_insert(rp_src, pa_0 + PA, RP_HID_MAIN);
+            evict_index_update(evict_index, pa_0 / CHUNK_SIZE,
+                               chunk_hotness(pa_0 / CHUNK_SIZE));
+        }
+    }
+}
+#endif /* FCtrans */
+
+/* first write to a clean chunk, its copy on the sub-host gets stale */
+static void handle_wp_fault(char *addr, ram_addr_t pa)
+{
+    struct uffdio_writeprotect wp_struct;
+    unsigned long chunk = pa / CHUNK_SIZE;
+
+    qemu_mutex_lock(&evict_lock);
+    clear_bit(chunk, clean_chunks);
+    qemu_mutex_unlock(&evict_lock);
+
+    /* write-enable the whole chunk and wake the writer */
+    wp_struct.range.start = (unsigned long)addr - (pa - chunk * CHUNK_SIZE);
+    wp_struct.range.len = CHUNK_SIZE;
+    wp_struct.mode = 0;
+
+    if (ioctl(ufd, UFFDIO_WRITEPROTECT, &wp_struct))
+        perror("ioctl: uffdio_writeprotect");
+}
+
+static void handle_fault(char *addr, ram_addr_t pa, bool wp)
+{
+    struct deferred_fault *f;
+    bool evicting;
+
+    qemu_mutex_lock(&evict_lock);
+    evicting = test_bit(pa / CHUNK_SIZE, evicting_chunks);
+    qemu_mutex_unlock(&evict_lock);
+
+    if (evicting) {
+        f = g_new(struct deferred_fault, 1);
+        f->addr = addr;
+        f->pa = pa;
+        f->wp = wp;
+        QSIMPLEQ_INSERT_TAIL(&deferred_faults, f, next);
+        return;
+    }
+
+    if (wp) {
+        handle_wp_fault(addr, pa);
+        return;
+    }
 
 #ifdef FCtrans
-extern unsigned long *FCtrans_bitmap;
-extern unsigned long FCtrans_bitmap_size;
-extern unsigned long free_pages_in_main_host;
-int guest_flag = 0;
+    if (test_bit(pa / TARGET_PAGE_SIZE, FCtrans_bitmap) == 0) {
+        zero_fill(addr, pa);
+        return;
+    }
 #endif
+    pagein_chunk(pa);
+}
 
-static int read_exact(int s, char *buf, size_t size)
+/* drain all pending events of userfaultfd */
+int paging_handle_ufd(void)
 {
-    int rcvd = 0;
-    int ret;
+    struct uffd_msg msgs[PAGING_MAX_MSGS];
+    char *addr;
+    ram_addr_t pa;
+    ssize_t ret;
+    int i, n;
 
-    while (rcvd < size) {
-        ret = read(s, &buf[rcvd], size - rcvd);
+    while (1) {
+        ret = read(ufd, msgs, sizeof(msgs));
         if (ret < 0) {
-          perror("recv");
-          return -1;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            perror("read ufd");
+            return -1;
         }
-        else if (ret == 0)
-          break;
 
-        rcvd += ret;
+        if (ret % sizeof(msgs[0])) {
+            fprintf(stderr, "read ufd: short message\n");
+            return -1;
+        }
+
+        n = ret / sizeof(msgs[0]);
+
+        for (i = 0; i < n; i++) {
+            if (msgs[i].event != UFFD_EVENT_PAGEFAULT) {
+                fprintf(stderr, "unexpected event\n");
+                return -1;
+            }
+
+            addr = (void *)(msgs[i].arg.pagefault.address & TARGET_PAGE_MASK);
+            pa = qemu_ram_addr_from_host(addr);
+            if (pa == RAM_ADDR_INVALID) {
+                fprintf(stderr, "fault outside guest: %p\n", addr);
+                continue;
+            }
+
+            handle_fault(addr, pa, msgs[i].arg.pagefault.flags &
+                                   UFFD_PAGEFAULT_FLAG_WP);
+        }
     }
+}
+
+/* epoll transport: non-blocking send() and read() on each socket */
+
+static void epoll_update_events(struct paging_conn *conn, bool want_out)
+{
+    struct epoll_event ev;
+
+    if (conn->tx_armed == want_out)
+        return;
+
+    ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
 
-    return rcvd;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->sock, &ev))
+        perror("paging: epoll_ctl");
+
+    conn->tx_armed = want_out;
 }
 
-static int send_pagein_request(int mem_sock, ram_addr_t pa)
+/* push pending bytes to the socket as far as it accepts them */
+static int epoll_flush(struct paging_conn *conn)
 {
-    unsigned int com = 2;
-    int ret;
+    size_t sent = 0;
+    ssize_t ret;
 
-    ret = send(mem_sock, &com, sizeof(com), 0);
-    if (ret == -1 || ret == 0) {
-        perror("pagein: send command");
-        return -1;
+    while (sent < conn->tx_len) {
+        ret = send(conn->sock, conn->tx_buf + sent, conn->tx_len - sent,
+                   MSG_DONTWAIT);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (conn->closing) {
+                /* the memory server is gone, its EOF frees conn */
+                sent = conn->tx_len;
+                break;
+            }
+            perror("paging: send");
+            return -1;
+        }
+        sent += ret;
     }
 
-    ret = send(mem_sock, &pa, sizeof(pa), 0);
-    if(ret == -1 || ret == 0) {
-        perror("pagein: send addr");
-        return -1;
-    }
+    memmove(conn->tx_buf, conn->tx_buf + sent, conn->tx_len - sent);
+    conn->tx_len -= sent;
+
+    epoll_update_events(conn, conn->tx_len > 0);
+
+    if (conn->closing && sent && conn->tx_len == 0 &&
+        shutdown(conn->sock, SHUT_WR))
+        perror("paging: shutdown");
 
     return 0;
 }
 
-static int recv_pagein_response(int mem_sock)
+static void *epoll_tx_reserve(struct paging_conn *conn, size_t len)
 {
-    struct uffdio_copy copy_struct;
-    ram_addr_t pa;
-    char *addr;
-    unsigned long pfn;
-    int ret;
+    void *p;
 
-    ret = read_exact(mem_sock, ( char *)&pa, sizeof(pa));
-    if (ret == -1 || ret == 0) {
-        perror("pagein: read ram addr");
-        return -1;
+    if (conn->tx_len + len > conn->tx_size) {
+        conn->tx_size = MAX(conn->tx_size * 2, conn->tx_len + len);
+        conn->tx_buf = g_realloc(conn->tx_buf, conn->tx_size);
     }
 
-    if (pa == (unsigned long)-1) {
-        printf("pagein: no page in sub-host\n");
-        return 0;  /* race condition */
-    }
+    p = conn->tx_buf + conn->tx_len;
+    conn->tx_len += len;
 
-    ret = read_exact(mem_sock, page, TARGET_PAGE_SIZE);
-    if (ret == -1 || ret == 0) {
-        perror("pagein: read mem");
-        return -1;
-    }
+    return p;
+}
 
-    addr = qemu_get_ram_ptr_safe(pa);
-    if (addr == NULL) {
-        printf("pagein: no host page\n");
-        return -1;
-    }
+static int epoll_send_iov(struct paging_conn *conn, const struct iovec *iov,
+                          int iovcnt)
+{
+    ssize_t sent = 0;
 
-    /* write contents to the accessed page */
-    copy_struct.dst = (unsigned long)addr;
-    copy_struct.src = (unsigned long)page;
-    copy_struct.len = TARGET_PAGE_SIZE;
-    copy_struct.mode = 0;
-  
-    if (ioctl(ufd, UFFDIO_COPY, &copy_struct)) {
-        perror("pagein: uffdio_copy");
-        return -1;
+    /* straight from the caller's buffers unless bytes are already queued */
+    if (conn->tx_len == 0) {
+        sent = paging_sendv_nowait(conn, iov, iovcnt);
+        if (sent < 0)
+            return -1;
     }
-  
-    rp_insert(rp_src, pa, RP_HID_MAIN);
 
-    /* set access history for the paged-in page */
-    pfn = pa / TARGET_PAGE_SIZE;
+    paging_conn_queue_iov(conn, iov, iovcnt, sent);
 
-    history[pfn] |= (1 << 7);
+    return epoll_flush(conn);
+}
 
-    return 0;
+static void epoll_close_conn(struct paging_conn *conn)
+{
+    conn->closing = true;
+
+    /* otherwise epoll_flush() shuts down once the queue is out */
+    if (conn->tx_len == 0 && shutdown(conn->sock, SHUT_WR))
+        perror("paging: shutdown");
 }
 
-static int send_pageout_request(int mem_sock, ram_addr_t pa,
-                                 unsigned int host_id)
+static int epoll_init(int fd, int nfd, int tfd)
 {
-    struct uffdio_pull pull_struct;
-    char *addr;
-    unsigned int com = 1;
-    int ret;
+    struct epoll_event ev;
 
-    addr = qemu_get_ram_ptr_safe(pa);
-    if (addr == NULL) {
-        printf("pageout: no host memory\n");
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("epoll_create1");
         return -1;
     }
 
-    /* remove mapped pages */
-    pull_struct.dst = (unsigned long)page;
-    pull_struct.src = (unsigned long)addr;
-    pull_struct.len = TARGET_PAGE_SIZE;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;  /* userfaultfd */
 
-    if (ioctl(ufd, UFFDIO_PULL, &pull_struct)) {
-        perror("pageout: uffdio_pull");
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        perror("epoll_ctl: ufd");
+        close(epfd);
         return -1;
     }
 
-    /* send Swapout command */
-    ret = send(mem_sock, &com, sizeof(com), 0);
-    if (ret == -1 || ret == 0) {
-        perror("pageout: send command");
+    ev.events = EPOLLIN;
+    ev.data.ptr = &notify_fd;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, nfd, &ev)) {
+        perror("epoll_ctl: eventfd");
+        close(epfd);
         return -1;
     }
 
-    /* Send page address to memory server */
-    ret = send(mem_sock, (char *)&pa, sizeof(pa), 0);
-    if (ret == -1 || ret == 0) {
-        perror("pageout: send addr");
+    ev.events = EPOLLIN;
+    ev.data.ptr = &timer_fd;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev)) {
+        perror("epoll_ctl: timerfd");
+        close(epfd);
         return -1;
     }
 
-    /* Send page data to memory server */
-    ret = send(mem_sock, page, TARGET_PAGE_SIZE, 0);
-    if (ret == -1 || ret == 0) {
-        perror("pageout: send data");
+    return 0;
+}
+
+static int epoll_add_conn(struct paging_conn *conn)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->sock, &ev)) {
+        perror("paging: epoll_ctl");
         return -1;
     }
 
-    rp_insert(rp_src, pa, host_id);
-
     return 0;
 }
 
-static int pagein_chunk(ram_addr_t pa_target)
+static int epoll_handle_conn(struct paging_conn *conn, uint32_t events)
 {
-    unsigned int host_id;
-    int mem_sock;
-    ram_addr_t pa_start, pa;
-    int ret;
+    ssize_t ret;
 
-    host_id = rp_search(rp_src, pa_target);
+    /* also raised by zero-copy completions on the error queue */
+    if (events & EPOLLERR)
+        paging_conn_reap(conn);
 
-    if (!rp_is_host_sub(rp_src, host_id)) {
-        printf("pagein: no sub-host's memory: %lx\n", pa_target);
-        return RP_HID_UNDEF;
+    if (events & EPOLLOUT) {
+        if (epoll_flush(conn))
+            return -1;
     }
 
-    mem_sock = rp_get_host_sock(rp_src, host_id);
-    if (mem_sock == -1) {
-        printf("pagein: invalid socket\n");
-        return RP_HID_UNDEF;
-    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        while (1) {
+            ret = read(conn->sock, conn->rx_buf + conn->rx_len,
+                       PAGING_RX_BUF_SIZE - conn->rx_len);
+            if (ret < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                if (errno == EINTR)
+                    continue;
+                if (conn->closing)
+                    break;
+                perror("pagein: recv");
+                return -1;
+            }
+            if (ret == 0 && conn->closing) {
+                /* one event per socket and wait, nothing else refers to it */
+                epoll_ctl(epfd, EPOLL_CTL_DEL, conn->sock, NULL);
+                paging_conn_free(conn);
+                return 0;
+            }
+            if (ret == 0) {
+                printf("pagein: host %u closed connection\n", conn->host_id);
+                return -1;
+            }
 
-    pa_start = pa_target & ~(CHUNK_SIZE - 1);
+            if (conn->closing)
+                continue;  /* late responses */
 
-    /* fault page first */
-    ret = send_pagein_request(mem_sock, pa_target);
-    if (ret == -1)
-        return RP_HID_UNDEF;
+            conn->rx_len += ret;
 
-    for (pa = pa_start; pa < pa_start + CHUNK_SIZE; pa += TARGET_PAGE_SIZE) {
-        if (pa == pa_target)
-            continue;
-#ifdef FCtrans
-			if(test_bit(pa / TARGET_PAGE_SIZE, FCtrans_bitmap) == 0)
-				continue;
-#endif
-        ret = send_pagein_request(mem_sock, pa);
-        if (ret == -1)
-            return RP_HID_UNDEF;
+            if (paging_conn_received(conn))
+                return -1;
+        }
     }
 
-    for (pa = pa_start; pa < pa_start + CHUNK_SIZE; pa += TARGET_PAGE_SIZE) {
-        ret = recv_pagein_response(mem_sock);
-        if (ret == -1)
-            return RP_HID_UNDEF;
-#ifdef FCtrans
-		if(test_bit(pa / TARGET_PAGE_SIZE, FCtrans_bitmap) == 0)
-			continue;
-#endif
-   }
+    return 0;
+}
 
-    pagein_num++;
+static void epoll_run(void)
+{
+    struct epoll_event events[PAGING_MAX_EVENTS];
+    int i, n;
+
+    while (1) {
+        n = epoll_wait(epfd, events, PAGING_MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return;
+        }
 
-    return host_id;
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                if (paging_handle_ufd())
+                    return;
+            } else if (events[i].data.ptr == &notify_fd) {
+                if (paging_handle_notify())
+                    return;
+            } else if (events[i].data.ptr == &timer_fd) {
+                if (paging_handle_timer())
+                    return;
+            } else if (epoll_handle_conn(events[i].data.ptr,
+                                         events[i].events)) {
+                return;
+            }
+        }
+    }
 }
 
-static int pageout_chunk_lru8(unsigned char *history, unsigned long nr_pages,
-                              ram_addr_t pa_pagein)
+const struct paging_transport paging_epoll_transport = {
+    .name = "epoll",
+    .init = epoll_init,
+    .add_conn = epoll_add_conn,
+    .tx_reserve = epoll_tx_reserve,
+    .flush = epoll_flush,
+    .send_iov = epoll_send_iov,
+    .close_conn = epoll_close_conn,
+    .run = epoll_run,
+};
+
+/*
+ * Single event loop over userfaultfd and all sub-host sockets:
+ * faults are turned into queued requests and responses are installed
+ * as they arrive, so that neither side waits for the other.
+ */
+static void *fault_thread(void *arg)
 {
-    unsigned long pfn;
-    unsigned char max_history;
-    unsigned char min_histgram = 255;
-    unsigned long selected_pfn = 0;
-    unsigned int id;
-    int i;
+    transport->run();
 
-    /* find a least-recently used page */
-    for (pfn = 0; pfn < nr_pages; pfn += CHUNK_PAGES) {
-        max_history = 0;
-      
-        for (i = 0; i < CHUNK_PAGES; i++)
-            max_history |= history[pfn + i];
-
-        if (max_history < min_histgram) {
-            id = rp_search(rp_src, pfn * 4096);
+    return NULL;
+}
 
-            if (!rp_is_host_main(rp_src, id))
-                continue;
+/* re-bucket main-host chunks after the access history was aged */
+void paging_history_aged(void)
+{
+    unsigned long chunk;
+    unsigned int host_id;
 
-            if (pfn * 4096 == pa_pagein)
-                continue;
+    if (evict_index == NULL)
+        return;
 
-            min_histgram = max_history;
-            selected_pfn = pfn;
+    /* the sub-hosts may have room again, the next page-out tells */
+    for (host_id = 0; host_id < RP_HID_UNDEF; host_id++)
+        atomic_set(&host_full[host_id], false);
 
-            if (min_histgram == 0)
-                break;
-        }
+    for (chunk = 0; chunk < nr_chunks; chunk++) {
+        if (evict_index_contains(evict_index, chunk))
+            evict_index_refresh(evict_index, chunk, chunk_hotness(chunk));
     }
+}
+
+/* an outgoing migration starts, the sub-hosts keep every chunk */
+void paging_migration_begin(void)
+{
+    if (guest_flag != 1)
+        return;
 
-    return selected_pfn;
+    atomic_set(&handing_over, true);
 }
 
-static void pageout_chunk(unsigned int host_id, ram_addr_t pa_pagein)
+/*
+ * The guest is stopped for the last pass: page out no more, and wait
+ * until what was paged out is stored, so every location the last pass
+ * sends is good.
+ */
+void paging_migration_settle(void)
 {
-    int mem_sock;
-    unsigned long nr_pages;
-    unsigned long pfn;
-    ram_addr_t pa, pa_start;
-    
-    mem_sock = rp_get_host_sock(rp_src, host_id);
-    if (mem_sock == -1) {
-        printf("invalid socket\n");
+    unsigned int host_id;
+    bool busy;
+
+    if (guest_flag != 1)
         return;
-    }
 
-    nr_pages = rp_get_mem_size(rp_src) / TARGET_PAGE_SIZE;
+    qemu_mutex_lock(&evict_lock);
+    pageout_frozen = true;
+    qemu_mutex_unlock(&evict_lock);
 
-    /* Select memory address in destination Main host */
-    pfn = pageout_chunk_lru8(history, nr_pages, pa_pagein);
+    do {
+        qemu_mutex_lock(&evict_lock);
+        busy = evict_running || !bitmap_empty(evicting_chunks, nr_chunks);
+        qemu_mutex_unlock(&evict_lock);
 
-    pa_start = pfn * TARGET_PAGE_SIZE;
+        for (host_id = 0; host_id < RP_HID_UNDEF; host_id++)
+            busy |= atomic_read(&pageout_queued[host_id]) != 0;
 
-    for (pa = pa_start; pa < pa_start + CHUNK_SIZE; pa += TARGET_PAGE_SIZE){
-#ifdef FCtrans
-		if(test_bit(pa / TARGET_PAGE_SIZE, FCtrans_bitmap) == 0)
-			continue;
-#endif
-        send_pageout_request(mem_sock, pa, host_id);
-	}
-	pageout_num++;
+        if (busy)
+            g_usleep(1000);
+    } while (busy);
 }
 
-static void *fault_thread(void *arg)
+/*
+ * The migration is over.  Once it completed the chunks on the
+ * sub-hosts are the destination's, this side leaves them alone.
+ */
+void paging_migration_end(bool completed)
 {
-    struct pollfd pfd[1];
-    struct uffd_msg msg;
-    char *addr;
-    ram_addr_t pa;
-    unsigned int host_id;
-    int ret;
-#ifdef FCtrans
-	struct uffdio_copy copy_struct;
-	unsigned long addr_0;
-	unsigned long pa_0;
-#endif
+    if (guest_flag != 1 || completed)
+        return;
 
-    while (1) {
-        pfd[0].fd = ufd;
-        pfd[0].events = POLLIN;
-        pfd[0].revents = 0;
+    qemu_mutex_lock(&evict_lock);
+    pageout_frozen = false;
+    qemu_mutex_unlock(&evict_lock);
+    atomic_set(&handing_over, false);
 
-        /* wait for an event from userfaultfd */
-        if (poll(pfd, 1, -1) == -1) {
-            perror("poll");
-            break;
-        }
+    if (atomic_read(&free_pages_in_main_host) < evict_low_wmark)
+        evict_kick();
+}
 
-        /* receive an event */
-        ret = read(ufd, &msg, sizeof(msg));
-        if (ret != sizeof(msg)) {
-            perror("read ufd");
-            break;
-        }
+/*
+ * Bring the VM back to the main host: the chunks on the sub-hosts are
+ * fetched hottest first at up to rate bytes/s, then the sub-hosts are
+ * let go.  Page-out and rebalance stop meanwhile.  Called again the
+ * new rate applies at once, 0 stops the drain.
+ */
+void paging_drain(uint64_t rate)
+{
+    uint64_t one = 1;
 
-        if (msg.event != UFFD_EVENT_PAGEFAULT) {
-            fprintf(stderr, "unexpected event\n");
-            break;
-        }
+    if (guest_flag != 1)
+        return;
 
-        addr = (void *)(msg.arg.pagefault.address & TARGET_PAGE_MASK);
-#ifdef FCtrans
-		addr_0 = (unsigned long)((unsigned long)addr & ~(CHUNK_SIZE -1));
-#endif
-        pa = qemu_ram_addr_from_host(addr);
-        if (pa == RAM_ADDR_INVALID) {
-            fprintf(stderr, "fault outside guest: %p\n", addr);
-            continue;
-        }
+    rate = MIN(rate, PAGING_DRAIN_MAX_RATE);
 
-#ifndef FCtrans
-        pa_0 = qemu_ram_addr_from_host(addr_0);
-		if (pa == RAM_ADDR_INVALID) {
-			fprintf(stderr, "fault1 outside guest: %p\n", addr);
-			continue;
-		}
-#endif
-#ifndef FCtrans
-		if(test_bit(pa / TARGET_PAGE_SIZE, FCtrans_bitmap) == 0){
-            if(find_next_bit(FCtrans_bitmap, ((pa_0 / TARGET_PAGE_SIZE) + CHUNK_PAGES), pa_0 / TARGET_PAGE_SIZE) < ((pa_0 / TARGET_PAGE_SIZE) + CHUNK_PAGES)){
-                copy_struct.dst = (unsigned long)addr;
-                copy_struct.src = (unsigned long)ZERO_PAGE;
-                copy_struct.len = TARGET_PAGE_SIZE;
-                copy_struct.mode = 0;
-
-                if (ioctl(ufd, UFFDIO_COPY, &copy_struct)) {
-                    perror("ioctl:zero copy");
-                    exit(1);
-                }
-
-                bitmap_set(FCtrans_bitmap, pa / TARGET_PAGE_SIZE, 1);
-                if(guest_flag == 1)
-                    rp_insert(rp_src, pa ,RP_HID_MAIN);
-
-            }else{
-                for(PA = 0; PA < CHUNK_SIZE; PA+=TARGET_PAGE_SIZE){
-                    copy_struct.dst = (unsigned long)addr_0 + PA;
-                    copy_struct.src = (unsigned long)ZERO_PAGE;
-                    copy_struct.len = TARGET_PAGE_SIZE;
-                    copy_struct.mode = 0;
-
-                    if (ioctl(ufd, UFFDIO_COPY, &copy_struct)) {
-                        perror("ioctl:zero copy");
-                        exit(1);
-                    }
-
-                    bitmap_set(FCtrans_bitmap, (pa_0 + PA) / TARGET_PAGE_SIZE, 1);
-                    if(guest_flag == 1)
-                        rp_insert(rp_src, pa_0 + PA,RP_HID_MAIN);
-                }
+    if (rate && atomic_read(&handing_over)) {
+        printf("drain: migration in progress\n");
+        return;
+    }
 
-            }
-        }else{
-			host_id = pagein_chunk(pa);
+    qemu_mutex_lock(&evict_lock);
+    draining = rate != 0;
+    qemu_mutex_unlock(&evict_lock);
+    atomic_set(&drain_rate, rate);
 
-        	if (host_id == RP_HID_UNDEF || host_id == RP_HID_MAIN)
-            	continue;
+    if (rate == 0 && atomic_read(&free_pages_in_main_host) < evict_low_wmark)
+        evict_kick();
 
-			free_pages_in_main_host -= CHUNK_PAGES;
+    /* picked up by the fault thread */
+    if (write(notify_fd, &one, sizeof(one)) < 0)
+        perror("drain: write eventfd");
+}
 
-			while(free_pages_in_main_host < CHUNK_PAGES){
-				pageout_chunk(host_id, pa & ~(CHUNK_SIZE - 1));
-				free_pages_in_main_host += CHUNK_PAGES;
-			}
-		}
-    }
+/* pick the fastest transport the host supports */
+static int paging_transport_init(int fd, int nfd, int tfd)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    transport = &paging_uring_transport;
+    if (transport->init(fd, nfd, tfd) == 0)
+        return 0;
 
-    return NULL;
+    printf("paging: io_uring unavailable, falling back to epoll\n");
+#endif
+
+    transport = &paging_epoll_transport;
+
+    return transport->init(fd, nfd, tfd);
 }
 
 void setup_paging(void)
@@ -426,26 +3077,16 @@ void setup_paging(void)
     unsigned int host_id;
     struct in_addr addr;
     char host_port[64];
+    struct paging_conn *conn;
     int mem_sock;
+    unsigned long chunk;
     QemuThread t;
-    
-    /* search the first sub-host (after main host) */
-    host_id = rp_get_next_host(rp_src, RP_HID_MAIN);
-
-    while (rp_is_host_sub(rp_src, host_id)) {
-        /* connect to a sub-host */
-        addr.s_addr = rp_get_host_addr(rp_src, host_id);
-        sprintf(host_port, "%s:9737", inet_ntoa(addr));
-
-        mem_sock = inet_connect(host_port, NULL);
-        if (mem_sock < 0)
-            perror("qemu_loadvm_state: inet_connect");
+    int i, n, n_move = 0;
 
-        /* register "host_id -> mem_sock" */
-        rp_set_host_sock(rp_src, host_id, mem_sock);
-
-        /* search the next sub-host */
-        host_id = rp_get_next_host(rp_src, host_id);
+    /* the memory servers tell VMs apart by their UUID */
+    if (!qemu_uuid_set) {
+        printf("setup_paging: the VM needs a -uuid\n");
+        exit(1);
     }
 
     /* check userfaultfd */
@@ -463,18 +3104,146 @@ void setup_paging(void)
         exit(1);
     }
 
+    /* the kernel reports the features it supports */
+    wp_enabled = api_struct.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+
+    notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (notify_fd == -1) {
+        perror("eventfd");
+        exit(1);
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) {
+        perror("timerfd_create");
+        exit(1);
+    }
+
+    if (paging_transport_init(ufd, notify_fd, timer_fd)) {
+        printf("setup_paging: no transport\n");
+        exit(1);
+    }
+
+    nr_chunks = rp_get_mem_size(rp_src) / CHUNK_SIZE;
+    zero_page = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
+    memset(zero_page, 0, TARGET_PAGE_SIZE);
+    inflight_chunks = bitmap_new(nr_chunks);
+
+    evict_index = evict_index_init(nr_chunks);
+    if (evict_index == NULL)
+        exit(1);
+
+    qemu_mutex_init(&evict_lock);
+    qemu_cond_init(&evict_cond);
+    evicting_chunks = bitmap_new(nr_chunks);
+    clean_chunks = bitmap_new(nr_chunks);
+    clean_host = g_malloc0(nr_chunks);
+    clean_replica = g_malloc(nr_chunks);
+    memset(clean_replica, RP_HID_UNDEF, nr_chunks);
+    memset(host_room, 0xff, sizeof(host_room));  /* no quota until told */
+    storing_chunks = g_new0(uint16_t, nr_chunks);
+    chunk_version = g_new0(uint32_t, nr_chunks);
+    moving_chunks = bitmap_new(nr_chunks);
+    paging_session = ((uint64_t)g_random_int() << 32) | g_random_int();
+
+    /* the compress migration capability turns compression on */
+    codec_running = migrate_use_compression();
+
+    for (chunk = 0; chunk < nr_chunks; chunk++) {
+        if (rp_is_host_main(rp_src, rp_search(rp_src, chunk * CHUNK_SIZE)))
+            evict_index_update(evict_index, chunk, chunk_hotness(chunk));
+    }
+
+    /* search the first sub-host (after main host) */
+    host_id = rp_get_next_host(rp_src, RP_HID_MAIN);
+
+    while (rp_is_host_sub(rp_src, host_id)) {
+        addr.s_addr = rp_get_host_addr(rp_src, host_id);
+        sprintf(host_port, "%s:%d", inet_ntoa(addr), MEMSRV_PORT);
+
+        /* connect to a sub-host, the ones refused are left out */
+        for (i = 0; i < SUBHOST_CHANNELS; i++) {
+            mem_sock = inet_connect(host_port, NULL);
+            if (mem_sock < 0) {
+                perror("qemu_loadvm_state: inet_connect");
+                continue;
+            }
+
+            conn = paging_conn_new(mem_sock, host_id, MEMSRV_ROLE_PAGING);
+            if (conn == NULL) {
+                close(mem_sock);
+                continue;
+            }
+
+            /* register "host_id -> mem_sock" */
+            n = host_channels[host_id]++;
+            rp_set_host_chan_sock(rp_src, host_id, n, mem_sock);
+            conns[host_id][n] = conn;
+
+            /*
+             * Without STORED a fetch could pass a STORE of the same
+             * chunk on another connection, keep everything on one.
+             */
+            if (!(conn->caps & MEMSRV_CAP_ACK))
+                break;
+        }
+
+        if (host_channels[host_id] &&
+            (conns[host_id][PAGING_CHAN_FAULT]->caps & MEMSRV_CAP_PUSH)) {
+            mem_sock = inet_connect(host_port, NULL);
+            if (mem_sock >= 0) {
+                push_conns[host_id] = paging_conn_new(mem_sock, host_id,
+                                                      MEMSRV_ROLE_PUSH);
+                if (push_conns[host_id] == NULL)
+                    close(mem_sock);
+            }
+        }
+
+        if (host_can_move(host_id))
+            n_move++;
+
+        /* search the next sub-host */
+        host_id = rp_get_next_host(rp_src, host_id);
+    }
+
+    /* before the fault thread runs, it owns the timer from then on */
+    if (n_move > 1) {
+        rebalance_next = get_clock() + PAGING_REBALANCE_MS * SCALE_MS;
+        timer_set(rebalance_next);
+    }
+
+    qemu_mutex_init(&codec_lock);
+    qemu_cond_init(&codec_cond);
+    inflate_page = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
+    if (codec_running) {
+        for (i = 0; i < PAGING_CODEC_WORKERS; i++)
+            qemu_thread_create(&t, "paging-codec", codec_worker, NULL,
+                               QEMU_THREAD_JOINABLE);
+    }
+
     qemu_thread_create(&t, "userfaultfd", fault_thread, NULL,
                        QEMU_THREAD_JOINABLE);
+    qemu_thread_create(&t, "evict", evict_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
 
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         reg_struct.range.start = (unsigned long)block->host;
         reg_struct.range.len = block->max_length;
         reg_struct.mode = UFFDIO_REGISTER_MODE_MISSING;
+        if (wp_enabled)
+            reg_struct.mode |= UFFDIO_REGISTER_MODE_WP;
 
         if (ioctl(ufd, UFFDIO_REGISTER, &reg_struct)) {
             perror("ioctl: UFFDIO_REGISTER");
             exit(1);
         }
+
+        /* e.g. shmem without write-protect support */
+        if (wp_enabled &&
+            !(reg_struct.ioctls & ((__u64)1 << _UFFDIO_WRITEPROTECT))) {
+            printf("setup_paging: no write-protect, clean eviction off\n");
+            wp_enabled = false;
+        }
     }
 #ifdef FCtrans
 	guest_flag = 1;
@@ -0,0 +1,139 @@
+#ifndef __PAGING_H
+#define __PAGING_H
+
+/* internal interface between the fault handler and its transports */
+
+#include "qemu/queue.h"
+#include "qemu/bitops.h"
+#include "zerocopy.h"
+#include "memsrv.h"
+
+#define PAGING_RX_BUF_SIZE (2 * MEMSRV_MAX_FRAME)
+
+/* a compressed page kept in pagein_req.cbuf, followed by its data */
+struct pagein_crec {
+    uint32_t pfn;  /* in the chunk */
+    uint32_t len;
+};
+
+/* a chunk being paged in, answered in order by the sub-host */
+struct pagein_req {
+    ram_addr_t pa_start;  /* head of the chunk */
+    ram_addr_t pa_target;  /* the faulted page */
+    unsigned int host_id;  /* asked for the chunk */
+    int64_t sent;  /* get_clock() when requested */
+    int nr_pages;  /* # of requested pages */
+    int nr_recvd;  /* # of received responses */
+    char *staging;  /* pages land at their offset in the chunk */
+    unsigned long staged[BITS_TO_LONGS(CHUNK_PAGES)];  /* pages in staging */
+    unsigned long zeroed[BITS_TO_LONGS(CHUNK_PAGES)];  /* answered as zero */
+
+    /* compressed pages, inflated into staging by a codec worker */
+    int codec;
+    char *cbuf;
+    size_t clen;
+    size_t csize;
+    bool bad;  /* a page did not decompress */
+    QSIMPLEQ_ENTRY(pagein_req) next;
+
+    /* hedged page-in: the same chunk asked of the replica as well */
+    int64_t deadline;  /* for the first page, then the twin is asked */
+    bool hedging;  /* on the hedge list until the first page is in */
+    QTAILQ_ENTRY(pagein_req) hedge_next;
+    struct pagein_req *twin;  /* the other one, until either finishes */
+    bool stale;  /* the twin installed the chunk first */
+
+    bool drain;  /* sent by the drain, not for a fault */
+};
+
+/* STORE frames of a chunk waiting for STORED */
+struct paging_store {
+    unsigned long chunk;
+    int nr_frames;
+    QSIMPLEQ_ENTRY(paging_store) next;
+};
+
+/* non-blocking connection to a memory server */
+struct paging_conn {
+    int sock;
+    unsigned int host_id;
+    uint32_t caps;  /* MEMSRV_CAP_*, agreed on with the memory server */
+    int codec;  /* PAGE_CODEC_* */
+
+    /* responses are parsed from the head of rx_buf */
+    char *rx_buf;
+    size_t rx_len;
+
+    /* bytes not accepted by the socket yet (epoll transport) */
+    char *tx_buf;
+    size_t tx_len;
+    size_t tx_size;
+    bool tx_armed;  /* waiting for EPOLLOUT */
+
+    void *opaque;  /* per-connection state of the transport */
+
+    struct zc_sock zc;  /* zero-copy sends of page-out batches */
+
+    QSIMPLEQ_HEAD(, pagein_req) pending;
+    QSIMPLEQ_HEAD(, paging_store) stores;
+
+    /* chunk being pushed (MEMSRV_ROLE_PUSH) */
+    bool pushing;
+    struct pagein_req *push_req;  /* NULL if not taken */
+
+    bool closing;  /* see close_conn, nothing more is sent or received */
+};
+
+/* how requests and responses move between the fault thread and sockets */
+struct paging_transport {
+    const char *name;
+
+    /*
+     * called once before any connection, with the userfaultfd, the
+     * eventfd of the reclaimer and the timerfd of hedged page-ins to
+     * watch
+     */
+    int (*init)(int ufd, int notify_fd, int timer_fd);
+    int (*add_conn)(struct paging_conn *conn);
+
+    /* return room for len bytes at the tail of the send queue */
+    void *(*tx_reserve)(struct paging_conn *conn, size_t len);
+    /* start sending whatever is queued */
+    int (*flush)(struct paging_conn *conn);
+    /*
+     * send iov after the queued bytes; the buffers may be reused on
+     * return, whatever is not sent yet is copied into the send queue
+     */
+    int (*send_iov)(struct paging_conn *conn, const struct iovec *iov,
+                    int iovcnt);
+    /*
+     * shut the sending side down once the queued bytes are out, and
+     * free conn with paging_conn_free() when the memory server has
+     * closed its side; late responses are dropped
+     */
+    void (*close_conn)(struct paging_conn *conn);
+
+    /* event loop of the fault thread, returns on a fatal error */
+    void (*run)(void);
+};
+
+extern const struct paging_transport paging_epoll_transport;
+#ifdef CONFIG_LINUX_IO_URING
+extern const struct paging_transport paging_uring_transport;
+#endif
+
+/* helpers for the transports */
+ssize_t paging_sendv_nowait(struct paging_conn *conn, const struct iovec *iov,
+                            int iovcnt);
+void paging_conn_queue_iov(struct paging_conn *conn, const struct iovec *iov,
+                           int iovcnt, size_t skip);
+void paging_conn_free(struct paging_conn *conn);
+
+/* callbacks from the transports */
+int paging_handle_ufd(void);
+int paging_handle_notify(void);
+int paging_handle_timer(void);
+int paging_conn_received(struct paging_conn *conn);
+void paging_conn_reap(struct paging_conn *conn);
+
+#endif /* __PAGING_H */
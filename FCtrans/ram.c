@@ -73,6 +73,7 @@
 #define GET_BIT(X,Y) (X & (1UL << Y)) >> Y
 #define GET_PFN(X) X & 0x7FFFFFFFFFFFFF
 #include "sysemu/cpus.h"
+#include "sysemu/sysemu.h"
 #define PAGE_SIZE 4096
 #include <sys/types.h>
 #endif
@@ -85,6 +86,9 @@
 #include <arpa/inet.h>
 #include "qemu/sockets.h"
 #include "rp.h"
+#include "zerocopy.h"
+#include "memsrv.h"
+#include "codec.h"
 
 #define RAM_SAVE_FLAG_SWAP     0x01
 
@@ -107,6 +111,82 @@ int64_t save_to_main, save_to_sub; //for qemu_clock log
 #define SUBHOST1 "10.20.67.25"
 
 unsigned long subhost_bytes;  /* bytes sent to sub-hosts */
+
+/*
+ * Page data to sub-hosts is sent with MSG_ZEROCOPY straight from guest
+ * memory.  A page dirtied before it is on the wire is sent again
+ * anyway, so only the error queue needs draining.
+ */
+#define ZC_REAP_INTERVAL 256  /* sends between completion reaps */
+static struct zc_sock subhost_zc[RP_HID_UNDEF][SUBHOST_CHANNELS];
+
+/* what each connection to a sub-host agreed on in the HELLO */
+static struct memsrv_hello subhost_hello[RP_HID_UNDEF][SUBHOST_CHANNELS];
+
+/*
+ * With the xbzrle capability, which sends pages against their previous
+ * copy on the main host, a page whose contents were already sent in
+ * full on a connection goes as its digest.  The sub-host answers
+ * MISSING for the digests it no longer has, those pages are sent again
+ * in full.  Pages are compressed only with the compress capability.
+ */
+#define SUBHOST_CAPS (MEMSRV_CAPS & ~(MEMSRV_CAP_ACK | MEMSRV_CAP_PUSH))
+#define SUBHOST_DIGESTS (1 << 16)  /* digests remembered per connection */
+static uint64_t subhost_resent;  /* pages MISSING and sent again */
+static uint64_t subhost_kept;  /* paged out here, left where they are */
+static uint64_t subhost_dedup;  /* sent as the digest of an earlier page */
+
+/* page records to a sub-host, sent as one STORE frame */
+struct subhost_frame {
+    struct memsrv_frame frame;
+    struct memsrv_page desc[MEMSRV_MAX_FRAME_PAGES];
+    struct iovec data[MEMSRV_MAX_FRAME_PAGES];  /* payloads, in order */
+    int nr;  /* # of records */
+    int nr_data;  /* # of payloads */
+    int nr_comp;  /* # of payloads in cbuf */
+    uint8_t cbuf[MEMSRV_MAX_FRAME_PAGES][PAGE_CODEC_BOUND];
+    QSIMPLEQ_ENTRY(subhost_frame) next;
+};
+
+/*
+ * With a codec agreed on, a connection has a worker thread: the
+ * migration thread only collects raw pages, the worker compresses the
+ * full frames and sends them in order.
+ */
+#define SUBHOST_FRAMES 4  /* frames of a connection, filled or queued */
+
+/* a connection to a sub-host */
+struct subhost_batch {
+    unsigned int host_id;
+    unsigned int chan;
+    struct subhost_frame *cur;  /* being filled */
+
+    uint64_t hash_key[2];
+    uint64_t (*digests)[2];  /* of pages sent in full, by their low bits */
+
+    /* answers of the sub-host, read between iterations */
+    char rx[sizeof(struct memsrv_frame) +
+            MEMSRV_MAX_FRAME_PAGES * sizeof(uint64_t)];
+    size_t rx_len;
+
+    /* compression worker, if running */
+    bool worker;
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    QSIMPLEQ_HEAD(, subhost_frame) full;  /* head is being sent */
+    QSIMPLEQ_HEAD(, subhost_frame) free;
+    bool quit;
+    bool error;  /* a send failed */
+};
+static struct subhost_batch *subhost_batch[RP_HID_UNDEF][SUBHOST_CHANNELS];
+
+/*
+ * Pages are spread over the connections to a sub-host by 2 MB chunk,
+ * so a page sent again always follows its previous copy.
+ */
+#define SUBHOST_CHAN(addr) \
+    (((addr) / (CHUNK_PAGES * TARGET_PAGE_SIZE)) % SUBHOST_CHANNELS)
 #endif /* SMEMV */
 
 #ifdef TAUCHI
@@ -1101,6 +1181,462 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
 
 #ifdef SMEMV
 /* 1-to-N migration */
+/* send a STORE frame to a sub-host, by the migration thread or the worker */
+static int subhost_send_frame(struct subhost_batch *b, struct subhost_frame *f)
+{
+    struct zc_sock *zc = &subhost_zc[b->host_id][b->chan];
+    struct iovec iov[2 + MEMSRV_MAX_FRAME_PAGES];
+    struct msghdr msg = { 0 };
+    size_t len, data_len = 0;
+    int mem_sock, i, n;
+    ssize_t res;
+
+    mem_sock = rp_get_host_chan_sock(rp_dst, b->host_id, b->chan);
+    if (mem_sock == -1) {
+        printf("invalid socket for host %d/%d\n", b->host_id, b->chan);
+        return -1;
+    }
+
+    for (i = 0; i < f->nr_data; i++)
+        data_len += f->data[i].iov_len;
+
+    memset(&f->frame, 0, sizeof(f->frame));
+    f->frame.len = f->nr * sizeof(f->desc[0]) + data_len;
+    f->frame.type = MEMSRV_FRAME_STORE;
+    f->frame.nr = f->nr;
+
+    iov[0].iov_base = &f->frame;
+    iov[0].iov_len = sizeof(f->frame);
+    iov[1].iov_base = f->desc;
+    iov[1].iov_len = f->nr * sizeof(f->desc[0]);
+    n = 2;
+    len = iov[0].iov_len + iov[1].iov_len;
+
+    /*
+     * Compressed payloads and digests live in the frame, which is
+     * reused at once: they are copied with the headers.  Raw pages
+     * alone go zero-copy from guest memory.
+     */
+    if (f->nr_comp) {
+        memcpy(&iov[n], f->data, f->nr_data * sizeof(f->data[0]));
+        n += f->nr_data;
+        len += data_len;
+        data_len = 0;
+    }
+
+    /* with TCP_NODELAY, tell the stack the page data follows */
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    res = sendmsg(mem_sock, &msg, data_len ? MSG_MORE : 0);
+    if (res != (ssize_t)len) {
+        perror("Error:send frame:migration");
+        return -1;
+    }
+
+    if (data_len) {
+        msg.msg_iov = f->data;
+        msg.msg_iovlen = f->nr_data;
+        res = zc_sendmsg(zc, &msg, 0);
+        if (res != (ssize_t)data_len) {
+            printf("Error:send data:migration");
+            return -1;
+        }
+
+        if (zc->next - zc->done >= ZC_REAP_INTERVAL)
+            zc_reap(zc);
+    }
+
+    atomic_add(&ram_counters.transferred, len + data_len);
+    atomic_add(&subhost_bytes, len + data_len);
+
+    f->nr = 0;
+    f->nr_data = 0;
+    f->nr_comp = 0;
+
+    return 0;
+}
+
+/* compress the raw pages of a frame in place, those that shrink */
+static void subhost_compress_frame(struct subhost_frame *f, int codec)
+{
+    struct iovec *data = f->data;
+    int i, clen;
+
+    for (i = 0; i < f->nr; i++) {
+        if (f->desc[i].len == 0)
+            continue;
+
+        /* neither a digest nor compressed yet */
+        if (!(f->desc[i].addr & MEMSRV_ADDR_FLAGS)) {
+            clen = page_compress(codec, data->iov_base, f->cbuf[i],
+                                 PAGE_CODEC_BOUND);
+            if (clen > 0) {
+                f->desc[i].addr |= MEMSRV_ADDR_COMP;
+                f->desc[i].len = clen;
+                data->iov_base = f->cbuf[i];
+                data->iov_len = clen;
+                f->nr_comp++;
+            }
+        }
+        data++;
+    }
+}
+
+static void *subhost_worker(void *opaque)
+{
+    struct subhost_batch *b = opaque;
+    int codec = subhost_hello[b->host_id][b->chan].codec;
+    struct subhost_frame *f;
+    int ret;
+
+    qemu_mutex_lock(&b->lock);
+    while (1) {
+        while (QSIMPLEQ_EMPTY(&b->full) && !b->quit)
+            qemu_cond_wait(&b->cond, &b->lock);
+
+        f = QSIMPLEQ_FIRST(&b->full);
+        if (f == NULL)
+            break;
+        qemu_mutex_unlock(&b->lock);
+
+        subhost_compress_frame(f, codec);
+        ret = subhost_send_frame(b, f);
+
+        qemu_mutex_lock(&b->lock);
+        QSIMPLEQ_REMOVE_HEAD(&b->full, next);
+        QSIMPLEQ_INSERT_TAIL(&b->free, f, next);
+        if (ret)
+            b->error = true;
+        qemu_cond_broadcast(&b->cond);
+    }
+    qemu_mutex_unlock(&b->lock);
+
+    return NULL;
+}
+
+static void subhost_start_worker(struct subhost_batch *b)
+{
+    int i;
+
+    qemu_mutex_init(&b->lock);
+    qemu_cond_init(&b->cond);
+    QSIMPLEQ_INIT(&b->full);
+    QSIMPLEQ_INIT(&b->free);
+    for (i = 1; i < SUBHOST_FRAMES; i++)
+        QSIMPLEQ_INSERT_TAIL(&b->free, g_new0(struct subhost_frame, 1), next);
+
+    b->quit = false;
+    b->error = false;
+    b->worker = true;
+    qemu_thread_create(&b->thread, "subhost-compress", subhost_worker, b,
+                       QEMU_THREAD_JOINABLE);
+}
+
+/* once the worker has sent everything queued */
+static void subhost_stop_worker(struct subhost_batch *b)
+{
+    struct subhost_frame *f;
+
+    qemu_mutex_lock(&b->lock);
+    b->quit = true;
+    qemu_cond_broadcast(&b->cond);
+    qemu_mutex_unlock(&b->lock);
+    qemu_thread_join(&b->thread);
+
+    while ((f = QSIMPLEQ_FIRST(&b->free)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&b->free, next);
+        g_free(f);
+    }
+    qemu_cond_destroy(&b->cond);
+    qemu_mutex_destroy(&b->lock);
+    b->worker = false;
+}
+
+static void subhost_stop_workers(void)
+{
+    unsigned int host_id, chan;
+
+    for (host_id = 0; host_id < RP_HID_UNDEF; host_id++) {
+        for (chan = 0; chan < SUBHOST_CHANNELS; chan++) {
+            if (subhost_batch[host_id][chan] &&
+                subhost_batch[host_id][chan]->worker)
+                subhost_stop_worker(subhost_batch[host_id][chan]);
+        }
+    }
+}
+
+/*
+ * Send the STORE frame collected for a connection to a sub-host, or
+ * hand it to the worker and go on with a free one.  With wait, return
+ * once the worker has sent everything.
+ */
+static int subhost_flush(unsigned int host_id, unsigned int chan, bool wait)
+{
+    struct subhost_batch *b = subhost_batch[host_id][chan];
+    struct subhost_frame *f;
+    bool error;
+
+    if (b == NULL)
+        return 0;
+
+    if (!b->worker)
+        return b->cur->nr ? subhost_send_frame(b, b->cur) : 0;
+
+    qemu_mutex_lock(&b->lock);
+    if (b->cur->nr) {
+        QSIMPLEQ_INSERT_TAIL(&b->full, b->cur, next);
+        qemu_cond_broadcast(&b->cond);
+
+        while ((f = QSIMPLEQ_FIRST(&b->free)) == NULL)
+            qemu_cond_wait(&b->cond, &b->lock);
+        QSIMPLEQ_REMOVE_HEAD(&b->free, next);
+        f->nr = 0;
+        f->nr_data = 0;
+        f->nr_comp = 0;
+        b->cur = f;
+    }
+
+    while (wait && !QSIMPLEQ_EMPTY(&b->full))
+        qemu_cond_wait(&b->cond, &b->lock);
+
+    error = b->error;
+    b->error = false;
+    qemu_mutex_unlock(&b->lock);
+
+    return error ? -1 : 0;
+}
+
+/* everything collected is sent, by the workers as well */
+static int subhost_flush_all(void)
+{
+    unsigned int host_id, chan;
+
+    for (host_id = 0; host_id < RP_HID_UNDEF; host_id++) {
+        for (chan = 0; chan < SUBHOST_CHANNELS; chan++) {
+            if (subhost_flush(host_id, chan, false))
+                return -1;
+        }
+    }
+
+    for (host_id = 0; host_id < RP_HID_UNDEF; host_id++) {
+        for (chan = 0; chan < SUBHOST_CHANNELS; chan++) {
+            if (subhost_flush(host_id, chan, true))
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Add a page to the STORE frame of its sub-host.  A page whose contents
+ * went to the same connection before goes as a digest if by_digest.
+ */
+static int subhost_add_page(unsigned int host_id, ram_addr_t addr,
+                            uint8_t *p, bool by_digest)
+{
+    unsigned int chan = SUBHOST_CHAN(addr);
+    struct memsrv_hello *hello = &subhost_hello[host_id][chan];
+    struct subhost_batch *b = subhost_batch[host_id][chan];
+    struct subhost_frame *f;
+    struct memsrv_page *desc;
+    struct iovec *data;
+    uint64_t digest[2], *seen = NULL;
+
+    if (b == NULL) {
+        printf("no connection to host %d\n", host_id);
+        return -1;
+    }
+
+    f = b->cur;
+    desc = &f->desc[f->nr];
+    desc->addr = addr;
+    desc->len = 0;
+    desc->version = 0;
+
+    if (b->digests) {
+        memsrv_page_hash(b->hash_key, p, digest);
+        seen = b->digests[digest[0] & (SUBHOST_DIGESTS - 1)];
+    }
+
+    if ((hello->caps & MEMSRV_CAP_ZERO) && is_zero_range(p, TARGET_PAGE_SIZE)) {
+        /* zero pages go as a flagged address without data */
+        desc->addr |= MEMSRV_ADDR_ZERO;
+        ram_counters.duplicate++;
+    } else if (seen && by_digest &&
+               seen[0] == digest[0] && seen[1] == digest[1]) {
+        data = &f->data[f->nr_data++];
+        desc->addr |= MEMSRV_ADDR_HASH;
+        desc->len = sizeof(digest);
+        memcpy(f->cbuf[f->nr], digest, sizeof(digest));
+        data->iov_base = f->cbuf[f->nr];
+        data->iov_len = desc->len;
+        f->nr_comp++;
+        subhost_dedup++;
+    } else {
+        /* compressed by the worker, if any */
+        data = &f->data[f->nr_data++];
+        desc->len = TARGET_PAGE_SIZE;
+        data->iov_base = p;
+        data->iov_len = desc->len;
+
+        if (seen) {
+            seen[0] = digest[0];
+            seen[1] = digest[1];
+        }
+    }
+
+    f->nr++;
+
+    if (f->nr == MEMSRV_MAX_FRAME_PAGES || !(hello->caps & MEMSRV_CAP_BATCH))
+        return subhost_flush(host_id, chan, false);
+
+    return 0;
+}
+
+/*
+ * Handle what a sub-host sent back: pages MISSING by digest are sent
+ * again in full.  Returns 1 once SYNC is received, waiting for it if
+ * wait_sync.
+ */
+static int subhost_read_answers(unsigned int host_id, unsigned int chan,
+                                bool wait_sync)
+{
+    struct subhost_batch *b = subhost_batch[host_id][chan];
+    int mem_sock = rp_get_host_chan_sock(rp_dst, host_id, chan);
+    struct memsrv_frame frame;
+    uint64_t addr;
+    size_t off;
+    ssize_t res;
+    uint32_t i;
+    int synced = 0;
+
+    if (b == NULL || b->digests == NULL)
+        return 1;
+
+    while (!synced) {
+        res = recv(mem_sock, b->rx + b->rx_len, sizeof(b->rx) - b->rx_len,
+                   wait_sync ? 0 : MSG_DONTWAIT);
+        if (res == 0 || (res < 0 && errno != EAGAIN && errno != EINTR)) {
+            perror("Error:recv answer:migration");
+            return -1;
+        }
+        if (res < 0) {
+            if (!wait_sync)
+                break;
+            continue;
+        }
+        b->rx_len += res;
+
+        for (off = 0; b->rx_len - off >= sizeof(frame);
+             off += sizeof(frame) + frame.len) {
+            memcpy(&frame, b->rx + off, sizeof(frame));
+
+            if (sizeof(frame) + frame.len > sizeof(b->rx) ||
+                (frame.type != MEMSRV_FRAME_MISSING &&
+                 frame.type != MEMSRV_FRAME_SYNC)) {
+                printf("bad answer from host %d\n", host_id);
+                return -1;
+            }
+
+            if (b->rx_len - off < sizeof(frame) + frame.len)
+                break;
+
+            if (frame.type == MEMSRV_FRAME_SYNC) {
+                synced = 1;
+                continue;
+            }
+
+            for (i = 0; i < frame.nr; i++) {
+                memcpy(&addr, b->rx + off + sizeof(frame) + i * sizeof(addr),
+                       sizeof(addr));
+                if (subhost_add_page(host_id, addr,
+                                     qemu_map_ram_ptr(NULL, addr), false))
+                    return -1;
+                subhost_resent++;
+            }
+        }
+
+        memmove(b->rx, b->rx + off, b->rx_len - off);
+        b->rx_len -= off;
+    }
+
+    return synced;
+}
+
+/* queue again the pages the sub-hosts reported MISSING so far */
+static int subhost_poll_all(void)
+{
+    unsigned int host_id, chan;
+    int ret = 0;
+
+    rcu_read_lock();
+    for (host_id = 0; host_id < RP_HID_UNDEF && ret >= 0; host_id++) {
+        for (chan = 0; chan < SUBHOST_CHANNELS && ret >= 0; chan++)
+            ret = subhost_read_answers(host_id, chan, false);
+    }
+    rcu_read_unlock();
+
+    return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Make sure every page referred to by digest is on the sub-hosts: send
+ * SYNC and resend what is MISSING until a SYNC comes back alone.
+ */
+static int subhost_sync_all(void)
+{
+    struct memsrv_frame frame;
+    unsigned int host_id, chan;
+    struct subhost_batch *b;
+    uint64_t resent;
+    int mem_sock;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.type = MEMSRV_FRAME_SYNC;
+
+    do {
+        resent = subhost_resent;
+
+        for (host_id = 0; host_id < RP_HID_UNDEF; host_id++) {
+            for (chan = 0; chan < SUBHOST_CHANNELS; chan++) {
+                b = subhost_batch[host_id][chan];
+                if (b == NULL || b->digests == NULL)
+                    continue;
+
+                if (subhost_flush(host_id, chan, true))
+                    return -1;
+
+                mem_sock = rp_get_host_chan_sock(rp_dst, host_id, chan);
+                if (send(mem_sock, &frame, sizeof(frame), 0) !=
+                    sizeof(frame)) {
+                    perror("Error:send sync:migration");
+                    return -1;
+                }
+
+                rcu_read_lock();
+                if (subhost_read_answers(host_id, chan, true) < 0) {
+                    rcu_read_unlock();
+                    return -1;
+                }
+                rcu_read_unlock();
+            }
+        }
+    } while (subhost_resent != resent);
+
+    return subhost_flush_all();
+}
+
+/* tell the destination which sub-host holds a page */
+static void save_page_location(RAMState *rs, RAMBlock *block,
+                               ram_addr_t offset, in_addr_t saddr)
+{
+    ram_counters.transferred +=
+        save_page_header(rs, rs->f, block, offset | RAM_SAVE_FLAG_SWAP);
+    qemu_put_buffer(rs->f, (uint8_t *)&saddr, sizeof(saddr));
+    ram_counters.transferred += sizeof(saddr);
+}
+
 static int ram_save_page_1_n(RAMState *rs, PageSearchStatus *pss,
                              bool last_stage)
 {
@@ -1128,6 +1664,21 @@ static int ram_save_page_1_n(RAMState *rs, PageSearchStatus *pss,
     if (block == rs->last_sent_block)
         offset |= RAM_SAVE_FLAG_CONTINUE;
 
+    /*
+     * This VM came by split migration and pages out: a page on a
+     * sub-host stays there, the destination gets its location.  Its
+     * memory is not touched, that would fault it in.
+     */
+    if (rp_src && current_addr < rp_get_mem_size(rp_src)) {
+        host_id = rp_search(rp_src, current_addr);
+        if (rp_is_host_sub(rp_src, host_id)) {
+            save_page_location(rs, block, offset,
+                               rp_get_host_addr(rp_src, host_id));
+            subhost_kept++;
+            return 1;
+        }
+    }
+
     /* current_addr -> host_id */
     if (current_addr < rp_get_mem_size(rp_dst))
         host_id = rp_search(rp_dst, current_addr);
@@ -1208,44 +1759,12 @@ static int ram_save_page_1_n(RAMState *rs, PageSearchStatus *pss,
 #endif
     }
     else if (rp_is_host_sub(rp_dst, host_id)) {  /* sub-host */
-        int mem_sock;
-        in_addr_t saddr;
-        int res;
-
-        /* host_id -> mem_sock */
-        mem_sock = rp_get_host_sock(rp_dst, host_id);
-        if (mem_sock == -1) {
-            printf("invalid socket for host %d\n", host_id);
+        if (subhost_add_page(host_id, current_addr, p, true))
             return -1;
-        }
-
-        /* send a page to one of the memory servers */
-        res = send(mem_sock, &current_addr, sizeof(current_addr), 0);
-        if (res == -1) {
-            perror("Error:send addr:migration");
-            return -1;
-        }
-
-        ram_counters.transferred += res;
-        subhost_bytes += res;
-
-        res = send(mem_sock, p, TARGET_PAGE_SIZE, 0);
-        if (res == -1) {
-            printf("Error:send data:migration");
-            return -1;
-        }
-
-        ram_counters.transferred += res;
-        subhost_bytes += res;
-
-        /* host_id -> saddr */
-        saddr = rp_get_host_addr(rp_dst, host_id);
 
         /* send mapping between an memory address and a sub-host */
-        ram_counters.transferred +=
-            save_page_header(rs, rs->f, block, offset | RAM_SAVE_FLAG_SWAP);
-        qemu_put_buffer(rs->f, (uint8_t *)&saddr, sizeof(saddr));
-        ram_counters.transferred += sizeof(saddr);
+        save_page_location(rs, block, offset,
+                           rp_get_host_addr(rp_dst, host_id));
 
         pages = 1;
     }
@@ -1892,6 +2411,11 @@ static void ram_save_cleanup(void *opaque)
     xbzrle_cleanup();
     compress_threads_save_cleanup();
     ram_state_cleanup(rsp);
+
+#ifdef SMEMV
+    subhost_stop_workers();
+    paging_migration_end(migration_has_finished(migrate_get_current()));
+#endif
 }
 
 static void ram_state_reset(RAMState *rs)
@@ -2460,8 +2984,21 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     char host_port[64];
     unsigned int host_id;
     unsigned long total_pages, main_pages, sub_pages[1];
+    struct memsrv_frame frame;
+    uint64_t mem_size;
+    struct iovec iov[2];
+    struct msghdr msg = { 0 };
+    struct subhost_batch *b;
+    unsigned int chan;
+    uint32_t caps;
     int i, ret;
 
+    /* the sub-hosts tell VMs apart by their UUID */
+    if (!qemu_uuid_set) {
+        printf("ram_save_setup: split migration needs a -uuid\n");
+        return -1;
+    }
+
     /* split migration */
     migrate_type = MTYPE_1_TO_N;
     subhosts[0] = inet_addr(SUBHOST1);
@@ -2470,10 +3007,13 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     if (migrate_type == MTYPE_1_TO_N) {
         rp_dst = rp_init(vm_mem_size);
 
-        for (i = 0; i < nr_subhosts; i++) {
+        for (i = 0; i < nr_subhosts * SUBHOST_CHANNELS; i++) {
+            host_id = rp_get_host_id(rp_dst, subhosts[i / SUBHOST_CHANNELS]);
+            chan = i % SUBHOST_CHANNELS;
+
             /* connect to a sub-host */
-            addr.s_addr = subhosts[i];
-            sprintf(host_port, "%s:9737", inet_ntoa(addr));
+            addr.s_addr = subhosts[i / SUBHOST_CHANNELS];
+            sprintf(host_port, "%s:%d", inet_ntoa(addr), MEMSRV_PORT);
 
             mem_sock = inet_connect(host_port, NULL);
             if (mem_sock < 0) {
@@ -2483,11 +3023,75 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             }
 
             /* register "host_id -> mem_sock" */
-            host_id = rp_get_host_id(rp_dst, subhosts[i]);
-            rp_set_host_sock(rp_dst, host_id, mem_sock);
+            rp_set_host_chan_sock(rp_dst, host_id, chan, mem_sock);
+
+            memsrv_tune_socket(mem_sock, 0);
+
+            /* no STORED, only MISSING is read back during migration */
+            caps = SUBHOST_CAPS;
+            if (!migrate_use_compression())
+                caps &= ~MEMSRV_CAP_COMPRESS;
+            if (!migrate_use_xbzrle())
+                caps &= ~MEMSRV_CAP_DEDUP;
+            if (memsrv_handshake(mem_sock, MEMSRV_ROLE_MIGRATION, caps,
+                                 migrate_use_compression() ?
+                                 page_codec_wanted() : PAGE_CODEC_NONE,
+                                 &subhost_hello[host_id][chan])) {
+                rp_free(rp_dst);
+                return -1;
+            }
+
+            /* the destination runs with the same -uuid */
+            if (!(subhost_hello[host_id][chan].caps & MEMSRV_CAP_TENANT)) {
+                printf("ram_save_setup: memory server without VMs\n");
+                rp_free(rp_dst);
+                return -1;
+            }
+            if (memsrv_select_vm(mem_sock, qemu_uuid.data)) {
+                rp_free(rp_dst);
+                return -1;
+            }
 
-            /* send VM memory size at first */
-            ret = send(mem_sock, &vm_mem_size, sizeof(vm_mem_size), 0);
+            zc_init(&subhost_zc[host_id][chan], mem_sock);
+            if (subhost_batch[host_id][chan] == NULL)
+                subhost_batch[host_id][chan] =
+                    g_new0(struct subhost_batch, 1);
+
+            /* digests of a previous migration mean nothing here */
+            b = subhost_batch[host_id][chan];
+            b->host_id = host_id;
+            b->chan = chan;
+            if (b->cur == NULL)
+                b->cur = g_new0(struct subhost_frame, 1);
+            b->error = false;
+            b->rx_len = 0;
+            g_free(b->digests);
+            b->digests = NULL;
+            if (subhost_hello[host_id][chan].caps & MEMSRV_CAP_DEDUP) {
+                memcpy(b->hash_key, subhost_hello[host_id][chan].hash_key,
+                       sizeof(b->hash_key));
+                b->digests = g_malloc0(SUBHOST_DIGESTS *
+                                       sizeof(b->digests[0]));
+            }
+
+            /* the migration thread only collects, a worker compresses */
+            if (subhost_hello[host_id][chan].codec != PAGE_CODEC_NONE &&
+                !b->worker)
+                subhost_start_worker(b);
+
+            /* send VM memory size at first, on every connection */
+            memset(&frame, 0, sizeof(frame));
+            frame.len = sizeof(mem_size);
+            frame.type = MEMSRV_FRAME_MEM_SIZE;
+            mem_size = vm_mem_size;
+            iov[0].iov_base = &frame;
+            iov[0].iov_len = sizeof(frame);
+            iov[1].iov_base = &mem_size;
+            iov[1].iov_len = sizeof(mem_size);
+            msg.msg_iov = iov;
+            msg.msg_iovlen = 2;
+
+            ret = sendmsg(mem_sock, &msg, 0);
             if (ret < 0)
                 perror("ram_save_setup: send");
         }
@@ -2497,6 +3101,11 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         sub_pages[0] = total_pages - main_pages;
         
         split_chunk_lru8(history, total_pages, main_pages, sub_pages, 1);
+
+        /* what is paged out here is handed over in place */
+        subhost_kept = 0;
+        subhost_dedup = 0;
+        paging_migration_begin();
     }
 #endif /* SMEMV */
 
@@ -2595,6 +3204,12 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     flush_compressed_data(rs);
     rcu_read_unlock();
 
+#ifdef SMEMV
+    if (migrate_type == MTYPE_1_TO_N &&
+        (subhost_flush_all() || subhost_poll_all()))
+        return -1;
+#endif
+
     /*
      * Must occur before EOS (or any QEMUFile operation)
      * because of RDMA protocol.
@@ -2627,6 +3242,11 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     RAMState **temp = opaque;
     RAMState *rs = *temp;
 
+#ifdef SMEMV
+    /* the page locations sent from here on stay good */
+    paging_migration_settle();
+#endif
+
     rcu_read_lock();
 
     if (!migration_in_postcopy()) {
@@ -2653,6 +3273,12 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     rcu_read_unlock();
 
+#ifdef SMEMV
+    /* pages must be on the sub-hosts before the destination faults */
+    if (migrate_type == MTYPE_1_TO_N && subhost_sync_all())
+        return -1;
+#endif
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
 #ifdef SMEMV
@@ -2660,6 +3286,8 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         rp_free(rp_dst);
 #endif
 	
+	printf("pages left on sub-hosts: %" PRIu64 "\n", subhost_kept);
+	printf("pages sent as digests: %" PRIu64 "\n", subhost_dedup);
 	printf("save time to main: %lu\n", save_to_main);
 	printf("save time to sub: %lu\n", save_to_sub);
 
@@ -16,9 +16,11 @@
 
 struct rp {
     in_addr_t hosts[MAX_HOST];  /* host id -> addr */
-    int sock[MAX_HOST];  /* socket for memory server */
+    int sock[MAX_HOST][RP_MAX_CHANNELS];  /* sockets for memory server */
     unsigned char *mem_loc;  /* host id for each memory page */
+    unsigned char *mem_replica;  /* host id of a second copy, or undef */
     unsigned long nr_pfns;  /* # of pages */
+    unsigned long host_pages[MAX_HOST];  /* # of pages by mem_loc */
     QemuMutex lock;  /* lock for hosts */
 };
 
@@ -26,7 +28,7 @@ struct rp {
 struct rp *rp_init(unsigned long mem_size)
 {
     struct rp *rp;
-    int i;
+    int i, j;
 
     rp = malloc(sizeof(struct rp));
     if (rp == NULL) {
@@ -43,16 +45,29 @@ struct rp *rp_init(unsigned long mem_size)
         return NULL;
     }
 
+    rp->mem_replica = (unsigned char *)malloc(rp->nr_pfns);
+    if (rp->mem_replica == NULL) {
+        printf("rp_init: cannot allocate mem_replica\n");
+        free(rp->mem_loc);
+        free(rp);
+        return NULL;
+    }
+
     /* initialized by RP_HID_UNDEF */
     memset(rp->mem_loc, RP_HID_UNDEF, rp->nr_pfns);
+    memset(rp->mem_replica, RP_HID_UNDEF, rp->nr_pfns);
+
+    memset(rp->host_pages, 0, sizeof(rp->host_pages));
 
     rp->hosts[RP_HID_MAIN] = RP_HOST_MAIN;
 
     for (i = 1; i < MAX_HOST; i++)
         rp->hosts[i] = RP_HOST_UNDEF;
 
-    for (i = 1; i < MAX_HOST; i++)
-        rp->sock[i] = -1;
+    for (i = 1; i < MAX_HOST; i++) {
+        for (j = 0; j < RP_MAX_CHANNELS; j++)
+            rp->sock[i][j] = -1;
+    }
 
     qemu_mutex_init(&rp->lock);
 
@@ -62,7 +77,7 @@ struct rp *rp_init(unsigned long mem_size)
 /* close all connection to sub-hosts */
 void rp_free(struct rp *rp)
 {
-    int i;
+    int i, j;
 
     if (rp == NULL) {
         printf("rp_free: rp is null\n");
@@ -70,8 +85,10 @@ void rp_free(struct rp *rp)
     }
 
     for (i = 1; i < MAX_HOST; i++) {
-        if (rp->sock[i] != -1)
-            close(rp->sock[i]);
+        for (j = 0; j < RP_MAX_CHANNELS; j++) {
+            if (rp->sock[i][j] != -1)
+                close(rp->sock[i][j]);
+        }
     }
 
     free(rp);
@@ -98,7 +115,39 @@ int rp_insert(struct rp *rp, unsigned long addr, unsigned int host_id)
         return -1;
     }
 
+    if (rp->mem_loc[pfn] != RP_HID_UNDEF)
+        rp->host_pages[rp->mem_loc[pfn]]--;
+    rp->host_pages[host_id]++;
+
+    /* a new home, any replica is out of date */
     rp->mem_loc[pfn] = host_id;
+    rp->mem_replica[pfn] = RP_HID_UNDEF;
+
+    return 0;
+}
+
+/* register a second host holding the page, after rp_insert() */
+int rp_insert_replica(struct rp *rp, unsigned long addr, unsigned int host_id)
+{
+    unsigned long pfn;
+
+    if (rp == NULL) {
+        printf("rp_insert_replica: rp is null\n");
+        return -1;
+    }
+
+    pfn = addr / PAGE_SIZE;
+    if (pfn >= rp->nr_pfns) {
+        printf("rp_insert_replica: too large address: %lx\n", addr);
+        return -1;
+    }
+
+    if (host_id >= MAX_HOST) {
+        printf("rp_insert_replica: invalid host id: %u\n", host_id);
+        return -1;
+    }
+
+    rp->mem_replica[pfn] = host_id;
 
     return 0;
 }
@@ -122,6 +171,25 @@ unsigned int rp_search(struct rp *rp, unsigned long addr)
     return rp->mem_loc[pfn];
 }
 
+/* addr -> host id of the replica, RP_HID_UNDEF if there is none */
+unsigned int rp_search_replica(struct rp *rp, unsigned long addr)
+{
+    unsigned long pfn;
+
+    if (rp == NULL) {
+        printf("rp_search_replica: rp is null\n");
+        return RP_HID_UNDEF;
+    }
+
+    pfn = addr / PAGE_SIZE;
+    if (pfn >= rp->nr_pfns) {
+        printf("rp_search_replica: too large address: %lx\n", addr);
+        return RP_HID_UNDEF;
+    }
+
+    return rp->mem_replica[pfn];
+}
+
 /* host addr -> host id */
 // XXX should use hash
 unsigned int rp_get_host_id(struct rp *rp, in_addr_t host)
@@ -231,36 +299,52 @@ int rp_is_host_undef(struct rp *rp, unsigned int host_id)
 
 /* set socket for a sub-host with host_id */
 int rp_set_host_sock(struct rp *rp, unsigned int host_id, int sock)
+{
+    return rp_set_host_chan_sock(rp, host_id, 0, sock);
+}
+
+/* return socket for a sub-host with host_id */
+int rp_get_host_sock(struct rp *rp, unsigned int host_id)
+{
+    return rp_get_host_chan_sock(rp, host_id, 0);
+}
+
+/* set socket of channel chan for a sub-host with host_id */
+int rp_set_host_chan_sock(struct rp *rp, unsigned int host_id,
+                          unsigned int chan, int sock)
 {
     if (rp == NULL) {
-        printf("rp_set_host_sock: rp is null\n");
+        printf("rp_set_host_chan_sock: rp is null\n");
         return -1;
     }
 
-    if (host_id >= MAX_HOST) {
-        printf("rp_set_host_sock: invalid host id: %u\n", host_id);
+    if (host_id >= MAX_HOST || chan >= RP_MAX_CHANNELS) {
+        printf("rp_set_host_chan_sock: invalid host id: %u/%u\n",
+               host_id, chan);
         return -1;
     }
 
-    rp->sock[host_id] = sock;
+    rp->sock[host_id][chan] = sock;
 
     return 0;
 }
 
-/* return socket for a sub-host with host_id */
-int rp_get_host_sock(struct rp *rp, unsigned int host_id)
+/* return socket of channel chan for a sub-host with host_id */
+int rp_get_host_chan_sock(struct rp *rp, unsigned int host_id,
+                          unsigned int chan)
 {
     if (rp == NULL) {
-        printf("rp_get_host_sock: rp is null\n");
+        printf("rp_get_host_chan_sock: rp is null\n");
         return -1;
     }
 
-    if (host_id >= MAX_HOST) {
-        printf("rp_get_host_sock: invalid host id: %u\n", host_id);
+    if (host_id >= MAX_HOST || chan >= RP_MAX_CHANNELS) {
+        printf("rp_get_host_chan_sock: invalid host id: %u/%u\n",
+               host_id, chan);
         return -1;
     }
 
-    return rp->sock[host_id];
+    return rp->sock[host_id][chan];
 }
 
 /* return memory size specified in rp_init() */
@@ -273,3 +357,17 @@ unsigned long rp_get_mem_size(struct rp *rp)
 
     return rp->nr_pfns * PAGE_SIZE;
 }
+
+/* # of pages whose first copy is on a host */
+unsigned long rp_get_host_pages(struct rp *rp, unsigned int host_id)
+{
+    if (rp == NULL) {
+        printf("rp_get_host_pages: rp is null\n");
+        return 0;
+    }
+
+    if (host_id >= MAX_HOST)
+        return 0;
+
+    return rp->host_pages[host_id];
+}
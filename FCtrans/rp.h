@@ -7,10 +7,15 @@ struct rp;
 #define RP_HID_MAIN 0
 #define RP_HID_UNDEF 255
 
+/* connections to the memory server of a host */
+#define RP_MAX_CHANNELS 8
+
 struct rp *rp_init(unsigned long mem_size);
 void rp_free(struct rp *rp);
 int rp_insert(struct rp *rp, unsigned long addr, unsigned int host_id);
 unsigned int rp_search(struct rp *rp, unsigned long addr);
+int rp_insert_replica(struct rp *rp, unsigned long addr, unsigned int host_id);
+unsigned int rp_search_replica(struct rp *rp, unsigned long addr);
 
 unsigned int rp_get_host_id(struct rp *rp, in_addr_t host);
 in_addr_t rp_get_host_addr(struct rp *rp, unsigned int host_id);
@@ -22,8 +27,13 @@ int rp_is_host_undef(struct rp *rp, unsigned int host_id);
 
 int rp_set_host_sock(struct rp *rp, unsigned int host_id, int sock);
 int rp_get_host_sock(struct rp *rp, unsigned int host_id);
+int rp_set_host_chan_sock(struct rp *rp, unsigned int host_id,
+                          unsigned int chan, int sock);
+int rp_get_host_chan_sock(struct rp *rp, unsigned int host_id,
+                          unsigned int chan);
 
 unsigned long rp_get_mem_size(struct rp *rp);
+unsigned long rp_get_host_pages(struct rp *rp, unsigned int host_id);
 
 #endif /* __RP_H_ */
 
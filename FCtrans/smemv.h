@@ -5,6 +5,12 @@
 
 #define CHUNK_PAGES 512  /* 2^9 pages = 2 MB*/
 
+/*
+ * connections to each sub-host: the first carries the page-in of
+ * faults, the others migration and page-out traffic
+ */
+#define SUBHOST_CHANNELS 3  /* up to RP_MAX_CHANNELS */
+
 #include <arpa/inet.h>
 
 struct rp;
@@ -18,6 +24,11 @@ extern unsigned long subhost_bytes;
 
 void get_vm_mem_size(void);
 void setup_paging(void);
+void paging_history_aged(void);
+void paging_migration_begin(void);
+void paging_migration_settle(void);
+void paging_migration_end(bool completed);
+void paging_drain(uint64_t rate);
 void split_chunk_lru8(unsigned char *history,
                       unsigned long total_pages, unsigned long main_pages,
                       unsigned long *sub_pages, int nr_subhosts);
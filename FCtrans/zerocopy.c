@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#include "qemu/osdep.h"
+#include "zerocopy.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+/* called once per socket, falls back to plain sends if unsupported */
+int zc_init(struct zc_sock *zc, int sock)
+{
+    int one = 1;
+
+    zc->sock = sock;
+    zc->next = 0;
+    zc->done = 0;
+    zc->enabled = 0;
+
+    if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one))) {
+        printf("zc_init: no zero-copy on socket %d\n", sock);
+        return -1;
+    }
+
+    zc->enabled = 1;
+
+    return 0;
+}
+
+/*
+ * sendmsg() with MSG_ZEROCOPY if enabled; a send that returns >= 0
+ * then takes the id zc->next - 1.
+ */
+ssize_t zc_sendmsg(struct zc_sock *zc, const struct msghdr *msg, int flags)
+{
+    ssize_t ret;
+
+    if (zc->enabled) {
+        ret = sendmsg(zc->sock, msg, flags | MSG_ZEROCOPY);
+        if (ret >= 0) {
+            zc->next++;
+            return ret;
+        }
+        /* out of optmem or locked pages, copy this one */
+        if (errno != ENOBUFS)
+            return ret;
+    }
+
+    return sendmsg(zc->sock, msg, flags);
+}
+
+/* read the completions on the error queue, returns -1 on error */
+int zc_reap(struct zc_sock *zc)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct sock_extended_err *serr;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    int n = 0;
+
+    while (zc->done != zc->next) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(zc->sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            perror("zc_reap: recvmsg");
+            return -1;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 ||
+                serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            /* ids [ee_info, ee_data] are completed, in order on TCP */
+            if ((int32_t)(serr->ee_data + 1 - zc->done) > 0)
+                zc->done = serr->ee_data + 1;
+
+            /* e.g. loopback: the kernel copied anyway, stop paying for it */
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zc->enabled = 0;
+
+            n++;
+        }
+    }
+
+    return n;
+}
+
+int zc_is_done(struct zc_sock *zc, uint32_t id)
+{
+    return (int32_t)(zc->done - id) > 0;
+}
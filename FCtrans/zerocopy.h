@@ -0,0 +1,21 @@
+#ifndef __ZEROCOPY_H_
+#define __ZEROCOPY_H_
+
+/*
+ * MSG_ZEROCOPY sends on a TCP socket.  The kernel sends straight from
+ * the user buffers, so a buffer must stay untouched until the
+ * notification with its id has been reaped from the error queue.
+ */
+struct zc_sock {
+    int sock;
+    int enabled;  /* SO_ZEROCOPY accepted and not falling back to copies */
+    uint32_t next;  /* id of the next zero-copy send */
+    uint32_t done;  /* all ids below are completed */
+};
+
+int zc_init(struct zc_sock *zc, int sock);
+ssize_t zc_sendmsg(struct zc_sock *zc, const struct msghdr *msg, int flags);
+int zc_reap(struct zc_sock *zc);
+int zc_is_done(struct zc_sock *zc, uint32_t id);
+
+#endif /* __ZEROCOPY_H_ */